@@ -4,6 +4,10 @@
 
 DEFINE_uint64(id, 0, "the server id");
 DEFINE_int32(numThreads, 0, "num threads");
+DEFINE_string(address_book, "res/peers.dat", "file of the known peers, dialed on start, empty to not keep them");
+DEFINE_int32(outbound, 8, "outbound sessions to keep");
+DEFINE_int32(max_inbound, 32, "inbound sessions above which the worst are evicted");
+DEFINE_bool(io_uring, false, "UDP transport on io_uring instead of the asio reactor (Linux)");
 
 int main(int argc, char *argv[])
 {
@@ -13,6 +17,13 @@ int main(int argc, char *argv[])
 	gflags::ParseCommandLineFlags(&argc, &argv, true);
 
 	P2pClouds::P2pCloudsApp app(FLAGS_id, FLAGS_numThreads);
+	app.setNetTransport(FLAGS_io_uring ? P2pClouds::NetTransportUring : P2pClouds::NetTransportReactor);
+	app.setAddressBookPath(FLAGS_address_book);
+
+	P2pClouds::ConnectionPolicy connectionPolicy;
+	connectionPolicy.targetOutbound = FLAGS_outbound;
+	connectionPolicy.maxInbound = FLAGS_max_inbound;
+	app.setConnectionPolicy(connectionPolicy);
 
 	try
 	{
@@ -8,43 +8,141 @@ namespace P2pClouds {
 
 	P2pCloudsApp::P2pCloudsApp(uint64_t id, int32_t numThreads)
 		: App(id, numThreads)
+		, addressBook_()
+		, addressBookPath_()
+		, connectionPolicy_()
+		, pConnectionManager_(NULL)
+		, peerTimer_(ioService_)
+		, lastBookSave_(0)
 	{
 	}
 
 	P2pCloudsApp::~P2pCloudsApp()
 	{
+		SAFE_RELEASE(pConnectionManager_);
 	}
 
 	bool P2pCloudsApp::initialize()
 	{
+		messageRegistry_.registerHandler<HelloMessage, P2pCloudsApp, &P2pCloudsApp::onHello>(this);
+
 		bool ret = App::initialize();
-		return ret;
+		if (!ret)
+			return false;
+
+		// The first dials go out in parallel right away.
+		lastBookSave_ = getMonotonicTime();
+		pConnectionManager_->update(lastBookSave_);
+
+		startPeerTimer();
+		return true;
+	}
+
+	void P2pCloudsApp::onNetworkInterfaceCreated()
+	{
+		if (!addressBookPath_.empty() && addressBook_.load(addressBookPath_))
+			LOG_INFO("P2pCloudsApp::onNetworkInterfaceCreated(): address book {}: {}", addressBookPath_, addressBook_.c_str());
+
+		pConnectionManager_ = new ConnectionManager(*pNetworkInterface_, addressBook_, connectionPolicy_);
 	}
 
 	bool P2pCloudsApp::finalise()
 	{
+		saveAddressBook();
 		return App::finalise();
 	}
 
+	void P2pCloudsApp::stop()
+	{
+		std::error_code ec;
+		peerTimer_.cancel(ec);
+
+		App::stop();
+	}
+
+	void P2pCloudsApp::saveAddressBook()
+	{
+		if (addressBookPath_.empty() || !addressBook_.dirty())
+			return;
+
+		addressBook_.save(addressBookPath_);
+	}
+
+	void P2pCloudsApp::startPeerTimer()
+	{
+		peerTimer_.expires_from_now(std::chrono::milliseconds(PEER_TICK));
+		peerTimer_.async_wait(std::bind(&P2pCloudsApp::handlePeerTimer, this, std::placeholders::_1));
+	}
+
+	void P2pCloudsApp::handlePeerTimer(const std::error_code& error)
+	{
+		if (error)
+			return;
+
+		uint64_t now = getMonotonicTime();
+		addressBook_.expireDials(now);
+		pConnectionManager_->update(now);
+
+		if (now - lastBookSave_ >= BOOK_SAVE_INTERVAL)
+		{
+			lastBookSave_ = now;
+			saveAddressBook();
+
+			LOG_INFO("P2pCloudsApp::handlePeerTimer(): {}, {}", pConnectionManager_->c_str(), addressBook_.c_str());
+		}
+
+		startPeerTimer();
+	}
+
 	bool P2pCloudsApp::run()
 	{
 		return App::run();
 	}
 
-	void P2pCloudsApp::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas)
+	void P2pCloudsApp::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel)
 	{
 		LOG_TRACE("netEventCallback: sessionID:{} type: {}", pSession->id(), netEventType2Str(event_type));
-		if (event_type == NetRcvMsg)
+
+		if (pConnectionManager_)
 		{
-			std::string msg;
-			(*pdatas) >> msg;
-			printf("----%s\n", msg.c_str());
+			if (event_type == NetConnect)
+				pConnectionManager_->onConnect(*pSession, getMonotonicTime());
+			else if (event_type == NetDisconnect)
+				pConnectionManager_->onDisconnect(*pSession);
+			else if (event_type == NetRcvMsg)
+				pConnectionManager_->onReceive(*pSession, pdatas->length());
+		}
 
+		App::netEventCallback(pSession, event_type, pdatas, channel);
 
+		if (event_type == NetConnect)
+		{
+			addressBook_.onConnect(pSession->endpoint());
+
+			// Once per session, each side tells the other its node ID.
+			HelloMessage hello;
+			hello.text = "hello";
+			hello.nodeID = id();
+			sendMessage(*pSession, hello);
+		}
+		else if (event_type == NetDisconnect)
+		{
+			addressBook_.onRtt(pSession->endpoint(), (uint32_t)std::max(pSession->rtt(), 0));
 		}
+	}
+
+	void P2pCloudsApp::onDispatchError(Session& session, MessageRegistry::DispatchResult result)
+	{
+		// Unknown opcodes may come from newer versions.
+		if (result == MessageRegistry::DISPATCH_MALFORMED && pConnectionManager_)
+			pConnectionManager_->onMisbehavior(session, MALFORMED_PENALTY, getMonotonicTime());
+	}
+
+	void P2pCloudsApp::onHello(Session& session, const HelloMessage& message)
+	{
+		LOG_DEBUG("P2pCloudsApp::onHello(): {}, nodeID={}. {}", message.text, message.nodeID, session.c_str());
 
-		ByteBuffer packet;
-		packet << "hello";
-		pSession->sendPacketKCP(packet);
+		addressBook_.onNodeID(session.endpoint(), message.nodeID);
+		addressBook_.onRtt(session.endpoint(), (uint32_t)std::max(session.rtt(), 0));
 	}
 }
@@ -1,12 +1,25 @@
 #pragma once
 
 #include "app/app.h"
+#include "app/messages.h"
+#include "app/address_book.h"
+#include "app/connection_manager.h"
 
 namespace P2pClouds {
 
+	/*
+		Remembers its peers in an AddressBook, its ConnectionManager dials the best scoring ones at once on
+		start instead of waiting to be found again, and keeps the set of peers fast afterwards.
+	*/
 	class P2pCloudsApp : public App
 	{
 	public:
+		enum {
+			PEER_TICK = 1000,				// ms between two updates of the peers
+			BOOK_SAVE_INTERVAL = 60000,		// ms
+			MALFORMED_PENALTY = 20			// misbehavior points of a message that could not be decoded
+		};
+
 		P2pCloudsApp(uint64_t id, int32_t numThreads);
 		virtual ~P2pCloudsApp();
 
@@ -14,9 +27,43 @@ namespace P2pClouds {
 		bool finalise() override;
 
 		bool run() override;
+		void stop() override;
+
+		// Set before initialize(), empty keeps the peers in memory only.
+		void setAddressBookPath(const std::string& path) {
+			addressBookPath_ = path;
+		}
+
+		// Set before initialize().
+		void setConnectionPolicy(const ConnectionPolicy& policy) {
+			connectionPolicy_ = policy;
+		}
 
 	protected:
-		void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas) override;
+		void onNetworkInterfaceCreated() override;
+
+		void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel) override;
+
+		void onDispatchError(Session& session, MessageRegistry::DispatchResult result) override;
+
+		void onHello(Session& session, const HelloMessage& message);
+
+		void saveAddressBook();
+
+		void startPeerTimer();
+		void handlePeerTimer(const std::error_code& error);
+
+	protected:
+		AddressBook addressBook_;
+		std::string addressBookPath_;
+
+		ConnectionPolicy connectionPolicy_;
+
+		// Created before the network starts, the events of all shards go to it from then on.
+		ConnectionManager* pConnectionManager_;
+
+		asio::steady_timer peerTimer_;
+		uint64_t lastBookSave_;
 	};
 
 }
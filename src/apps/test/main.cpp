@@ -5,6 +5,7 @@
 #include "common/arith_uint256.h"
 DEFINE_uint64(id, 0, "the server id");
 DEFINE_int32(numThreads, 0, "num threads");
+DEFINE_bool(io_uring, false, "UDP transport on io_uring instead of the asio reactor (Linux)");
 
 int main(int argc, char *argv[])
 {
@@ -14,6 +15,7 @@ int main(int argc, char *argv[])
 	gflags::ParseCommandLineFlags(&argc, &argv, true);
 
 	P2pClouds::TestApp app(FLAGS_id, FLAGS_numThreads);
+	app.setNetTransport(FLAGS_io_uring ? P2pClouds::NetTransportUring : P2pClouds::NetTransportReactor);
 
 	try
 	{
@@ -17,6 +17,8 @@ namespace P2pClouds {
 
 	bool TestApp::initialize()
 	{
+		messageRegistry_.registerHandler<HelloMessage, TestApp, &TestApp::onHello>(this);
+
 		bool ret = App::initialize();
 
 		for(int i=0; i<64; i++)
@@ -27,8 +29,8 @@ namespace P2pClouds {
 
 	bool TestApp::initNetworkInterfaces()
 	{
-		pNetworkInterface_ = new NetworkInterface(ioService_, "127.0.0.1", LISTEN_PORT + 1);
-		pNetworkInterface_->setEventCallback(std::bind(&TestApp::netEventCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+		pNetworkInterface_ = new NetworkInterface(ioService_, "127.0.0.1", LISTEN_PORT + 1, numThreads(), netTransport_);
+		pNetworkInterface_->setEventCallback(std::bind(&TestApp::netEventCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
 		return pNetworkInterface_->initialize();
 	}
 
@@ -44,21 +46,21 @@ namespace P2pClouds {
 		return App::run();
 	}
 
-	void TestApp::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas) 
+	void TestApp::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel) 
 	{
 		LOG_TRACE("netEventCallback: sessionID:{} type: {}", pSession->id(), netEventType2Str(event_type));
-		if (event_type == NetRcvMsg)
-		{
-			std::string msg;
-			(*pdatas) >> msg;
-			static int i = 0;
-			printf("----%s-%d\n", msg.c_str(), i++);
+		App::netEventCallback(pSession, event_type, pdatas, channel);
 
-		}
+		HelloMessage hello;
+		hello.text = "hello";
+		hello.nodeID = id();
+		sendMessage(*pSession, hello);
+	}
 
-		ByteBuffer packet;
-		packet << "hello";
-		pSession->sendPacketKCP(packet);
+	void TestApp::onHello(Session& /*session*/, const HelloMessage& message)
+	{
+		static int i = 0;
+		printf("----%s-%d\n", message.text.c_str(), i++);
 	}
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "app/app.h"
+#include "app/messages.h"
 
 namespace P2pClouds {
 
@@ -18,7 +19,9 @@ namespace P2pClouds {
 		bool run() override;
 
 	protected:
-		void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas) override;
+		void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel) override;
+
+		void onHello(Session& session, const HelloMessage& message);
 	};
 
 }
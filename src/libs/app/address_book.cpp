@@ -0,0 +1,371 @@
+#include "address_book.h"
+#include "log/log.h"
+
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX
+#include <sys/mman.h>
+#endif
+
+namespace P2pClouds {
+
+	namespace {
+
+		template<typename T>
+		T readField(const uint8_t* pDatas)
+		{
+			T value;
+			memcpy(&value, pDatas, sizeof(value));
+			EndianConvert(value);
+			return value;
+		}
+	}
+
+	AddressBook::AddressBook(size_t maxPeers)
+		: mutex_()
+		, entries_()
+		, maxPeers_(maxPeers)
+		, dirty_(false)
+	{
+	}
+
+	AddressBook::~AddressBook()
+	{
+	}
+
+	bool AddressBook::load(const std::string& path)
+	{
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size < HEADER_SIZE)
+		{
+			::close(fd);
+			return false;
+		}
+
+		size_t size = (size_t)st.st_size;
+		void* pMap = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+
+		if (pMap == MAP_FAILED)
+		{
+			LOG_ERROR("AddressBook::load(): mmap {} failed! errno={}", path, errno);
+			return false;
+		}
+
+		bool ret = parse((const uint8_t*)pMap, size);
+		munmap(pMap, size);
+#else
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return false;
+
+		std::vector<uint8_t> datas((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		bool ret = parse(datas.data(), datas.size());
+#endif
+
+		if (!ret)
+			LOG_ERROR("AddressBook::load(): {} is damaged!", path);
+
+		return ret;
+	}
+
+	bool AddressBook::parse(const uint8_t* pDatas, size_t size)
+	{
+		if (size < HEADER_SIZE || readField<uint32_t>(pDatas) != FILE_MAGIC || readField<uint16_t>(pDatas + 4) != FILE_VERSION)
+			return false;
+
+		// Records may grow at their end, the fields known here are at the same offsets.
+		size_t recordSize = readField<uint16_t>(pDatas + 6);
+		size_t count = readField<uint32_t>(pDatas + 8);
+
+		if (recordSize < RECORD_SIZE || count > (size - HEADER_SIZE) / recordSize)
+			return false;
+
+		std::lock_guard<std::mutex> lg(mutex_);
+		entries_.clear();
+
+		// Saved best first, a smaller book keeps the best.
+		for (size_t i = 0; i < count && entries_.size() < maxPeers_; ++i)
+		{
+			Entry entry;
+			entry.dialTime = 0;
+
+			if (readRecord(pDatas + HEADER_SIZE + i * recordSize, entry.address))
+				entries_[entry.address.endpoint] = entry;
+		}
+
+		dirty_ = false;
+		return true;
+	}
+
+	bool AddressBook::save(const std::string& path)
+	{
+		ByteBuffer datas;
+
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+
+			std::vector<PeerAddress> peers;
+			sortedPeers(peers);
+
+			datas << (uint32_t)FILE_MAGIC << (uint16_t)FILE_VERSION << (uint16_t)RECORD_SIZE << (uint32_t)peers.size() << (uint32_t)0;
+
+			for (const PeerAddress& peer : peers)
+				writeRecord(datas, peer);
+
+			dirty_ = false;
+		}
+
+		// Written aside first, a crash while writing leaves the old file.
+		std::string tmpPath = path + ".tmp";
+
+		bool ret = false;
+
+		{
+			std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+			if (file)
+			{
+				file.write((const char*)datas.data(), datas.length());
+				file.close();
+				ret = !file.fail();
+			}
+		}
+
+#if P2PCLOUDS_PLATFORM == PLATFORM_WIN32
+		// rename() does not replace an existing file here.
+		if (ret)
+			std::remove(path.c_str());
+#endif
+
+		if (ret)
+			ret = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+
+		if (!ret)
+		{
+			LOG_ERROR("AddressBook::save(): writing {} failed!", path);
+
+			std::lock_guard<std::mutex> lg(mutex_);
+			dirty_ = true;
+		}
+
+		return ret;
+	}
+
+	AddressBook::Entry& AddressBook::entry(const asio::ip::udp::endpoint& endpoint)
+	{
+		std::map<asio::ip::udp::endpoint, Entry>::iterator it = entries_.find(endpoint);
+		if (it != entries_.end())
+			return it->second;
+
+		if (entries_.size() >= maxPeers_)
+			evict();
+
+		Entry& entry = entries_[endpoint];
+		entry.address.endpoint = endpoint;
+		entry.address.nodeID = 0;
+		entry.address.lastSeen = 0;
+		entry.address.rtt = 0;
+		entry.address.successes = 0;
+		entry.address.failures = 0;
+		entry.dialTime = 0;
+		return entry;
+	}
+
+	void AddressBook::evict()
+	{
+		uint64_t nowSeconds = getSysTime();
+
+		std::map<asio::ip::udp::endpoint, Entry>::iterator worst = entries_.end();
+		double worstScore = 0.0;
+
+		for (std::map<asio::ip::udp::endpoint, Entry>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+		{
+			double s = score(it->second.address, nowSeconds);
+			if (worst == entries_.end() || s < worstScore)
+			{
+				worst = it;
+				worstScore = s;
+			}
+		}
+
+		if (worst != entries_.end())
+			entries_.erase(worst);
+	}
+
+	void AddressBook::onDial(const asio::ip::udp::endpoint& endpoint, uint64_t now)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		entry(endpoint).dialTime = now;
+	}
+
+	void AddressBook::onConnect(const asio::ip::udp::endpoint& endpoint)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		Entry& e = entry(endpoint);
+		e.dialTime = 0;
+		e.address.lastSeen = getSysTime();
+		++e.address.successes;
+		dirty_ = true;
+	}
+
+	void AddressBook::onNodeID(const asio::ip::udp::endpoint& endpoint, uint64_t nodeID)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		std::map<asio::ip::udp::endpoint, Entry>::iterator it = entries_.find(endpoint);
+		if (it == entries_.end() || it->second.address.nodeID == nodeID)
+			return;
+
+		it->second.address.nodeID = nodeID;
+		dirty_ = true;
+	}
+
+	void AddressBook::onRtt(const asio::ip::udp::endpoint& endpoint, uint32_t rtt)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		std::map<asio::ip::udp::endpoint, Entry>::iterator it = entries_.find(endpoint);
+		if (it == entries_.end() || rtt == 0)
+			return;
+
+		it->second.address.rtt = rtt;
+		dirty_ = true;
+	}
+
+	void AddressBook::expireDials(uint64_t now)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		for (std::pair<const asio::ip::udp::endpoint, Entry>& item : entries_)
+		{
+			Entry& e = item.second;
+			if (e.dialTime == 0 || now - e.dialTime < DIAL_TIMEOUT)
+				continue;
+
+			e.dialTime = 0;
+			++e.address.failures;
+			dirty_ = true;
+		}
+	}
+
+	void AddressBook::bestPeers(size_t count, std::vector<PeerAddress>& peers) const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		sortedPeers(peers);
+
+		if (peers.size() > count)
+			peers.resize(count);
+	}
+
+	void AddressBook::sortedPeers(std::vector<PeerAddress>& peers) const
+	{
+		uint64_t nowSeconds = getSysTime();
+
+		std::vector<std::pair<double, const PeerAddress*> > scored;
+		scored.reserve(entries_.size());
+
+		for (const std::pair<const asio::ip::udp::endpoint, Entry>& item : entries_)
+			scored.push_back(std::make_pair(score(item.second.address, nowSeconds), &item.second.address));
+
+		std::sort(scored.begin(), scored.end(),
+			[](const std::pair<double, const PeerAddress*>& a, const std::pair<double, const PeerAddress*>& b) { return a.first > b.first; });
+
+		peers.clear();
+		peers.reserve(scored.size());
+
+		for (const std::pair<double, const PeerAddress*>& item : scored)
+			peers.push_back(*item.second);
+	}
+
+	double AddressBook::score(const PeerAddress& peer, uint64_t nowSeconds)
+	{
+		// Laplace smoothed, a new peer starts at 0.5.
+		double successRate = (peer.successes + 1.0) / (peer.successes + peer.failures + 2.0);
+
+		// Halves after a day without a connect.
+		double days = nowSeconds > peer.lastSeen ? (nowSeconds - peer.lastSeen) / 86400.0 : 0.0;
+		double recency = 1.0 / (1.0 + days);
+
+		// Unmeasured peers are taken as 200ms away.
+		double latency = 100.0 / (100.0 + (peer.rtt > 0 ? peer.rtt : 200));
+
+		return successRate * recency * latency;
+	}
+
+	size_t AddressBook::size() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return entries_.size();
+	}
+
+	bool AddressBook::dirty() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return dirty_;
+	}
+
+	std::string AddressBook::c_str() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return fmt::format("peers={}, dirty={}", entries_.size(), dirty_);
+	}
+
+	void AddressBook::writeRecord(ByteBuffer& datas, const PeerAddress& peer)
+	{
+		// family(1) reserved(1) port(2) address(16) nodeID(8) lastSeen(8) rtt(4) successes(4) failures(4)
+		uint8_t address[16] = { 0 };
+		uint8_t family = 4;
+
+		if (peer.endpoint.address().is_v6())
+		{
+			asio::ip::address_v6::bytes_type bytes = peer.endpoint.address().to_v6().to_bytes();
+			memcpy(address, bytes.data(), bytes.size());
+			family = 6;
+		}
+		else
+		{
+			asio::ip::address_v4::bytes_type bytes = peer.endpoint.address().to_v4().to_bytes();
+			memcpy(address, bytes.data(), bytes.size());
+		}
+
+		datas << family << (uint8_t)0 << (uint16_t)peer.endpoint.port();
+		datas.append(address, sizeof(address));
+		datas << peer.nodeID << peer.lastSeen << peer.rtt << peer.successes << peer.failures;
+	}
+
+	bool AddressBook::readRecord(const uint8_t* pRecord, PeerAddress& peer)
+	{
+		uint8_t family = pRecord[0];
+		uint16_t port = readField<uint16_t>(pRecord + 2);
+
+		if (family == 6)
+		{
+			asio::ip::address_v6::bytes_type bytes;
+			memcpy(bytes.data(), pRecord + 4, bytes.size());
+			peer.endpoint = asio::ip::udp::endpoint(asio::ip::address_v6(bytes), port);
+		}
+		else if (family == 4)
+		{
+			asio::ip::address_v4::bytes_type bytes;
+			memcpy(bytes.data(), pRecord + 4, bytes.size());
+			peer.endpoint = asio::ip::udp::endpoint(asio::ip::address_v4(bytes), port);
+		}
+		else
+		{
+			return false;
+		}
+
+		peer.nodeID = readField<uint64_t>(pRecord + 20);
+		peer.lastSeen = readField<uint64_t>(pRecord + 28);
+		peer.rtt = readField<uint32_t>(pRecord + 36);
+		peer.successes = readField<uint32_t>(pRecord + 40);
+		peer.failures = readField<uint32_t>(pRecord + 44);
+		return port != 0;
+	}
+
+}
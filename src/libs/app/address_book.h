@@ -0,0 +1,95 @@
+#pragma once
+
+#include "common/common.h"
+#include "common/byte_buffer.h"
+
+namespace P2pClouds {
+
+	struct PeerAddress
+	{
+		asio::ip::udp::endpoint endpoint;
+		uint64_t nodeID;			// 0 until its hello arrived
+		uint64_t lastSeen;			// unix seconds of the last connect
+		uint32_t rtt;				// ms, 0 if never measured
+		uint32_t successes;
+		uint32_t failures;			// dials that did not connect within DIAL_TIMEOUT
+	};
+
+	/*
+		Peers this node was connected to, kept across restarts so that a restarted node dials the peers that
+		answered quickly and reliably before instead of rediscovering the network.
+
+		The file is a 16 byte header followed by fixed size little endian records, it is memory mapped on load
+		and written to a temporary file that replaces the old one, a crash while saving leaves the old one.
+
+		Locked, the network events of all shards update it.
+	*/
+	class AddressBook
+	{
+	public:
+		enum {
+			MAX_PEERS = 1024,
+			DIAL_TIMEOUT = 5000,		// ms
+			FILE_MAGIC = 0x42503250,	// "P2PB"
+			FILE_VERSION = 1,
+			HEADER_SIZE = 16,
+			RECORD_SIZE = 48
+		};
+
+		AddressBook(size_t maxPeers = MAX_PEERS);
+		virtual ~AddressBook();
+
+		// Replaces the peers by the ones in the file, false if it is missing or damaged.
+		bool load(const std::string& path);
+		bool save(const std::string& path);
+
+		// now is getMonotonicTime().
+		void onDial(const asio::ip::udp::endpoint& endpoint, uint64_t now);
+		void onConnect(const asio::ip::udp::endpoint& endpoint);
+		void onNodeID(const asio::ip::udp::endpoint& endpoint, uint64_t nodeID);
+		void onRtt(const asio::ip::udp::endpoint& endpoint, uint32_t rtt);
+
+		// Counts dials older than DIAL_TIMEOUT as failures.
+		void expireDials(uint64_t now);
+
+		// Best scoring peers first.
+		void bestPeers(size_t count, std::vector<PeerAddress>& peers) const;
+
+		// Higher is better: the success rate, discounted by the age of the last connect and by the RTT.
+		static double score(const PeerAddress& peer, uint64_t nowSeconds);
+
+		size_t size() const;
+
+		// Changed since the last load() or save().
+		bool dirty() const;
+
+		std::string c_str() const;
+
+	protected:
+		struct Entry
+		{
+			PeerAddress address;
+			uint64_t dialTime;			// 0 if no dial is pending
+		};
+
+		Entry& entry(const asio::ip::udp::endpoint& endpoint);
+
+		// Drops the worst scoring peer, a pending dial of it is forgotten.
+		void evict();
+
+		// Peers in the order they are saved, best first. Called locked.
+		void sortedPeers(std::vector<PeerAddress>& peers) const;
+
+		bool parse(const uint8_t* pDatas, size_t size);
+
+		static void writeRecord(ByteBuffer& datas, const PeerAddress& peer);
+		static bool readRecord(const uint8_t* pRecord, PeerAddress& peer);
+
+	protected:
+		mutable std::mutex mutex_;
+		std::map<asio::ip::udp::endpoint, Entry> entries_;
+		size_t maxPeers_;
+		bool dirty_;
+	};
+
+}
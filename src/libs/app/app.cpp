@@ -5,10 +5,12 @@ namespace P2pClouds {
 
 	App::App(uint64_t id, int32_t numThreads)
 		: pNetworkInterface_(NULL)
+		, messageRegistry_()
 		, ioService_()
 		, signals_(ioService_)
         , id_(id)
         , numThreads_(numThreads)
+		, netTransport_(NetTransportReactor)
 	{
 		doAwaitStop();
 	}
@@ -36,7 +38,7 @@ namespace P2pClouds {
 			// The server is stopped by cancelling all outstanding asynchronous
 			// operations. Once all operations have finished the io_service::run()
 			// call will exit.
-			pNetworkInterface_->stopAll();
+			stop();
 		});
 	}
 
@@ -47,8 +49,9 @@ namespace P2pClouds {
 
 	bool App::initNetworkInterfaces()
 	{
-		pNetworkInterface_ = new NetworkInterface(ioService_, "127.0.0.1", 27776);
-		pNetworkInterface_->setEventCallback(std::bind(&App::netEventCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
+		pNetworkInterface_ = new NetworkInterface(ioService_, "127.0.0.1", 27776, numThreads_, netTransport_);
+		pNetworkInterface_->setEventCallback(std::bind(&App::netEventCallback, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+		onNetworkInterfaceCreated();
 		return pNetworkInterface_->initialize();
 	}
 
@@ -60,17 +63,33 @@ namespace P2pClouds {
 		return true;
 	}
 
+	void App::stop()
+	{
+		if (pNetworkInterface_)
+			pNetworkInterface_->stopAll();
+	}
+
 	bool App::run()
 	{
 		// The io_service::run() call will block until all asynchronous operations
 		// have finished. While the server is running, there is always at least one
 		// asynchronous operation outstanding: the asynchronous accept call waiting
 		// for new incoming connections.
+		// With numThreads > 1 the other network shards run on threads owned by the NetworkInterface.
 		ioService_.run();
 		return true;
 	}
 
-	void App::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas)
+	void App::netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel /*channel*/)
 	{
+		if (event_type == NetRcvMsg)
+		{
+			while (pdatas->length() > 0)
+			{
+				MessageRegistry::DispatchResult result = messageRegistry_.dispatch(*pSession, *pdatas);
+				if (result != MessageRegistry::DISPATCH_OK)
+					onDispatchError(*pSession, result);
+			}
+		}
 	}
 }
@@ -2,6 +2,7 @@
 
 #include "common/common.h"
 #include "network/common.h"
+#include "network/message.h"
 
 namespace P2pClouds {
 
@@ -20,6 +21,9 @@ namespace P2pClouds {
 
 		virtual bool run();
 
+		// Stops the network, run() returns once nothing else keeps the io_service busy.
+		virtual void stop();
+
         uint64_t id() const {
             return id_;
         }
@@ -28,15 +32,33 @@ namespace P2pClouds {
         {
             return numThreads_;
         }
+
+		// Set before initialize().
+		void setNetTransport(NetTransport transport) {
+			netTransport_ = transport;
+		}
         
 	protected:
 		// Wait for a request to stop the server.
 		virtual void doAwaitStop();
 
-		virtual void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas);
+		// Hands received messages to messageRegistry_.
+		virtual void netEventCallback(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel);
+
+		// pNetworkInterface_ is created but not started yet, what its callbacks use is set up here. They come from the
+		// threads of all shards as soon as it starts.
+		virtual void onNetworkInterfaceCreated() {
+		}
+
+		// A received message had no handler or could not be decoded, on the thread of the session.
+		virtual void onDispatchError(Session& /*session*/, MessageRegistry::DispatchResult /*result*/) {
+		}
 
 	protected:
 		NetworkInterface* pNetworkInterface_;
+
+		// Filled by the apps before the network starts, read only afterwards since callbacks come from all shards.
+		MessageRegistry messageRegistry_;
 		asio::io_service ioService_;
 
 		// The signal_set is used to register for process termination notifications.
@@ -44,6 +66,7 @@ namespace P2pClouds {
         
         uint64_t id_;
         int32_t numThreads_;
+		NetTransport netTransport_;
 	};
 
 }
@@ -0,0 +1,350 @@
+#include "connection_manager.h"
+#include "network/network_interface.h"
+#include "network/session.h"
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	ConnectionManager::ConnectionManager(NetworkInterface& networkInterface, AddressBook& addressBook, const ConnectionPolicy& policy)
+		: networkInterface_(networkInterface)
+		, addressBook_(addressBook)
+		, policy_(policy)
+		, mutex_()
+		, peers_()
+		, dials_()
+		, bans_()
+		, cooldowns_()
+		, lastUpdate_(0)
+		, lastRotate_(0)
+		, rotations_(0)
+		, evictions_(0)
+		, numBans_(0)
+	{
+	}
+
+	ConnectionManager::~ConnectionManager()
+	{
+	}
+
+	uint64_t ConnectionManager::groupOf(const asio::ip::address& address)
+	{
+		if (address.is_v6())
+		{
+			asio::ip::address_v6 v6 = address.to_v6();
+			if (v6.is_v4_mapped())
+				return groupOf(v6.to_v4());
+
+			asio::ip::address_v6::bytes_type bytes = v6.to_bytes();
+
+			// Loopback, link local and unique local (fc00::/7).
+			if (v6.is_loopback() || v6.is_link_local() || (bytes[0] & 0xfe) == 0xfc)
+				return LOCAL_GROUP;
+
+			// Kept apart from the IPv4 groups.
+			return (1ull << 32) | ((uint64_t)bytes[0] << 24) | ((uint64_t)bytes[1] << 16) | ((uint64_t)bytes[2] << 8) | bytes[3];
+		}
+
+		asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
+
+		// Loopback, RFC 1918 and link local.
+		if (bytes[0] == 127 || bytes[0] == 10 || (bytes[0] == 172 && (bytes[1] & 0xf0) == 16) ||
+			(bytes[0] == 192 && bytes[1] == 168) || (bytes[0] == 169 && bytes[1] == 254))
+			return LOCAL_GROUP;
+
+		return ((uint64_t)bytes[0] << 8) | bytes[1];
+	}
+
+	void ConnectionManager::onConnect(Session& session, uint64_t now)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		Peer peer;
+		peer.sessionID = session.id();
+		peer.endpoint = session.endpoint();
+		peer.outbound = dials_.erase(session.endpoint()) > 0;
+		peer.group = groupOf(session.endpoint().address());
+		peer.connectTime = now;
+		peer.rtt = 0;
+		peer.bytes = 0;
+		peer.throughput = 0.0;
+		peer.misbehavior = 0;
+
+		std::map<asio::ip::address, uint64_t>::iterator ban = bans_.find(peer.endpoint.address());
+		peer.drop = ban != bans_.end() && now < ban->second;
+
+		peers_[peer.sessionID] = peer;
+	}
+
+	void ConnectionManager::onDisconnect(Session& session)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		peers_.erase(session.id());
+	}
+
+	void ConnectionManager::onReceive(Session& session, size_t bytes)
+	{
+		int32_t rtt = session.rtt();
+
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		std::map<SessionID, Peer>::iterator it = peers_.find(session.id());
+		if (it == peers_.end())
+			return;
+
+		it->second.bytes += bytes;
+
+		if (rtt > 0)
+			it->second.rtt = (uint32_t)rtt;
+	}
+
+	void ConnectionManager::onMisbehavior(Session& session, uint32_t points, uint64_t now)
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		std::map<SessionID, Peer>::iterator it = peers_.find(session.id());
+		if (it == peers_.end() || it->second.drop)
+			return;
+
+		Peer& peer = it->second;
+		peer.misbehavior += points;
+
+		if (peer.misbehavior < policy_.banScore)
+			return;
+
+		LOG_WARNING("ConnectionManager::onMisbehavior(): banning {}, misbehavior={}", peer.endpoint.address().to_string(), peer.misbehavior);
+
+		peer.drop = true;
+		bans_[peer.endpoint.address()] = now + policy_.banTime;
+		++numBans_;
+	}
+
+	double ConnectionManager::score(const Peer& peer) const
+	{
+		double latency = 100.0 / (100.0 + (peer.rtt > 0 ? peer.rtt : (uint32_t)RTT_UNMEASURED));
+
+		// Up to twice the score for a peer that keeps sending, blocks come from those.
+		double throughput = 1.0 + peer.throughput / (peer.throughput + THROUGHPUT_REF);
+
+		return latency * throughput / (1.0 + peer.misbehavior / 10.0);
+	}
+
+	size_t ConnectionManager::countPeers(bool outbound) const
+	{
+		size_t count = 0;
+
+		for (const std::pair<const SessionID, Peer>& item : peers_)
+		{
+			if (item.second.outbound == outbound && !item.second.drop)
+				++count;
+		}
+
+		return count;
+	}
+
+	ConnectionManager::Peer* ConnectionManager::worstPeer(bool outbound, uint64_t now)
+	{
+		Peer* pWorst = NULL;
+		double worstScore = 0.0;
+
+		for (std::pair<const SessionID, Peer>& item : peers_)
+		{
+			Peer& peer = item.second;
+			if (peer.outbound != outbound || peer.drop || now - peer.connectTime < policy_.minAge)
+				continue;
+
+			double s = score(peer);
+			if (!pWorst || s < worstScore)
+			{
+				pWorst = &peer;
+				worstScore = s;
+			}
+		}
+
+		return pWorst;
+	}
+
+	void ConnectionManager::pickCandidates(size_t count, uint64_t now, std::vector<asio::ip::udp::endpoint>& candidates)
+	{
+		if (count == 0)
+			return;
+
+		std::set<asio::ip::udp::endpoint> busy;
+		std::map<uint64_t, uint32_t> groups;
+
+		for (const std::pair<const SessionID, Peer>& item : peers_)
+		{
+			busy.insert(item.second.endpoint);
+
+			if (item.second.outbound && !item.second.drop)
+				++groups[item.second.group];
+		}
+
+		for (const std::pair<const asio::ip::udp::endpoint, uint64_t>& dial : dials_)
+		{
+			busy.insert(dial.first);
+			++groups[groupOf(dial.first.address())];
+		}
+
+		for (const asio::ip::udp::endpoint& candidate : candidates)
+		{
+			busy.insert(candidate);
+			++groups[groupOf(candidate.address())];
+		}
+
+		std::vector<PeerAddress> peers;
+		addressBook_.bestPeers(AddressBook::MAX_PEERS, peers);
+
+		for (const PeerAddress& peer : peers)
+		{
+			if (busy.find(peer.endpoint) != busy.end())
+				continue;
+
+			std::map<asio::ip::address, uint64_t>::iterator ban = bans_.find(peer.endpoint.address());
+			if (ban != bans_.end() && now < ban->second)
+				continue;
+
+			std::map<asio::ip::udp::endpoint, uint64_t>::iterator cooldown = cooldowns_.find(peer.endpoint);
+			if (cooldown != cooldowns_.end() && now < cooldown->second)
+				continue;
+
+			uint64_t group = groupOf(peer.endpoint.address());
+			uint32_t& inGroup = groups[group];
+			if (group != LOCAL_GROUP && inGroup >= policy_.maxPerGroup)
+				continue;
+
+			++inGroup;
+			candidates.push_back(peer.endpoint);
+
+			if (--count == 0)
+				break;
+		}
+	}
+
+	void ConnectionManager::update(uint64_t now)
+	{
+		std::vector<SessionID> drops;
+		std::vector<asio::ip::udp::endpoint> dials;
+
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+
+			uint64_t elapsed = lastUpdate_ > 0 ? now - lastUpdate_ : 0;
+			lastUpdate_ = now;
+
+			if (elapsed > 0)
+			{
+				for (std::pair<const SessionID, Peer>& item : peers_)
+				{
+					Peer& peer = item.second;
+					peer.throughput = 0.75 * peer.throughput + 0.25 * (peer.bytes * 1000.0 / elapsed);
+					peer.bytes = 0;
+				}
+			}
+
+			for (std::map<asio::ip::udp::endpoint, uint64_t>::iterator it = dials_.begin(); it != dials_.end(); )
+			{
+				if (now - it->second >= AddressBook::DIAL_TIMEOUT)
+					it = dials_.erase(it);
+				else
+					++it;
+			}
+
+			for (std::map<asio::ip::address, uint64_t>::iterator it = bans_.begin(); it != bans_.end(); )
+			{
+				if (now >= it->second)
+					it = bans_.erase(it);
+				else
+					++it;
+			}
+
+			for (std::map<asio::ip::udp::endpoint, uint64_t>::iterator it = cooldowns_.begin(); it != cooldowns_.end(); )
+			{
+				if (now >= it->second)
+					it = cooldowns_.erase(it);
+				else
+					++it;
+			}
+
+			// The newest inbound sessions are spared for minAge, a flood of them evicts each other.
+			while (countPeers(false) > policy_.maxInbound)
+			{
+				Peer* pWorst = worstPeer(false, now);
+				if (!pWorst)
+				{
+					for (std::pair<const SessionID, Peer>& item : peers_)
+					{
+						if (!item.second.outbound && !item.second.drop && (!pWorst || item.second.connectTime > pWorst->connectTime))
+							pWorst = &item.second;
+					}
+				}
+
+				pWorst->drop = true;
+				cooldowns_[pWorst->endpoint] = now + policy_.rotateInterval;
+				++evictions_;
+			}
+
+			// Only when there is a peer to try instead.
+			if (policy_.rotateInterval > 0 && now - lastRotate_ >= policy_.rotateInterval && countPeers(true) >= policy_.targetOutbound)
+			{
+				lastRotate_ = now;
+
+				std::vector<asio::ip::udp::endpoint> spare;
+				pickCandidates(1, now, spare);
+
+				Peer* pWorst = worstPeer(true, now);
+				if (pWorst && !spare.empty())
+				{
+					LOG_INFO("ConnectionManager::update(): rotating out {}:{}, rtt={}, throughput={:.0f}",
+						pWorst->endpoint.address().to_string(), pWorst->endpoint.port(), pWorst->rtt, pWorst->throughput);
+
+					pWorst->drop = true;
+					cooldowns_[pWorst->endpoint] = now + policy_.rotateInterval;
+					++rotations_;
+				}
+			}
+
+			for (const std::pair<const SessionID, Peer>& item : peers_)
+			{
+				if (item.second.drop)
+					drops.push_back(item.first);
+			}
+
+			size_t outbound = countPeers(true) + dials_.size();
+			if (outbound < policy_.targetOutbound)
+				pickCandidates(policy_.targetOutbound - outbound, now, dials);
+
+			for (const asio::ip::udp::endpoint& endpoint : dials)
+				dials_[endpoint] = now;
+		}
+
+		// Unlocked, a disconnect on this thread calls back into onDisconnect().
+		for (SessionID sessionID : drops)
+			networkInterface_.disconnect(sessionID);
+
+		for (const asio::ip::udp::endpoint& endpoint : dials)
+		{
+			addressBook_.onDial(endpoint, now);
+			networkInterface_.connect(endpoint.address().to_string(), endpoint.port());
+		}
+	}
+
+	size_t ConnectionManager::numOutbound() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return countPeers(true);
+	}
+
+	size_t ConnectionManager::numInbound() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return countPeers(false);
+	}
+
+	std::string ConnectionManager::c_str() const
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+		return fmt::format("outbound={}, inbound={}, dials={}, rotations={}, evictions={}, bans={}",
+			countPeers(true), countPeers(false), dials_.size(), rotations_, evictions_, numBans_);
+	}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "common/common.h"
+#include "network/common.h"
+#include "address_book.h"
+
+namespace P2pClouds {
+
+	class NetworkInterface;
+	class Session;
+
+	// Targets and limits of ConnectionManager.
+	struct ConnectionPolicy
+	{
+		ConnectionPolicy()
+			: targetOutbound(8)
+			, maxInbound(32)
+			, maxPerGroup(2)
+			, rotateInterval(10 * 60 * 1000)
+			, minAge(60 * 1000)
+			, banScore(100)
+			, banTime(24 * 3600 * 1000)
+		{
+		}
+
+		uint32_t targetOutbound;		// sessions this node dials and keeps
+		uint32_t maxInbound;
+
+		uint32_t maxPerGroup;			// outbound sessions and dials per network group (see groupOf), not for LOCAL_GROUP
+
+		uint32_t rotateInterval;		// ms between two rotations of the worst outbound peer, 0 never
+		uint32_t minAge;				// ms a session is kept before it may be rotated or evicted
+
+		uint32_t banScore;				// misbehavior points that disconnect and ban the address of a peer
+		uint32_t banTime;				// ms
+	};
+
+	/*
+		Decides which peers a node keeps.
+
+		Dials the best scoring peers of the AddressBook until targetOutbound sessions are open, at most maxPerGroup
+		of them in one network group so an attacker or a single provider can not hold all of them. Peers are
+		scored by RTT and throughput and lose score for misbehavior. Every rotateInterval the worst outbound
+		peer is dropped for the best one not connected yet, so the set drifts towards fast peers. Inbound
+		sessions above maxInbound are evicted worst first.
+
+		The events come from all shards and are only recorded, sessions are dropped and dialed by update()
+		on the thread of the primary.
+	*/
+	class ConnectionManager
+	{
+	public:
+		enum {
+			LOCAL_GROUP = 0,
+			RTT_UNMEASURED = 200,			// ms assumed before the first ack
+			THROUGHPUT_REF = 64 * 1024		// bytes/s that count half of the throughput bonus
+		};
+
+		ConnectionManager(NetworkInterface& networkInterface, AddressBook& addressBook, const ConnectionPolicy& policy = ConnectionPolicy());
+		virtual ~ConnectionManager();
+
+		void onConnect(Session& session, uint64_t now);
+		void onDisconnect(Session& session);
+
+		// On the thread of the session, also samples its RTT.
+		void onReceive(Session& session, size_t bytes);
+
+		void onMisbehavior(Session& session, uint32_t points, uint64_t now);
+
+		void update(uint64_t now);
+
+		// IPv4 /16, IPv6 /32. Private, loopback and link local addresses are all LOCAL_GROUP, a cluster in one
+		// data center is not spread out, those peers can not be taken over from the internet.
+		static uint64_t groupOf(const asio::ip::address& address);
+
+		size_t numOutbound() const;
+		size_t numInbound() const;
+
+		std::string c_str() const;
+
+	protected:
+		struct Peer
+		{
+			SessionID sessionID;
+			asio::ip::udp::endpoint endpoint;
+			bool outbound;
+			uint64_t group;
+			uint64_t connectTime;
+			uint32_t rtt;
+			uint64_t bytes;				// received since the last update()
+			double throughput;			// bytes/s, smoothed
+			uint32_t misbehavior;
+			bool drop;					// disconnected by the next update()
+		};
+
+		double score(const Peer& peer) const;
+
+		// Not dropped yet.
+		size_t countPeers(bool outbound) const;
+
+		// The worst peer of a direction that is at least minAge old, NULL if none.
+		Peer* worstPeer(bool outbound, uint64_t now);
+
+		// Best peers of the AddressBook that may be dialed now. Called locked.
+		void pickCandidates(size_t count, uint64_t now, std::vector<asio::ip::udp::endpoint>& candidates);
+
+	protected:
+		NetworkInterface& networkInterface_;
+		AddressBook& addressBook_;
+		ConnectionPolicy policy_;
+
+		mutable std::mutex mutex_;
+		std::map<SessionID, Peer> peers_;
+
+		// Dial time by endpoint, a session from there is outbound.
+		std::map<asio::ip::udp::endpoint, uint64_t> dials_;
+
+		// Until when an address is banned, or an endpoint that was rotated out or evicted is not dialed again.
+		std::map<asio::ip::address, uint64_t> bans_;
+		std::map<asio::ip::udp::endpoint, uint64_t> cooldowns_;
+
+		uint64_t lastUpdate_;
+		uint64_t lastRotate_;
+
+		uint64_t rotations_;
+		uint64_t evictions_;
+		uint64_t numBans_;
+	};
+
+}
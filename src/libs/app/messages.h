@@ -0,0 +1,26 @@
+#pragma once
+
+#include "network/message.h"
+
+namespace P2pClouds {
+
+	// Messages of the app protocol, opcodes are dense and never reused (see MessageRegistry).
+	enum AppOpcode
+	{
+		APP_OPCODE_HELLO = 1
+	};
+
+	struct HelloMessage
+	{
+		enum { OPCODE = APP_OPCODE_HELLO };
+
+		std::string text;
+		uint64_t nodeID;			// App::id() of the sender
+
+		template<typename S>
+		void fields(S& s) {
+			s & text & nodeID;
+		}
+	};
+
+}
@@ -540,6 +540,8 @@ namespace P2pClouds {
     };
 
 
+    typedef std::shared_ptr<ByteBuffer> ByteBufferPtr;
+
     template <typename T>
     inline ByteBuffer &operator<<(ByteBuffer &b, std::vector<T> v)
     {
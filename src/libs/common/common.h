@@ -67,6 +67,8 @@
 #include <chrono>
 #include <condition_variable>
 #include <future>
+#include <thread>
+#include <atomic>
 
 #include "common/version.h"
 #include "common/singleton.h"
@@ -300,6 +302,12 @@ namespace P2pClouds {
 		return tmp.count();
 	}
 
+	// Milliseconds of a monotonic clock, for timers and timeouts. Unrelated to wall time.
+	inline uint64_t getMonotonicTime()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
 	inline time_t getSysTime()
 	{
 		return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
@@ -0,0 +1,200 @@
+#pragma once
+
+#include "common/common.h"
+
+namespace P2pClouds {
+
+	class TimerWheel;
+
+	/*
+		An intrusive timer entry, the owner derives from it.
+		A node unlinks itself on destruction, so owners can be destroyed while scheduled.
+	*/
+	class TimerWheelNode
+	{
+	public:
+		TimerWheelNode()
+			: prev_(NULL)
+			, next_(NULL)
+			, expire_(0)
+		{
+		}
+
+		virtual ~TimerWheelNode()
+		{
+			unlink();
+		}
+
+		bool isScheduled() const {
+			return next_ != NULL;
+		}
+
+		uint64_t expireTime() const {
+			return expire_;
+		}
+
+		void unlink()
+		{
+			if (!next_)
+				return;
+
+			prev_->next_ = next_;
+			next_->prev_ = prev_;
+			prev_ = next_ = NULL;
+		}
+
+	private:
+		TimerWheelNode(const TimerWheelNode&);
+		TimerWheelNode& operator=(const TimerWheelNode&);
+
+		void linkBefore(TimerWheelNode* pHead)
+		{
+			prev_ = pHead->prev_;
+			next_ = pHead;
+			pHead->prev_->next_ = this;
+			pHead->prev_ = this;
+		}
+
+		void makeHead()
+		{
+			prev_ = next_ = this;
+		}
+
+		friend class TimerWheel;
+
+		TimerWheelNode* prev_;
+		TimerWheelNode* next_;
+		uint64_t expire_;
+	};
+
+	/*
+		A hierarchical timer wheel with 4 levels of 256 slots, one tick per time unit (milliseconds in the network code).
+		schedule() and cancel are O(1), advance() only touches the slots that became due.
+		Expire times further away than 2^32 ticks are clamped.
+	*/
+	class TimerWheel
+	{
+	public:
+		enum { LEVELS = 4, SLOT_BITS = 8, SLOTS = 1 << SLOT_BITS, SLOT_MASK = SLOTS - 1 };
+
+		TimerWheel(uint64_t now = 0)
+			: currentTick_(now)
+		{
+			for (int level = 0; level < LEVELS; ++level)
+				for (int slot = 0; slot < SLOTS; ++slot)
+					slots_[level][slot].makeHead();
+		}
+
+		virtual ~TimerWheel()
+		{
+			clear();
+		}
+
+		uint64_t currentTick() const {
+			return currentTick_;
+		}
+
+		// Reschedules the node if it is already scheduled. Times in the past fire on the next advance().
+		void schedule(TimerWheelNode& node, uint64_t expire)
+		{
+			node.unlink();
+			node.expire_ = std::max(expire, currentTick_);
+			link(node);
+		}
+
+		// Fires every node whose expire time is <= now. The callback may reschedule or destroy any node.
+		template<typename F>
+		void advance(uint64_t now, F&& onExpire)
+		{
+			TimerWheelNode expired;
+			expired.makeHead();
+
+			while (currentTick_ <= now)
+			{
+				uint64_t tick = currentTick_;
+
+				if ((tick & SLOT_MASK) == 0)
+					cascade(tick, 1);
+
+				TimerWheelNode& head = slots_[0][tick & SLOT_MASK];
+
+				// Move the slot aside first, nodes scheduled by the callback go to the next tick.
+				if (head.next_ != &head)
+				{
+					expired.next_ = head.next_;
+					expired.prev_ = head.prev_;
+					head.next_->prev_ = &expired;
+					head.prev_->next_ = &expired;
+					head.makeHead();
+				}
+
+				currentTick_ = tick + 1;
+
+				while (expired.next_ != &expired)
+				{
+					TimerWheelNode* pNode = expired.next_;
+					pNode->unlink();
+					onExpire(pNode);
+				}
+			}
+
+			expired.prev_ = expired.next_ = NULL;
+		}
+
+		void clear()
+		{
+			for (int level = 0; level < LEVELS; ++level)
+			{
+				for (int slot = 0; slot < SLOTS; ++slot)
+				{
+					TimerWheelNode& head = slots_[level][slot];
+					while (head.next_ != &head)
+						head.next_->unlink();
+				}
+			}
+		}
+
+	private:
+		TimerWheel(const TimerWheel&);
+		TimerWheel& operator=(const TimerWheel&);
+
+		void link(TimerWheelNode& node)
+		{
+			uint64_t delta = node.expire_ - currentTick_;
+			if (delta >= (1ull << (SLOT_BITS * LEVELS)))
+			{
+				delta = (1ull << (SLOT_BITS * LEVELS)) - 1;
+				node.expire_ = currentTick_ + delta;
+			}
+
+			int level = 0;
+			while (delta >= (1ull << (SLOT_BITS * (level + 1))))
+				++level;
+
+			node.linkBefore(&slots_[level][(node.expire_ >> (SLOT_BITS * level)) & SLOT_MASK]);
+		}
+
+		// Moves the nodes of the level slot that starts at tick down to the lower levels.
+		void cascade(uint64_t tick, int level)
+		{
+			if (level >= LEVELS)
+				return;
+
+			uint64_t index = (tick >> (SLOT_BITS * level)) & SLOT_MASK;
+			if (index == 0)
+				cascade(tick, level + 1);
+
+			TimerWheelNode& head = slots_[level][index];
+			while (head.next_ != &head)
+			{
+				TimerWheelNode* pNode = head.next_;
+				pNode->unlink();
+				link(*pNode);
+			}
+		}
+
+		TimerWheelNode slots_[LEVELS][SLOTS];
+		uint64_t currentTick_;
+	};
+
+}
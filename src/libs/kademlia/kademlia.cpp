@@ -1,9 +1,42 @@
 #include "kademlia.h"
 #include "network/network_interface.h"
+#include "log/log.h"
+
+#include <openssl/rand.h>
 
 namespace P2pClouds {
 
-	Kademlia::Kademlia()
+	namespace {
+
+		template<typename M>
+		M makeFind(uint64_t rpcID, const uint160_t& senderID, const uint160_t& target, const KadToken& token)
+		{
+			M find;
+			find.rpcID = rpcID;
+			find.senderID = senderID;
+			find.target = target;
+			find.token = token;
+			return find;
+		}
+	}
+
+	Kademlia::Kademlia(NetworkInterface& networkInterface, const uint160_t& selfID, size_t maxStoreBytes)
+		: networkInterface_(networkInterface)
+		, routingTable_(selfID)
+		, timer_(networkInterface.ioService())
+		, stopped_(true)
+		, rpcs_()
+		, lookups_()
+		, lastLookupID_(0)
+		, valueStore_(getMonotonicTime(), maxStoreBytes)
+		, tokenCookie_(TOKEN_LIFETIME)
+		, tokens_()
+		, verifyPings_(0)
+		, bootstrapCallback_()
+		, bootstrapPings_(0)
+		, srtt_(0)
+		, rttvar_(0)
+		, rpcTimeout_(RPC_TIMEOUT_INITIAL)
 	{
 	}
 
@@ -11,4 +44,703 @@ namespace P2pClouds {
 	{
 	}
 
+	bool Kademlia::initialize()
+	{
+		networkInterface_.setDatagramCallback(std::bind(&Kademlia::handleDatagram, this, std::placeholders::_1, std::placeholders::_2));
+
+		stopped_ = false;
+		startTimer();
+		return true;
+	}
+
+	void Kademlia::finalise()
+	{
+		stopped_ = true;
+
+		std::error_code ec;
+		timer_.cancel(ec);
+
+		LOG_INFO("Kademlia::finalise(): {}, lookups={}, rpcs={}, rpcTimeout={}", routingTable_.c_str(), lookups_.size(), rpcs_.size(), rpcTimeout_);
+		LOG_INFO("Kademlia::finalise(): store {}", valueStore_.statsString());
+
+		lookups_.clear();
+		rpcs_.clear();
+		tokens_.clear();
+		verifyPings_ = 0;
+		bootstrapCallback_ = LookupCallback();
+	}
+
+	void Kademlia::bootstrap(const std::vector<asio::ip::udp::endpoint>& seeds, const LookupCallback& callback)
+	{
+		bootstrapCallback_ = callback;
+		bootstrapPings_ = seeds.size();
+
+		for (const asio::ip::udp::endpoint& seed : seeds)
+			sendPing(RPC_BOOTSTRAP, uint160_t(), seed);
+
+		if (seeds.empty())
+		{
+			LookupResult result;
+			result.target = routingTable_.selfID();
+			bootstrapCallback_ = LookupCallback();
+			callback(result);
+			return;
+		}
+
+		networkInterface_.flushPackets();
+	}
+
+	void Kademlia::findNode(const uint160_t& target, const LookupCallback& callback)
+	{
+		startLookup(NodeLookup::FIND_NODE, target, callback);
+	}
+
+	void Kademlia::findValue(const uint160_t& key, const LookupCallback& callback)
+	{
+		startLookup(NodeLookup::FIND_VALUE, key, callback);
+	}
+
+	bool Kademlia::publish(const uint160_t& key, const std::string& value, uint32_t ttl)
+	{
+		return valueStore_.publish(key, value, ttl, getMonotonicTime());
+	}
+
+	bool Kademlia::unpublish(const uint160_t& key)
+	{
+		return valueStore_.unpublish(key);
+	}
+
+	void Kademlia::republish(std::vector<StoreRecord>& records)
+	{
+		std::shared_ptr<RepublishBatch> pBatch = std::make_shared<RepublishBatch>();
+		pBatch->records.swap(records);
+
+		// Lookups that end at once call back before the next one starts.
+		pBatch->pendingLookups = pBatch->records.size();
+
+		for (size_t i = 0; i < pBatch->records.size(); ++i)
+		{
+			findNode(pBatch->records[i].key, [this, pBatch, i](const LookupResult& result)
+			{
+				for (const Contact& contact : result.closest)
+				{
+					StoreTarget& target = pBatch->targets[contact.id];
+					target.endpoint = contact.endpoint;
+					target.records.push_back(i);
+				}
+
+				if (--pBatch->pendingLookups == 0)
+					sendStores(*pBatch);
+			});
+		}
+	}
+
+	void Kademlia::sendStores(const RepublishBatch& batch)
+	{
+		size_t numStores = 0;
+
+		for (const std::pair<const uint160_t, StoreTarget>& target : batch.targets)
+		{
+			KadStoreMessage store;
+			store.rpcID = 0;
+			store.senderID = routingTable_.selfID();
+
+			// rpcID, senderID and the record count.
+			size_t emptyBytes = MessageHeader::SIZE + sizeof(uint64_t) + uint160_t::WIDTH + sizeof(uint32_t);
+			size_t bytes = emptyBytes;
+
+			for (size_t index : target.second.records)
+			{
+				const StoreRecord& record = batch.records[index];
+				// key, ttl and the value with its length.
+				size_t recordBytes = uint160_t::WIDTH + sizeof(uint32_t) + sizeof(uint32_t) + record.value.size();
+
+				if (!store.records.empty() && bytes + recordBytes > STORE_BATCH_BYTES)
+				{
+					sendStore(store, target.first, target.second.endpoint);
+					store.records.clear();
+					bytes = emptyBytes;
+					++numStores;
+				}
+
+				KadRecord kadRecord;
+				kadRecord.key = record.key;
+				kadRecord.ttl = record.ttl;
+				kadRecord.value = record.value;
+				store.records.push_back(kadRecord);
+				bytes += recordBytes;
+			}
+
+			if (!store.records.empty())
+			{
+				sendStore(store, target.first, target.second.endpoint);
+				++numStores;
+			}
+		}
+
+		LOG_DEBUG("Kademlia::sendStores(): {} records, {} nodes, {} stores", batch.records.size(), batch.targets.size(), numStores);
+		networkInterface_.flushPackets();
+	}
+
+	void Kademlia::sendStore(const KadStoreMessage& message, const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint)
+	{
+		PendingRpc rpc;
+		rpc.type = RPC_STORE;
+		rpc.lookupID = 0;
+		rpc.nodeID = nodeID;
+		rpc.endpoint = endpoint;
+		rpc.sentTime = getMonotonicTime();
+		rpc.timedOut = false;
+
+		uint64_t rpcID = newRpcID();
+		rpcs_[rpcID] = rpc;
+
+		KadStoreMessage store = message;
+		store.rpcID = rpcID;
+		send(store, endpoint);
+	}
+
+	void Kademlia::startLookup(NodeLookup::Type type, const uint160_t& target, const LookupCallback& callback)
+	{
+		std::shared_ptr<NodeLookup> pLookup = std::make_shared<NodeLookup>(type, routingTable_.selfID(), target, getMonotonicTime(), callback);
+
+		std::vector<Contact> contacts;
+		routingTable_.findClosest(target, RoutingTable::K, contacts);
+		pLookup->addCandidates(contacts, 1);
+
+		uint64_t lookupID = ++lastLookupID_;
+		lookups_[lookupID] = pLookup;
+
+		runLookup(lookupID);
+		networkInterface_.flushPackets();
+	}
+
+	void Kademlia::runLookup(uint64_t lookupID)
+	{
+		std::map<uint64_t, std::shared_ptr<NodeLookup> >::iterator it = lookups_.find(lookupID);
+		if (it == lookups_.end())
+			return;
+
+		std::shared_ptr<NodeLookup> pLookup = it->second;
+
+		if (!pLookup->isFinished())
+		{
+			std::vector<Contact> queries;
+			pLookup->takeQueries(ALPHA, queries);
+
+			uint64_t now = getMonotonicTime();
+
+			for (const Contact& contact : queries)
+			{
+				PendingRpc rpc;
+				rpc.type = RPC_FIND;
+				rpc.lookupID = lookupID;
+				rpc.nodeID = contact.id;
+				rpc.endpoint = contact.endpoint;
+				rpc.sentTime = now;
+				rpc.timedOut = false;
+
+				uint64_t rpcID = newRpcID();
+				rpcs_[rpcID] = rpc;
+
+				// Without a token the answer is cut to the size of the request.
+				const KadToken* pToken = findToken(contact.endpoint, now);
+				KadToken token = pToken ? *pToken : KadToken();
+				size_t padTo = pToken ? 0 : PADDED_FIND_BYTES;
+
+				if (pLookup->type() == NodeLookup::FIND_VALUE)
+					send(makeFind<KadFindValueMessage>(rpcID, routingTable_.selfID(), pLookup->target(), token), contact.endpoint, padTo);
+				else
+					send(makeFind<KadFindNodeMessage>(rpcID, routingTable_.selfID(), pLookup->target(), token), contact.endpoint, padTo);
+			}
+
+			// Answers still outstanding, or just asked for.
+			if (pLookup->inFlight() > 0)
+				return;
+		}
+
+		// RPCs of the lookup still in flight are answered into the routing table only.
+		lookups_.erase(it);
+
+		LookupResult result = pLookup->result(getMonotonicTime());
+		pLookup->callback()(result);
+	}
+
+	uint64_t Kademlia::newRpcID()
+	{
+		// Unpredictable, so only the node an RPC was sent to can answer it.
+		uint64_t rpcID = 0;
+
+		do
+		{
+			if (RAND_bytes((unsigned char*)&rpcID, sizeof(rpcID)) != 1)
+				rpcID = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+		} while (rpcID == 0 || rpcs_.find(rpcID) != rpcs_.end());
+
+		return rpcID;
+	}
+
+	void Kademlia::sendPing(RpcType type, const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint)
+	{
+		PendingRpc rpc;
+		rpc.type = type;
+		rpc.lookupID = 0;
+		rpc.nodeID = nodeID;
+		rpc.endpoint = endpoint;
+		rpc.sentTime = getMonotonicTime();
+		rpc.timedOut = false;
+
+		uint64_t rpcID = newRpcID();
+		rpcs_[rpcID] = rpc;
+
+		KadPingMessage ping;
+		ping.rpcID = rpcID;
+		ping.senderID = routingTable_.selfID();
+		send(ping, endpoint);
+	}
+
+	template<typename M>
+	void Kademlia::send(const M& message, const asio::ip::udp::endpoint& endpoint, size_t padTo)
+	{
+		ByteBuffer datas;
+		encodeMessage(datas, message);
+
+		if (datas.length() < padTo)
+		{
+			std::vector<uint8_t> padding(padTo - datas.length(), 0);
+			datas.append(padding.data(), padding.size());
+
+			uint32_t length = (uint32_t)(padTo - MessageHeader::SIZE);
+			EndianConvert(length);
+			datas.put(3, (const uint8_t*)&length, sizeof(length));
+		}
+
+		networkInterface_.sendDatagram(datas, endpoint);
+	}
+
+	KadToken Kademlia::makeToken(const asio::ip::udp::endpoint& endpoint) const
+	{
+		KadToken token;
+		token.time = tokenTime(getMonotonicTime());
+		token.mac = tokenCookie_.make(endpoint, token.time);
+		return token;
+	}
+
+	bool Kademlia::verifyToken(const KadToken& token, const asio::ip::udp::endpoint& endpoint) const
+	{
+		return token.mac != 0 && tokenCookie_.verify(endpoint, token.time, token.mac, tokenTime(getMonotonicTime()));
+	}
+
+	void Kademlia::storeToken(const asio::ip::udp::endpoint& endpoint, const KadToken& token, uint64_t now)
+	{
+		if (token.mac == 0)
+			return;
+
+		if (tokens_.size() >= MAX_TOKENS && tokens_.find(endpoint) == tokens_.end())
+		{
+			for (std::map<asio::ip::udp::endpoint, ReceivedToken>::iterator it = tokens_.begin(); it != tokens_.end(); )
+			{
+				if (now - it->second.time >= TOKEN_REUSE * 1000ull)
+					it = tokens_.erase(it);
+				else
+					++it;
+			}
+
+			// All fresh, one of them has to go.
+			if (tokens_.size() >= MAX_TOKENS)
+				tokens_.erase(tokens_.begin());
+		}
+
+		ReceivedToken& received = tokens_[endpoint];
+		received.token = token;
+		received.time = now;
+	}
+
+	const KadToken* Kademlia::findToken(const asio::ip::udp::endpoint& endpoint, uint64_t now)
+	{
+		std::map<asio::ip::udp::endpoint, ReceivedToken>::iterator it = tokens_.find(endpoint);
+		if (it == tokens_.end())
+			return NULL;
+
+		// Echoed well within its lifetime, the clocks of both nodes only have to agree on the rate.
+		if (now - it->second.time >= TOKEN_REUSE * 1000ull)
+		{
+			tokens_.erase(it);
+			return NULL;
+		}
+
+		return &it->second.token;
+	}
+
+	bool Kademlia::takeRpc(uint64_t rpcID, const uint160_t& senderID, const asio::ip::udp::endpoint& endpoint, uint64_t now, PendingRpc& rpc)
+	{
+		std::unordered_map<uint64_t, PendingRpc>::iterator it = rpcs_.find(rpcID);
+		if (it == rpcs_.end() || it->second.endpoint != endpoint)
+			return false;
+
+		if (!it->second.nodeID.isNull() && it->second.nodeID != senderID)
+			return false;
+
+		rpc = it->second;
+		rpcs_.erase(it);
+
+		// Karn: an answer to a timed out RPC may belong to any of its sends, it says nothing about the RTT.
+		if (!rpc.timedOut)
+			sampleRtt(now - rpc.sentTime);
+
+		return true;
+	}
+
+	void Kademlia::handleDatagram(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		if (stopped_)
+			return;
+
+		MessageHeader header;
+		if (!MessageRegistry::readHeader(datas, header) || header.length > datas.length())
+			return;
+
+		datas.wpos((int)(datas.rpos() + header.length));
+
+		uint64_t now = getMonotonicTime();
+
+		try
+		{
+			MessageReader reader(datas);
+
+			switch (header.opcode)
+			{
+			case KAD_OPCODE_PING:
+			{
+				KadPingMessage ping;
+				ping.fields(reader);
+
+				verifySender(ping.senderID, remoteEndpoint);
+
+				KadPongMessage pong;
+				pong.rpcID = ping.rpcID;
+				pong.senderID = routingTable_.selfID();
+				pong.token = makeToken(remoteEndpoint);
+				send(pong, remoteEndpoint);
+				break;
+			}
+			case KAD_OPCODE_PONG:
+			{
+				KadPongMessage pong;
+				pong.fields(reader);
+
+				PendingRpc rpc;
+				if (!takeRpc(pong.rpcID, pong.senderID, remoteEndpoint, now, rpc))
+					break;
+
+				if (rpc.type == RPC_VERIFY)
+					--verifyPings_;
+
+				seen(pong.senderID, remoteEndpoint, now);
+				storeToken(remoteEndpoint, pong.token, now);
+
+				if (rpc.type == RPC_BOOTSTRAP && bootstrapCallback_)
+				{
+					LookupCallback callback = bootstrapCallback_;
+					bootstrapCallback_ = LookupCallback();
+					findNode(routingTable_.selfID(), callback);
+				}
+
+				break;
+			}
+			case KAD_OPCODE_FIND_NODE:
+			case KAD_OPCODE_FIND_VALUE:
+			{
+				KadFindMessage find;
+				find.fields(reader);
+				handleFind(find, header.opcode == KAD_OPCODE_FIND_VALUE, MessageHeader::SIZE + header.length, remoteEndpoint);
+				break;
+			}
+			case KAD_OPCODE_NODES:
+			{
+				KadNodesMessage nodes;
+				nodes.fields(reader);
+				handleAnswer(nodes.rpcID, nodes.senderID, nodes.token, &nodes.nodes, NULL, remoteEndpoint, now);
+				break;
+			}
+			case KAD_OPCODE_VALUE:
+			{
+				KadValueMessage value;
+				value.fields(reader);
+				handleAnswer(value.rpcID, value.senderID, value.token, NULL, &value.value, remoteEndpoint, now);
+				break;
+			}
+			case KAD_OPCODE_STORE:
+			{
+				KadStoreMessage store;
+				store.fields(reader);
+				handleStore(store, remoteEndpoint, now);
+				break;
+			}
+			case KAD_OPCODE_STORE_ACK:
+			{
+				KadStoreAckMessage ack;
+				ack.fields(reader);
+
+				PendingRpc rpc;
+				if (!takeRpc(ack.rpcID, ack.senderID, remoteEndpoint, now, rpc) || rpc.type != RPC_STORE)
+					break;
+
+				seen(ack.senderID, remoteEndpoint, now);
+				storeToken(remoteEndpoint, ack.token, now);
+				break;
+			}
+			default:
+				break;
+			};
+		}
+		catch (ByteBuffer::Exception&)
+		{
+		}
+	}
+
+	void Kademlia::handleStore(const KadStoreMessage& message, const asio::ip::udp::endpoint& remoteEndpoint, uint64_t now)
+	{
+		verifySender(message.senderID, remoteEndpoint);
+
+		KadStoreAckMessage ack;
+		ack.rpcID = message.rpcID;
+		ack.senderID = routingTable_.selfID();
+		ack.stored = 0;
+		ack.token = makeToken(remoteEndpoint);
+
+		for (const KadRecord& record : message.records)
+		{
+			if (valueStore_.store(record.key, record.value, record.ttl, now))
+				++ack.stored;
+		}
+
+		send(ack, remoteEndpoint);
+	}
+
+	void Kademlia::handleFind(const KadFindMessage& message, bool findValue, size_t requestBytes, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		verifySender(message.senderID, remoteEndpoint);
+
+		// A spoofed FIND must not make this node send more to its victim than the attacker sent.
+		size_t maxBytes = verifyToken(message.token, remoteEndpoint) ? std::numeric_limits<size_t>::max() : requestBytes;
+
+		if (findValue)
+		{
+			const std::string* pValue = valueStore_.get(message.target);
+			if (pValue)
+			{
+				KadValueMessage value;
+				value.rpcID = message.rpcID;
+				value.senderID = routingTable_.selfID();
+				value.value = *pValue;
+				value.token = makeToken(remoteEndpoint);
+
+				ByteBuffer datas;
+				encodeMessage(datas, value);
+
+				// Too large, the nodes that fit are answered instead and the token gets the value next time.
+				if (datas.length() <= maxBytes)
+				{
+					networkInterface_.sendDatagram(datas, remoteEndpoint);
+					return;
+				}
+			}
+		}
+
+		std::vector<Contact> contacts;
+		routingTable_.findClosest(message.target, RoutingTable::K, contacts);
+
+		KadNodesMessage nodes;
+		nodes.rpcID = message.rpcID;
+		nodes.senderID = routingTable_.selfID();
+		nodes.token = makeToken(remoteEndpoint);
+
+		// The empty answer, each node adds its ID, the address family, the address and the port.
+		size_t bytes = MessageHeader::SIZE + sizeof(uint64_t) + uint160_t::WIDTH + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t);
+
+		for (const Contact& contact : contacts)
+		{
+			// The asking node knows itself.
+			if (contact.id == message.senderID)
+				continue;
+
+			size_t nodeBytes = uint160_t::WIDTH + 1 + (contact.endpoint.address().is_v4() ? 4 : 16) + sizeof(uint16_t);
+			if (bytes + nodeBytes > maxBytes)
+				break;
+
+			KadNode node;
+			node.id = contact.id;
+			node.endpoint = contact.endpoint;
+			nodes.nodes.push_back(node);
+			bytes += nodeBytes;
+		}
+
+		send(nodes, remoteEndpoint);
+	}
+
+	void Kademlia::handleAnswer(uint64_t rpcID, const uint160_t& senderID, const KadToken& token, const std::vector<KadNode>* pNodes, const std::string* pValue,
+		const asio::ip::udp::endpoint& remoteEndpoint, uint64_t now)
+	{
+		PendingRpc rpc;
+		if (!takeRpc(rpcID, senderID, remoteEndpoint, now, rpc) || rpc.type != RPC_FIND)
+			return;
+
+		seen(senderID, remoteEndpoint, now);
+		storeToken(remoteEndpoint, token, now);
+
+		std::map<uint64_t, std::shared_ptr<NodeLookup> >::iterator it = lookups_.find(rpc.lookupID);
+		if (it == lookups_.end())
+			return;
+
+		if (pValue)
+		{
+			it->second->onValue(senderID, *pValue);
+		}
+		else
+		{
+			// No more than a bucket is asked for, the rest would only crowd the shortlist.
+			std::vector<Contact> contacts;
+			for (size_t i = 0; i < pNodes->size() && i < RoutingTable::K; ++i)
+			{
+				Contact contact;
+				contact.id = (*pNodes)[i].id;
+				contact.key = NodeKey(contact.id);
+				contact.endpoint = (*pNodes)[i].endpoint;
+				contacts.push_back(contact);
+			}
+
+			it->second->onAnswer(senderID, contacts);
+		}
+
+		runLookup(rpc.lookupID);
+	}
+
+	void Kademlia::seen(const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint, uint64_t now)
+	{
+		Contact pingContact;
+		if (routingTable_.update(nodeID, endpoint, now, &pingContact) == RoutingTable::UPDATE_PING)
+			sendPing(RPC_PING, pingContact.id, pingContact.endpoint);
+	}
+
+	void Kademlia::verifySender(const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint)
+	{
+		// Known contacts are refreshed by the answers to our own RPCs only.
+		if (verifyPings_ >= MAX_VERIFY_PINGS || routingTable_.find(nodeID))
+			return;
+
+		int index = routingTable_.bucketIndex(nodeID);
+		if (index < 0 || routingTable_.bucketSize(index) >= RoutingTable::K)
+			return;
+
+		++verifyPings_;
+		sendPing(RPC_VERIFY, nodeID, endpoint);
+	}
+
+	void Kademlia::sampleRtt(uint64_t rtt)
+	{
+		if (srtt_ == 0)
+		{
+			srtt_ = std::max(rtt, (uint64_t)1);
+			rttvar_ = rtt / 2;
+		}
+		else
+		{
+			uint64_t delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+			rttvar_ = (3 * rttvar_ + delta) / 4;
+			srtt_ = std::max((7 * srtt_ + rtt) / 8, (uint64_t)1);
+		}
+
+		rpcTimeout_ = std::min(std::max(srtt_ + 4 * rttvar_, (uint64_t)RPC_TIMEOUT_MIN), (uint64_t)RPC_TIMEOUT_MAX);
+	}
+
+	void Kademlia::startTimer()
+	{
+		timer_.expires_from_now(std::chrono::milliseconds(TICK_INTERVAL));
+		timer_.async_wait(std::bind(&Kademlia::handleTimer, this, std::placeholders::_1));
+	}
+
+	void Kademlia::handleTimer(const std::error_code& error)
+	{
+		if (error || stopped_)
+			return;
+
+		uint64_t now = getMonotonicTime();
+
+		std::vector<uint64_t> timedOutLookups;
+		bool backOff = false;
+		bool bootstrapFailed = false;
+
+		for (std::unordered_map<uint64_t, PendingRpc>::iterator it = rpcs_.begin(); it != rpcs_.end(); )
+		{
+			PendingRpc& rpc = it->second;
+
+			if (!rpc.timedOut && now - rpc.sentTime >= rpcTimeout_)
+			{
+				rpc.timedOut = true;
+				backOff = true;
+
+				if (rpc.type == RPC_FIND)
+				{
+					std::map<uint64_t, std::shared_ptr<NodeLookup> >::iterator lookup = lookups_.find(rpc.lookupID);
+					if (lookup != lookups_.end())
+					{
+						lookup->second->onTimeout(rpc.nodeID);
+						timedOutLookups.push_back(rpc.lookupID);
+					}
+				}
+				else if (rpc.type == RPC_BOOTSTRAP && bootstrapPings_ > 0 && --bootstrapPings_ == 0)
+				{
+					bootstrapFailed = true;
+				}
+			}
+
+			if (now - rpc.sentTime >= RPC_LATE_ANSWER)
+			{
+				if (rpc.type == RPC_VERIFY)
+					--verifyPings_;
+
+				it = rpcs_.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+
+		// Once per tick however many RPCs timed out together, they all saw the same conditions.
+		if (backOff)
+			rpcTimeout_ = std::min(rpcTimeout_ * 2, (uint64_t)RPC_TIMEOUT_MAX);
+
+		// Callbacks may start lookups, so they only run once the RPCs were walked.
+		if (bootstrapFailed && bootstrapCallback_)
+		{
+			LookupResult result;
+			result.target = routingTable_.selfID();
+
+			LookupCallback callback = bootstrapCallback_;
+			bootstrapCallback_ = LookupCallback();
+			callback(result);
+		}
+
+		for (uint64_t lookupID : timedOutLookups)
+			runLookup(lookupID);
+
+		// Full buckets whose least recently seen contact did not answer the ping.
+		std::vector<uint160_t> ids;
+		routingTable_.pingsTimedOut(now, ids);
+
+		for (const uint160_t& id : ids)
+			routingTable_.onPingTimeout(id);
+
+		std::vector<StoreRecord> due;
+		valueStore_.update(now, due);
+
+		if (!due.empty())
+			republish(due);
+
+		networkInterface_.flushPackets();
+		startTimer();
+	}
+
 }
@@ -2,17 +2,201 @@
 
 #include "common/common.h"
 #include "network/common.h"
+#include "routing_table.h"
+#include "node_lookup.h"
+#include "kademlia_messages.h"
+#include "value_store.h"
 
 namespace P2pClouds {
 
+	class NetworkInterface;
+
+	/*
+		Kademlia node on the connectionless datagrams of a NetworkInterface.
+
+		Lookups are iterative and run in parallel: up to ALPHA RPCs of a lookup are in flight, a new one is sent
+		as soon as one answers or times out (see NodeLookup). RPC timeouts follow the measured RTT like TCP's
+		RTO (RFC 6298): srtt + 4 * rttvar, doubled after a timeout, only RPCs answered in time are sampled.
+
+		Only answers to our own RPCs refresh their sender in the routing table, a full bucket pings its least
+		recently seen contact first (see RoutingTable). A node that sends a request is pinged and joins once it
+		answered, so spoofed requests can not fill the table.
+
+		An answer is no larger than its request until the asking node echoed a token that proves it receives at
+		its address, a FIND without a token is padded to PADDED_FIND_BYTES so that it gets a whole answer anyway.
+		Spoofed FINDs are not amplified.
+
+		Published records are republished to the K nodes closest to their keys (see ValueStore), all records
+		due in one tick go out together: one lookup per key, then one STORE per node carrying every record it
+		is among the closest for.
+
+		Everything runs on the thread of the primary of the NetworkInterface, lookups must be started there and
+		their callbacks are invoked there.
+	*/
 	class Kademlia
 	{
 	public:
-		Kademlia();
+		enum {
+			ALPHA = 3,
+			TICK_INTERVAL = 20,				// ms between two timeout checks
+			RPC_TIMEOUT_INITIAL = 1000,		// ms, before the first RTT sample
+			RPC_TIMEOUT_MIN = 50,
+			RPC_TIMEOUT_MAX = 5000,
+			RPC_LATE_ANSWER = 10000,		// ms after sending that a late answer is still taken
+			STORE_BATCH_BYTES = 1100,		// encoded STORE, fits P2PCLOUDS_PMTU_BASE with the datagram header
+			PADDED_FIND_BYTES = 1100,		// encoded FIND without a token, as large as any answer
+			TOKEN_LIFETIME = 600,			// seconds a token is accepted
+			TOKEN_REUSE = 300,				// seconds a token is echoed after it arrived
+			MAX_TOKENS = 4096,
+			MAX_VERIFY_PINGS = 64			// pings of unknown requesting nodes outstanding
+		};
+
+		Kademlia(NetworkInterface& networkInterface, const uint160_t& selfID, size_t maxStoreBytes = ValueStore::DEFAULT_MAX_BYTES);
 		virtual ~Kademlia();
 
+		bool initialize();
+		void finalise();
+
+		RoutingTable& routingTable() {
+			return routingTable_;
+		}
+
+		// Pings the seeds, the first that answers joins the routing table and a lookup of the own ID fills it.
+		// callback gets the result of that lookup, or an empty one if no seed answered.
+		void bootstrap(const std::vector<asio::ip::udp::endpoint>& seeds, const LookupCallback& callback);
+
+		void findNode(const uint160_t& target, const LookupCallback& callback);
+		void findValue(const uint160_t& key, const LookupCallback& callback);
+
+		// A record this node serves to FIND_VALUE and keeps republishing, ttl in ms (see ValueStore::publish).
+		bool publish(const uint160_t& key, const std::string& value, uint32_t ttl);
+		bool unpublish(const uint160_t& key);
+
+		ValueStore& valueStore() {
+			return valueStore_;
+		}
+
+		uint64_t rpcTimeout() const {
+			return rpcTimeout_;
+		}
+
+		size_t numLookups() const {
+			return lookups_.size();
+		}
+
 	protected:
+		enum RpcType
+		{
+			RPC_PING,					// a contact of a full bucket
+			RPC_BOOTSTRAP,				// a seed, its node ID is not known yet
+			RPC_FIND,
+			RPC_STORE,
+			RPC_VERIFY					// a node that sent a request and is not in the routing table
+		};
+
+		struct PendingRpc
+		{
+			RpcType type;
+			uint64_t lookupID;
+			uint160_t nodeID;
+			asio::ip::udp::endpoint endpoint;
+			uint64_t sentTime;
+			bool timedOut;
+		};
+
+		struct StoreTarget
+		{
+			asio::ip::udp::endpoint endpoint;
+			std::vector<size_t> records;	// indices into RepublishBatch::records
+		};
+
+		struct RepublishBatch
+		{
+			std::vector<StoreRecord> records;
+			size_t pendingLookups;
+			std::map<uint160_t, StoreTarget> targets;
+		};
+
+		void startLookup(NodeLookup::Type type, const uint160_t& target, const LookupCallback& callback);
+
+		// Sends the next RPCs of the lookup, or ends it.
+		void runLookup(uint64_t lookupID);
+
+		uint64_t newRpcID();
+		void sendPing(RpcType type, const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint);
+
+		// Looks up the closest nodes of every record, then stores them.
+		void republish(std::vector<StoreRecord>& records);
+		void sendStores(const RepublishBatch& batch);
+		void sendStore(const KadStoreMessage& message, const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint);
+
+		// Zeros after the fields up to padTo, the decoder skips them.
+		template<typename M>
+		void send(const M& message, const asio::ip::udp::endpoint& endpoint, size_t padTo = 0);
+
+		KadToken makeToken(const asio::ip::udp::endpoint& endpoint) const;
+		bool verifyToken(const KadToken& token, const asio::ip::udp::endpoint& endpoint) const;
+
+		// Tokens other nodes gave this one, by their endpoint.
+		void storeToken(const asio::ip::udp::endpoint& endpoint, const KadToken& token, uint64_t now);
+		const KadToken* findToken(const asio::ip::udp::endpoint& endpoint, uint64_t now);
+
+		// Seconds of the monotonic clock, the time base of tokens.
+		static uint32_t tokenTime(uint64_t now) {
+			return (uint32_t)(now / 1000);
+		}
+
+		// The RPC that an answer belongs to, only if it came from the node it was sent to. It is removed.
+		bool takeRpc(uint64_t rpcID, const uint160_t& senderID, const asio::ip::udp::endpoint& endpoint, uint64_t now, PendingRpc& rpc);
+
+		void handleDatagram(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleStore(const KadStoreMessage& message, const asio::ip::udp::endpoint& remoteEndpoint, uint64_t now);
+		void handleFind(const KadFindMessage& message, bool findValue, size_t requestBytes, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleAnswer(uint64_t rpcID, const uint160_t& senderID, const KadToken& token, const std::vector<KadNode>* pNodes, const std::string* pValue,
+			const asio::ip::udp::endpoint& remoteEndpoint, uint64_t now);
+
+		// Refreshes the routing table entry of a node that answered an RPC.
+		void seen(const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint, uint64_t now);
+
+		// Pings a node that sent a request if it could join the routing table, its answer adds it.
+		void verifySender(const uint160_t& nodeID, const asio::ip::udp::endpoint& endpoint);
+
+		void sampleRtt(uint64_t rtt);
+
+		void startTimer();
+		void handleTimer(const std::error_code& error);
+
+	protected:
+		NetworkInterface& networkInterface_;
+		RoutingTable routingTable_;
+
+		asio::steady_timer timer_;
+		bool stopped_;
+
+		std::unordered_map<uint64_t, PendingRpc> rpcs_;
+		std::map<uint64_t, std::shared_ptr<NodeLookup> > lookups_;
+		uint64_t lastLookupID_;
+
+		ValueStore valueStore_;
+
+		ConnectCookie tokenCookie_;
+
+		struct ReceivedToken
+		{
+			KadToken token;
+			uint64_t time;
+		};
+
+		std::map<asio::ip::udp::endpoint, ReceivedToken> tokens_;
+		size_t verifyPings_;
+
+		LookupCallback bootstrapCallback_;
+		size_t bootstrapPings_;
 
+		// ms, 0 before the first sample.
+		uint64_t srtt_;
+		uint64_t rttvar_;
+		uint64_t rpcTimeout_;
 	};
 
 }
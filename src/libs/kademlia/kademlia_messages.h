@@ -0,0 +1,248 @@
+#pragma once
+
+#include "network/message.h"
+#include "network/connect_packet.h"
+
+namespace P2pClouds {
+
+	// Kademlia RPCs, sent as connectionless datagrams (see NetworkInterface::sendDatagram) with the framing of
+	// encodeMessage(). Every message names the RPC it belongs to and the node ID of its sender.
+	enum KadOpcode
+	{
+		KAD_OPCODE_PING = 1,
+		KAD_OPCODE_PONG,
+		KAD_OPCODE_FIND_NODE,
+		KAD_OPCODE_FIND_VALUE,
+		KAD_OPCODE_NODES,			// answers FIND_NODE, and FIND_VALUE if the value is not held
+		KAD_OPCODE_VALUE,
+		KAD_OPCODE_STORE,
+		KAD_OPCODE_STORE_ACK
+	};
+
+	inline ByteBuffer& operator<<(ByteBuffer& datas, const uint160_t& id)
+	{
+		datas.append(id.begin(), id.size());
+		return datas;
+	}
+
+	inline ByteBuffer& operator>>(ByteBuffer& datas, uint160_t& id)
+	{
+		datas.read(id.begin(), id.size());
+		return datas;
+	}
+
+	struct KadNode
+	{
+		uint160_t id;
+		asio::ip::udp::endpoint endpoint;
+	};
+
+	inline ByteBuffer& operator<<(ByteBuffer& datas, const KadNode& node)
+	{
+		datas << node.id;
+		ConnectPacket::writeEndpoint(datas, node.endpoint);
+		return datas;
+	}
+
+	inline ByteBuffer& operator>>(ByteBuffer& datas, KadNode& node)
+	{
+		datas >> node.id;
+
+		if (!ConnectPacket::readEndpoint(datas, node.endpoint))
+			throw ByteBuffer::Exception(false, datas.rpos(), 1, datas.length());
+
+		return datas;
+	}
+
+	// Proof that a node receives at its address: a MAC over the address and the time it was issued. Every answer
+	// carries one for the asking node, which echoes it in its next FIND to the answering one (see Kademlia::handleFind).
+	struct KadToken
+	{
+		KadToken()
+			: time(0)
+			, mac(0)
+		{
+		}
+
+		uint32_t time;
+		uint64_t mac;
+	};
+
+	inline ByteBuffer& operator<<(ByteBuffer& datas, const KadToken& token)
+	{
+		datas << token.time << token.mac;
+		return datas;
+	}
+
+	inline ByteBuffer& operator>>(ByteBuffer& datas, KadToken& token)
+	{
+		datas >> token.time >> token.mac;
+		return datas;
+	}
+
+	// Values are opaque bytes, written with a length instead of the zero terminated ByteBuffer strings, which end
+	// at the first zero or non ASCII byte.
+	struct KadBytes
+	{
+		KadBytes(std::string& value)
+			: value(value)
+		{
+		}
+
+		std::string& value;
+	};
+
+	inline ByteBuffer& operator<<(ByteBuffer& datas, const KadBytes& bytes)
+	{
+		datas << (uint32_t)bytes.value.size();
+		datas.append(bytes.value.data(), bytes.value.size());
+		return datas;
+	}
+
+	inline ByteBuffer& operator>>(ByteBuffer& datas, KadBytes& bytes)
+	{
+		uint32_t size = 0;
+		datas >> size;
+
+		if (size > datas.length())
+			throw ByteBuffer::Exception(false, datas.rpos(), size, datas.length());
+
+		bytes.value.assign((const char*)datas.data() + datas.rpos(), size);
+		datas.read_skip(size);
+		return datas;
+	}
+
+	// ttl in ms, counted from when the record arrives.
+	struct KadRecord
+	{
+		uint160_t key;
+		uint32_t ttl;
+		std::string value;
+	};
+
+	inline ByteBuffer& operator<<(ByteBuffer& datas, const KadRecord& record)
+	{
+		datas << record.key << record.ttl << (uint32_t)record.value.size();
+		datas.append(record.value.data(), record.value.size());
+		return datas;
+	}
+
+	inline ByteBuffer& operator>>(ByteBuffer& datas, KadRecord& record)
+	{
+		KadBytes value(record.value);
+		datas >> record.key >> record.ttl >> value;
+		return datas;
+	}
+
+	struct KadPingMessage
+	{
+		enum { OPCODE = KAD_OPCODE_PING };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID;
+		}
+	};
+
+	struct KadPongMessage
+	{
+		enum { OPCODE = KAD_OPCODE_PONG };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+		KadToken token;			// for the receiver
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID & token;
+		}
+	};
+
+	struct KadFindMessage
+	{
+		uint64_t rpcID;
+		uint160_t senderID;
+		uint160_t target;
+		KadToken token;			// the last one the receiver gave, an answer is no larger than the request without it
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID & target & token;
+		}
+	};
+
+	struct KadFindNodeMessage : public KadFindMessage
+	{
+		enum { OPCODE = KAD_OPCODE_FIND_NODE };
+	};
+
+	struct KadFindValueMessage : public KadFindMessage
+	{
+		enum { OPCODE = KAD_OPCODE_FIND_VALUE };
+	};
+
+	struct KadNodesMessage
+	{
+		enum { OPCODE = KAD_OPCODE_NODES };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+		std::vector<KadNode> nodes;
+		KadToken token;			// for the receiver
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID & nodes & token;
+		}
+	};
+
+	struct KadValueMessage
+	{
+		enum { OPCODE = KAD_OPCODE_VALUE };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+		std::string value;
+		KadToken token;			// for the receiver
+
+		template<typename S>
+		void fields(S& s) {
+			KadBytes bytes(value);
+			s & rpcID & senderID & bytes & token;
+		}
+	};
+
+	// All records for one node that came up for republishing together.
+	struct KadStoreMessage
+	{
+		enum { OPCODE = KAD_OPCODE_STORE };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+		std::vector<KadRecord> records;
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID & records;
+		}
+	};
+
+	struct KadStoreAckMessage
+	{
+		enum { OPCODE = KAD_OPCODE_STORE_ACK };
+
+		uint64_t rpcID;
+		uint160_t senderID;
+		uint32_t stored;			// records taken, the others were too large or did not fit
+		KadToken token;			// for the receiver
+
+		template<typename S>
+		void fields(S& s) {
+			s & rpcID & senderID & stored & token;
+		}
+	};
+
+}
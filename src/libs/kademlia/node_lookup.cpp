@@ -0,0 +1,175 @@
+#include "node_lookup.h"
+
+namespace P2pClouds {
+
+	NodeLookup::NodeLookup(Type type, const uint160_t& selfID, const uint160_t& target, uint64_t now, const LookupCallback& callback)
+		: type_(type)
+		, selfID_(selfID)
+		, target_(target)
+		, targetKey_(target)
+		, shortlist_()
+		, inFlight_(0)
+		, found_(false)
+		, value_()
+		, valueHops_(0)
+		, rpcs_(0)
+		, timeouts_(0)
+		, startTime_(now)
+		, callback_(callback)
+	{
+	}
+
+	NodeLookup::~NodeLookup()
+	{
+	}
+
+	NodeLookup::Candidate* NodeLookup::findCandidate(const uint160_t& id)
+	{
+		for (Candidate& candidate : shortlist_)
+		{
+			if (candidate.contact.id == id)
+				return &candidate;
+		}
+
+		return NULL;
+	}
+
+	void NodeLookup::addCandidates(const std::vector<Contact>& contacts, uint32_t hops)
+	{
+		for (const Contact& contact : contacts)
+		{
+			if (contact.id == selfID_ || contact.id.isNull() || findCandidate(contact.id))
+				continue;
+
+			Candidate candidate;
+			candidate.contact = contact;
+			candidate.contact.key = NodeKey(contact.id);
+			candidate.distance = candidate.contact.key.distance(targetKey_);
+			candidate.state = CANDIDATE_NEW;
+			candidate.hops = hops;
+
+			std::vector<Candidate>::iterator it = std::upper_bound(shortlist_.begin(), shortlist_.end(), candidate,
+				[](const Candidate& a, const Candidate& b) { return a.distance < b.distance; });
+
+			shortlist_.insert(it, candidate);
+		}
+
+		// The farthest candidates would only be asked once all nearer ones failed.
+		while (shortlist_.size() > MAX_SHORTLIST && shortlist_.back().state == CANDIDATE_NEW)
+			shortlist_.pop_back();
+	}
+
+	void NodeLookup::takeQueries(size_t alpha, std::vector<Contact>& queries)
+	{
+		for (size_t i = 0; i < shortlist_.size() && inFlight_ < alpha; ++i)
+		{
+			Candidate& candidate = shortlist_[i];
+			if (candidate.state != CANDIDATE_NEW)
+				continue;
+
+			candidate.state = CANDIDATE_IN_FLIGHT;
+			++inFlight_;
+			++rpcs_;
+
+			queries.push_back(candidate.contact);
+		}
+	}
+
+	void NodeLookup::onAnswer(const uint160_t& id, const std::vector<Contact>& contacts)
+	{
+		Candidate* pCandidate = findCandidate(id);
+		if (!pCandidate || pCandidate->state == CANDIDATE_ANSWERED)
+			return;
+
+		if (pCandidate->state == CANDIDATE_IN_FLIGHT)
+			--inFlight_;
+
+		pCandidate->state = CANDIDATE_ANSWERED;
+
+		// The nodes it named are one hop further away.
+		addCandidates(contacts, pCandidate->hops + 1);
+	}
+
+	void NodeLookup::onValue(const uint160_t& id, const std::string& value)
+	{
+		Candidate* pCandidate = findCandidate(id);
+		if (!pCandidate || pCandidate->state == CANDIDATE_ANSWERED)
+			return;
+
+		if (pCandidate->state == CANDIDATE_IN_FLIGHT)
+			--inFlight_;
+
+		pCandidate->state = CANDIDATE_ANSWERED;
+
+		if (!found_)
+		{
+			found_ = true;
+			value_ = value;
+			valueHops_ = pCandidate->hops;
+		}
+	}
+
+	void NodeLookup::onTimeout(const uint160_t& id)
+	{
+		Candidate* pCandidate = findCandidate(id);
+		if (!pCandidate || pCandidate->state != CANDIDATE_IN_FLIGHT)
+			return;
+
+		--inFlight_;
+		++timeouts_;
+		pCandidate->state = CANDIDATE_TIMED_OUT;
+	}
+
+	bool NodeLookup::isFinished() const
+	{
+		if (found_)
+			return true;
+
+		size_t answered = 0;
+
+		for (const Candidate& candidate : shortlist_)
+		{
+			if (candidate.state == CANDIDATE_TIMED_OUT)
+				continue;
+
+			if (candidate.state != CANDIDATE_ANSWERED)
+				return false;
+
+			if (++answered == RoutingTable::K)
+				return true;
+		}
+
+		return true;
+	}
+
+	LookupResult NodeLookup::result(uint64_t now) const
+	{
+		LookupResult result;
+		result.target = target_;
+		result.found = found_;
+		result.value = value_;
+		result.rpcs = rpcs_;
+		result.timeouts = timeouts_;
+		result.latency = now - startTime_;
+
+		for (const Candidate& candidate : shortlist_)
+		{
+			if (candidate.state != CANDIDATE_ANSWERED)
+				continue;
+
+			if (result.closest.empty())
+				result.hops = candidate.hops;
+
+			result.closest.push_back(candidate.contact);
+
+			if (result.closest.size() == RoutingTable::K)
+				break;
+		}
+
+		if (found_)
+			result.hops = valueHops_;
+
+		return result;
+	}
+
+}
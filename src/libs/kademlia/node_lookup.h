@@ -0,0 +1,135 @@
+#pragma once
+
+#include "routing_table.h"
+
+namespace P2pClouds {
+
+	struct LookupResult
+	{
+		LookupResult()
+			: target()
+			, found(false)
+			, value()
+			, closest()
+			, hops(0)
+			, rpcs(0)
+			, timeouts(0)
+			, latency(0)
+		{
+		}
+
+		uint160_t target;
+
+		// FIND_VALUE only, set if a node returned the value.
+		bool found;
+		std::string value;
+
+		// The closest nodes that answered, nearest first, at most RoutingTable::K.
+		std::vector<Contact> closest;
+
+		uint32_t hops;				// RPCs in a row it took to reach the value, or the closest node
+		uint32_t rpcs;				// RPCs sent
+		uint32_t timeouts;			// RPCs that timed out, late answers are still taken
+		uint64_t latency;			// ms from the start to the end of the lookup
+	};
+
+	typedef std::function<void(const LookupResult&)> LookupCallback;
+
+	/*
+		State of one iterative lookup (FIND_NODE or FIND_VALUE), the I/O is done by Kademlia.
+
+		The shortlist holds the candidates sorted by distance to the target, a node is in it only once.
+		takeQueries() hands out the closest candidates not asked yet while fewer than alpha RPCs are in
+		flight. A timed out RPC frees its slot but its answer is still taken if it comes late. Nodes from
+		answers join the shortlist one hop further than the node that named them.
+
+		The lookup is finished once the K closest candidates that did not time out have all answered,
+		when nothing is left to ask, or when the value was found.
+	*/
+	class NodeLookup
+	{
+	public:
+		enum Type
+		{
+			FIND_NODE,
+			FIND_VALUE
+		};
+
+		enum {
+			MAX_SHORTLIST = RoutingTable::K * 3
+		};
+
+		NodeLookup(Type type, const uint160_t& selfID, const uint160_t& target, uint64_t now, const LookupCallback& callback);
+		virtual ~NodeLookup();
+
+		Type type() const {
+			return type_;
+		}
+
+		const uint160_t& target() const {
+			return target_;
+		}
+
+		// Nodes at the given hop count, the node itself and known nodes are skipped.
+		void addCandidates(const std::vector<Contact>& contacts, uint32_t hops);
+
+		// Up to alpha minus the RPCs in flight of the closest candidates not asked yet, they are in flight afterwards.
+		void takeQueries(size_t alpha, std::vector<Contact>& queries);
+
+		void onAnswer(const uint160_t& id, const std::vector<Contact>& contacts);
+		void onValue(const uint160_t& id, const std::string& value);
+		void onTimeout(const uint160_t& id);
+
+		size_t inFlight() const {
+			return inFlight_;
+		}
+
+		bool isFinished() const;
+
+		LookupResult result(uint64_t now) const;
+
+		const LookupCallback& callback() const {
+			return callback_;
+		}
+
+	protected:
+		enum CandidateState
+		{
+			CANDIDATE_NEW,
+			CANDIDATE_IN_FLIGHT,
+			CANDIDATE_TIMED_OUT,
+			CANDIDATE_ANSWERED
+		};
+
+		struct Candidate
+		{
+			Contact contact;
+			NodeKey distance;
+			CandidateState state;
+			uint32_t hops;
+		};
+
+		Candidate* findCandidate(const uint160_t& id);
+
+	protected:
+		Type type_;
+		uint160_t selfID_;
+		uint160_t target_;
+		NodeKey targetKey_;
+
+		// Nearest first.
+		std::vector<Candidate> shortlist_;
+		size_t inFlight_;
+
+		bool found_;
+		std::string value_;
+		uint32_t valueHops_;
+
+		uint32_t rpcs_;
+		uint32_t timeouts_;
+		uint64_t startTime_;
+
+		LookupCallback callback_;
+	};
+
+}
@@ -0,0 +1,277 @@
+#include "routing_table.h"
+
+namespace P2pClouds {
+
+	namespace {
+
+		uint64_t loadBigEndian(const uint8_t* p, size_t size)
+		{
+			uint64_t value = 0;
+
+			for (size_t i = 0; i < size; ++i)
+				value = (value << 8) | p[i];
+
+			return value;
+		}
+
+		int highestBit(uint64_t value)
+		{
+#if defined(__GNUC__)
+			return 63 - __builtin_clzll(value);
+#else
+			int bit = 0;
+			while (value >>= 1)
+				++bit;
+
+			return bit;
+#endif
+		}
+	}
+
+	NodeKey::NodeKey(const uint160_t& id)
+	{
+		words[0] = loadBigEndian(id.begin(), 8);
+		words[1] = loadBigEndian(id.begin() + 8, 8);
+		words[2] = loadBigEndian(id.begin() + 16, 4);
+	}
+
+	int NodeKey::distanceBit(const NodeKey& other) const
+	{
+		NodeKey d = distance(other);
+
+		if (d.words[0])
+			return 96 + highestBit(d.words[0]);
+
+		if (d.words[1])
+			return 32 + highestBit(d.words[1]);
+
+		if (d.words[2])
+			return highestBit(d.words[2]);
+
+		return -1;
+	}
+
+	int RoutingTable::KBucket::indexOf(const uint160_t& id) const
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (contacts[i].id == id)
+				return (int)i;
+		}
+
+		return -1;
+	}
+
+	void RoutingTable::KBucket::erase(int index)
+	{
+		for (size_t i = index; i + 1 < count; ++i)
+			contacts[i] = contacts[i + 1];
+
+		--count;
+	}
+
+	RoutingTable::RoutingTable(const uint160_t& selfID)
+		: selfID_(selfID)
+		, selfKey_(selfID)
+		, buckets_(NUM_BUCKETS)
+		, size_(0)
+	{
+	}
+
+	RoutingTable::~RoutingTable()
+	{
+	}
+
+	RoutingTable::UpdateResult RoutingTable::update(const uint160_t& id, const asio::ip::udp::endpoint& endpoint, uint64_t now, Contact* pPingContact)
+	{
+		int index = bucketIndex(id);
+		if (index < 0)
+			return UPDATE_IGNORED;
+
+		KBucket& bucket = buckets_[index];
+
+		int pos = bucket.indexOf(id);
+		if (pos >= 0)
+		{
+			Contact contact = bucket.contacts[pos];
+			contact.endpoint = endpoint;
+			contact.lastSeen = now;
+
+			bucket.erase(pos);
+			bucket.contacts[bucket.count++] = contact;
+
+			// The pinged contact answered.
+			if (pos == 0)
+				bucket.pingTime = 0;
+
+			return UPDATE_REFRESHED;
+		}
+
+		Contact contact;
+		contact.id = id;
+		contact.key = NodeKey(id);
+		contact.endpoint = endpoint;
+		contact.lastSeen = now;
+
+		if (bucket.count < K)
+		{
+			bucket.contacts[bucket.count++] = contact;
+			++size_;
+			return UPDATE_ADDED;
+		}
+
+		addReplacement(bucket, contact);
+
+		if (bucket.pingTime != 0)
+			return UPDATE_CACHED;
+
+		bucket.pingTime = std::max(now, (uint64_t)1);
+
+		if (pPingContact)
+			*pPingContact = bucket.contacts[0];
+
+		return UPDATE_PING;
+	}
+
+	void RoutingTable::addReplacement(KBucket& bucket, const Contact& contact)
+	{
+		size_t pos = 0;
+		while (pos < bucket.numReplacements && bucket.replacements[pos].id != contact.id)
+			++pos;
+
+		// A known replacement is moved to the back, the oldest one makes room for a new one.
+		if (pos == bucket.numReplacements && bucket.numReplacements == REPLACEMENTS)
+			pos = 0;
+		else if (pos == bucket.numReplacements)
+			++bucket.numReplacements;
+
+		for (; pos + 1 < bucket.numReplacements; ++pos)
+			bucket.replacements[pos] = bucket.replacements[pos + 1];
+
+		bucket.replacements[bucket.numReplacements - 1] = contact;
+	}
+
+	void RoutingTable::onPingTimeout(const uint160_t& id)
+	{
+		remove(id);
+	}
+
+	void RoutingTable::pingsTimedOut(uint64_t now, std::vector<uint160_t>& ids) const
+	{
+		for (const KBucket& bucket : buckets_)
+		{
+			if (bucket.pingTime != 0 && now - bucket.pingTime >= PING_TIMEOUT)
+				ids.push_back(bucket.contacts[0].id);
+		}
+	}
+
+	bool RoutingTable::remove(const uint160_t& id)
+	{
+		int index = bucketIndex(id);
+		if (index < 0)
+			return false;
+
+		KBucket& bucket = buckets_[index];
+
+		int pos = bucket.indexOf(id);
+		if (pos < 0)
+			return false;
+
+		bucket.erase(pos);
+		--size_;
+
+		if (pos == 0)
+			bucket.pingTime = 0;
+
+		// The most recently seen replacement is the most likely to be alive.
+		if (bucket.numReplacements > 0)
+		{
+			bucket.contacts[bucket.count++] = bucket.replacements[--bucket.numReplacements];
+			++size_;
+		}
+
+		return true;
+	}
+
+	const Contact* RoutingTable::find(const uint160_t& id) const
+	{
+		int index = bucketIndex(id);
+		if (index < 0)
+			return NULL;
+
+		const KBucket& bucket = buckets_[index];
+
+		int pos = bucket.indexOf(id);
+		return pos >= 0 ? &bucket.contacts[pos] : NULL;
+	}
+
+	void RoutingTable::collect(const KBucket& bucket, const NodeKey& target, std::vector<std::pair<NodeKey, const Contact*> >& candidates) const
+	{
+		for (size_t i = 0; i < bucket.count; ++i)
+			candidates.push_back(std::make_pair(bucket.contacts[i].key.distance(target), &bucket.contacts[i]));
+	}
+
+	size_t RoutingTable::findClosest(const uint160_t& target, size_t count, std::vector<Contact>& result) const
+	{
+		result.clear();
+
+		if (count == 0)
+			return 0;
+
+		NodeKey targetKey(target);
+		int targetBucket = selfKey_.distanceBit(targetKey);
+
+		std::vector<std::pair<NodeKey, const Contact*> > candidates;
+		candidates.reserve(count + K);
+
+		// The distances to target of the contacts in bucket i are below 2^targetBucket for i == targetBucket,
+		// in [2^targetBucket, 2^(targetBucket+1)) for all i < targetBucket and in [2^i, 2^(i+1)) for i > targetBucket.
+		// Every group is sorted on its own and the groups are taken nearest first. The buckets below targetBucket
+		// are one group, their order says nothing about the distance to target, so all of them are collected.
+		size_t groupStart = 0;
+
+		if (targetBucket >= 0)
+		{
+			collect(buckets_[targetBucket], targetKey, candidates);
+			std::sort(candidates.begin(), candidates.end());
+			groupStart = candidates.size();
+
+			for (int i = 0; i < targetBucket && groupStart < count; ++i)
+				collect(buckets_[i], targetKey, candidates);
+
+			std::sort(candidates.begin() + groupStart, candidates.end());
+		}
+
+		for (int i = targetBucket + 1; i < NUM_BUCKETS && candidates.size() < count; ++i)
+		{
+			groupStart = candidates.size();
+			collect(buckets_[i], targetKey, candidates);
+			std::sort(candidates.begin() + groupStart, candidates.end());
+		}
+
+		size_t found = std::min(count, candidates.size());
+		result.reserve(found);
+
+		for (size_t i = 0; i < found; ++i)
+			result.push_back(*candidates[i].second);
+
+		return found;
+	}
+
+	std::string RoutingTable::c_str() const
+	{
+		size_t usedBuckets = 0;
+		size_t replacements = 0;
+
+		for (const KBucket& bucket : buckets_)
+		{
+			if (bucket.count > 0)
+				++usedBuckets;
+
+			replacements += bucket.numReplacements;
+		}
+
+		return fmt::format("self={}, contacts={}, buckets={}, replacements={}", selfID_.getHex(), size_, usedBuckets, replacements);
+	}
+
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "common/common.h"
+#include "network/common.h"
+
+namespace P2pClouds {
+
+	// A node ID as three host order words, most significant first, so the XOR distance of two IDs compares as integers.
+	struct NodeKey
+	{
+		NodeKey()
+		{
+			words[0] = words[1] = words[2] = 0;
+		}
+
+		explicit NodeKey(const uint160_t& id);
+
+		// The index of the highest bit set in the distance to other, -1 if both are equal.
+		int distanceBit(const NodeKey& other) const;
+
+		NodeKey distance(const NodeKey& other) const
+		{
+			NodeKey result;
+			result.words[0] = words[0] ^ other.words[0];
+			result.words[1] = words[1] ^ other.words[1];
+			result.words[2] = words[2] ^ other.words[2];
+			return result;
+		}
+
+		bool operator<(const NodeKey& other) const
+		{
+			if (words[0] != other.words[0])
+				return words[0] < other.words[0];
+
+			if (words[1] != other.words[1])
+				return words[1] < other.words[1];
+
+			return words[2] < other.words[2];
+		}
+
+		uint64_t words[3];		// the last word holds the low 32 bits
+	};
+
+	struct Contact
+	{
+		Contact()
+			: id()
+			, key()
+			, endpoint()
+			, lastSeen(0)
+		{
+		}
+
+		uint160_t id;
+		NodeKey key;
+		asio::ip::udp::endpoint endpoint;
+		uint64_t lastSeen;
+	};
+
+	/*
+		Kademlia routing table of a node: bucket i holds the contacts whose XOR distance to the node
+		has its highest bit at i, byte 0 of a uint160_t being the most significant.
+
+		A bucket keeps up to K contacts in a flat array, least recently seen first. A new contact for a
+		full bucket goes to the bucket's replacement cache and the caller is asked to ping the least
+		recently seen one: an answer moves it to the back (update()), a timeout evicts it (onPingTimeout())
+		and the most recent replacement takes its place. Only one ping per bucket is outstanding.
+
+		findClosest() visits the buckets in order of distance to the target, so it touches about K
+		contacts no matter how many the table holds. The table is not locked, it belongs to the thread
+		that runs the lookups.
+	*/
+	class RoutingTable
+	{
+	public:
+		enum {
+			NUM_BUCKETS = 160,
+			K = 20,
+			REPLACEMENTS = 8,			// replacement cache per bucket
+			PING_TIMEOUT = 5000			// ms after which a ping of a full bucket counts as unanswered
+		};
+
+		enum UpdateResult
+		{
+			UPDATE_ADDED,				// the contact is new in its bucket
+			UPDATE_REFRESHED,			// the contact was known and moved to the back
+			UPDATE_PING,				// the bucket is full, the caller has to ping the returned contact
+			UPDATE_CACHED,				// the bucket is full and a ping is outstanding, the contact waits in the cache
+			UPDATE_IGNORED				// the ID of the table itself
+		};
+
+		RoutingTable(const uint160_t& selfID);
+		virtual ~RoutingTable();
+
+		const uint160_t& selfID() const {
+			return selfID_;
+		}
+
+		// Called for every message of a node. pPingContact receives the contact to ping on UPDATE_PING.
+		UpdateResult update(const uint160_t& id, const asio::ip::udp::endpoint& endpoint, uint64_t now, Contact* pPingContact = NULL);
+
+		// The pinged contact did not answer within PING_TIMEOUT (see pingsTimedOut()), it is replaced from the cache.
+		void onPingTimeout(const uint160_t& id);
+
+		// Appends the IDs of the contacts whose ping timed out, the caller then calls onPingTimeout() for them.
+		void pingsTimedOut(uint64_t now, std::vector<uint160_t>& ids) const;
+
+		bool remove(const uint160_t& id);
+
+		const Contact* find(const uint160_t& id) const;
+
+		// Up to count contacts closest to target, nearest first. Returns the number found.
+		size_t findClosest(const uint160_t& target, size_t count, std::vector<Contact>& result) const;
+
+		// -1 for the ID of the table itself.
+		int bucketIndex(const uint160_t& id) const {
+			return selfKey_.distanceBit(NodeKey(id));
+		}
+
+		size_t bucketSize(int index) const {
+			return buckets_[index].count;
+		}
+
+		size_t size() const {
+			return size_;
+		}
+
+		std::string c_str() const;
+
+	protected:
+		struct KBucket
+		{
+			KBucket()
+				: count(0)
+				, numReplacements(0)
+				, pingTime(0)
+			{
+			}
+
+			int indexOf(const uint160_t& id) const;
+			void erase(int index);
+
+			// Least recently seen first.
+			Contact contacts[K];
+			size_t count;
+
+			// Oldest first, a full cache drops its oldest entry.
+			Contact replacements[REPLACEMENTS];
+			size_t numReplacements;
+
+			// Set while contacts[0] is being pinged.
+			uint64_t pingTime;
+		};
+
+		void addReplacement(KBucket& bucket, const Contact& contact);
+
+		// Appends the contacts of bucket to candidates with their distance to target.
+		void collect(const KBucket& bucket, const NodeKey& target, std::vector<std::pair<NodeKey, const Contact*> >& candidates) const;
+
+	protected:
+		uint160_t selfID_;
+		NodeKey selfKey_;
+
+		std::vector<KBucket> buckets_;
+		size_t size_;
+	};
+
+}
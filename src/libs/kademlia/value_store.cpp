@@ -0,0 +1,183 @@
+#include "value_store.h"
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	ValueStore::ValueStore(uint64_t now, size_t maxBytes)
+		: records_()
+		, lru_()
+		, timerWheel_(now)
+		, maxBytes_(maxBytes)
+		, bytes_(0)
+		, localBytes_(0)
+		, hits_(0)
+		, misses_(0)
+		, evictions_(0)
+		, expirations_(0)
+	{
+	}
+
+	ValueStore::~ValueStore()
+	{
+		// The records unlink themselves from the wheel, which has to be alive then.
+		records_.clear();
+	}
+
+	bool ValueStore::publish(const uint160_t& key, const std::string& value, uint32_t ttl, uint64_t now)
+	{
+		if (value.size() > MAX_VALUE_SIZE || ttl == 0)
+			return false;
+
+		size_t newBytes = RECORD_OVERHEAD + value.size();
+
+		std::map<uint160_t, std::unique_ptr<Record> >::iterator it = records_.find(key);
+		Record* pOld = it != records_.end() ? it->second.get() : NULL;
+		size_t oldBytes = pOld ? recordBytes(*pOld) : 0;
+
+		if (localBytes_ - (pOld && pOld->local ? oldBytes : 0) + newBytes > maxBytes_)
+			return false;
+
+		// The old record goes only once the new one fits, a failed publish leaves it in place.
+		if (!makeRoom(newBytes > oldBytes ? newBytes - oldBytes : 0, pOld))
+			return false;
+
+		if (pOld)
+			erase(records_.find(key));
+
+		std::unique_ptr<Record> pRecord(new Record());
+		pRecord->key = key;
+		pRecord->value = value;
+		pRecord->ttl = std::min(ttl, (uint32_t)MAX_TTL);
+		pRecord->local = true;
+		pRecord->lruPos = lru_.end();
+
+		timerWheel_.schedule(*pRecord, now + PUBLISH_DELAY);
+
+		bytes_ += newBytes;
+		localBytes_ += newBytes;
+		records_[key] = std::move(pRecord);
+		return true;
+	}
+
+	bool ValueStore::unpublish(const uint160_t& key)
+	{
+		std::map<uint160_t, std::unique_ptr<Record> >::iterator it = records_.find(key);
+		if (it == records_.end() || !it->second->local)
+			return false;
+
+		erase(it);
+		return true;
+	}
+
+	bool ValueStore::store(const uint160_t& key, const std::string& value, uint32_t ttl, uint64_t now)
+	{
+		if (value.size() > MAX_VALUE_SIZE || ttl == 0)
+			return false;
+
+		std::map<uint160_t, std::unique_ptr<Record> >::iterator it = records_.find(key);
+		Record* pOld = it != records_.end() ? it->second.get() : NULL;
+
+		if (pOld && pOld->local)
+			return true;
+
+		size_t newBytes = RECORD_OVERHEAD + value.size();
+		size_t oldBytes = pOld ? recordBytes(*pOld) : 0;
+
+		if (!makeRoom(newBytes > oldBytes ? newBytes - oldBytes : 0, pOld))
+			return false;
+
+		if (pOld)
+			erase(records_.find(key));
+
+		std::unique_ptr<Record> pRecord(new Record());
+		pRecord->key = key;
+		pRecord->value = value;
+		pRecord->ttl = std::min(ttl, (uint32_t)MAX_TTL);
+		pRecord->local = false;
+
+		lru_.push_front(pRecord.get());
+		pRecord->lruPos = lru_.begin();
+
+		timerWheel_.schedule(*pRecord, now + pRecord->ttl);
+
+		bytes_ += newBytes;
+		records_[key] = std::move(pRecord);
+		return true;
+	}
+
+	const std::string* ValueStore::get(const uint160_t& key)
+	{
+		std::map<uint160_t, std::unique_ptr<Record> >::iterator it = records_.find(key);
+		if (it == records_.end())
+		{
+			++misses_;
+			return NULL;
+		}
+
+		++hits_;
+
+		Record& record = *it->second;
+		if (!record.local)
+			lru_.splice(lru_.begin(), lru_, record.lruPos);
+
+		return &record.value;
+	}
+
+	void ValueStore::update(uint64_t now, std::vector<StoreRecord>& republish)
+	{
+		timerWheel_.advance(now, [this, now, &republish](TimerWheelNode* pNode)
+		{
+			Record* pRecord = static_cast<Record*>(pNode);
+
+			if (pRecord->local)
+			{
+				StoreRecord record;
+				record.key = pRecord->key;
+				record.value = pRecord->value;
+				record.ttl = pRecord->ttl;
+				republish.push_back(record);
+
+				timerWheel_.schedule(*pRecord, now + std::min(pRecord->ttl / 2, (uint32_t)REPUBLISH_INTERVAL));
+				return;
+			}
+
+			++expirations_;
+			erase(records_.find(pRecord->key));
+		});
+	}
+
+	void ValueStore::erase(std::map<uint160_t, std::unique_ptr<Record> >::iterator it)
+	{
+		Record& record = *it->second;
+		bytes_ -= recordBytes(record);
+
+		if (record.local)
+			localBytes_ -= recordBytes(record);
+		else
+			lru_.erase(record.lruPos);
+
+		records_.erase(it);
+	}
+
+	bool ValueStore::makeRoom(size_t extra, const Record* pKeep)
+	{
+		// Moved to the front, it is then only left once everything else is evicted.
+		if (pKeep && !pKeep->local)
+			lru_.splice(lru_.begin(), lru_, pKeep->lruPos);
+
+		while (bytes_ + extra > maxBytes_ && !lru_.empty() && lru_.back() != pKeep)
+		{
+			++evictions_;
+			erase(records_.find(lru_.back()->key));
+		}
+
+		return bytes_ + extra <= maxBytes_;
+	}
+
+	std::string ValueStore::statsString() const
+	{
+		return fmt::format("records={}, bytes={}, hits={}, misses={}, evictions={}, expirations={}",
+			records_.size(), bytes_, hits_, misses_, evictions_, expirations_);
+	}
+
+}
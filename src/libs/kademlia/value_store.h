@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common/common.h"
+#include "common/timer_wheel.h"
+
+namespace P2pClouds {
+
+	// A record as it is republished, ttl in ms.
+	struct StoreRecord
+	{
+		uint160_t key;
+		std::string value;
+		uint32_t ttl;
+	};
+
+	/*
+		Small DHT records (peer addresses, block providers keyed by block hash) of a Kademlia node.
+
+		Records published by this node are kept until unpublish() and come up for republishing every
+		min(ttl / 2, REPUBLISH_INTERVAL). Records stored by other nodes expire after their TTL, a timer wheel
+		keeps the expiry O(1) per record. They live in an LRU list, once the bytes of all records exceed the
+		cap the least recently used ones are evicted, records of this node never are.
+
+		Not locked, it belongs to the thread of its Kademlia.
+	*/
+	class ValueStore
+	{
+	public:
+		enum {
+			MAX_VALUE_SIZE = 1024,						// a record has to fit into one datagram
+			RECORD_OVERHEAD = 128,						// bytes accounted per record besides the value
+			DEFAULT_MAX_BYTES = 16 * 1024 * 1024,
+			MAX_TTL = 24 * 3600 * 1000,					// ms
+			REPUBLISH_INTERVAL = 3600 * 1000,			// ms
+			PUBLISH_DELAY = 500							// ms, records published together are republished in one batch
+		};
+
+		ValueStore(uint64_t now, size_t maxBytes = DEFAULT_MAX_BYTES);
+		virtual ~ValueStore();
+
+		// A record of this node, false if the value is too large or the cap is reached by records of this node alone.
+		bool publish(const uint160_t& key, const std::string& value, uint32_t ttl, uint64_t now);
+		bool unpublish(const uint160_t& key);
+
+		// A record from a STORE of another node, a record of this node with the same key is kept.
+		bool store(const uint160_t& key, const std::string& value, uint32_t ttl, uint64_t now);
+
+		// NULL if the key is not held, counted as a hit or a miss. The pointer is valid until the next change.
+		const std::string* get(const uint160_t& key);
+
+		// Expires records and appends the records of this node that are due for republishing.
+		void update(uint64_t now, std::vector<StoreRecord>& republish);
+
+		size_t size() const {
+			return records_.size();
+		}
+
+		size_t bytes() const {
+			return bytes_;
+		}
+
+		uint64_t hits() const {
+			return hits_;
+		}
+
+		uint64_t misses() const {
+			return misses_;
+		}
+
+		uint64_t evictions() const {
+			return evictions_;
+		}
+
+		uint64_t expirations() const {
+			return expirations_;
+		}
+
+		std::string statsString() const;
+
+	protected:
+		struct Record : public TimerWheelNode
+		{
+			uint160_t key;
+			std::string value;
+			uint32_t ttl;
+			bool local;
+
+			// Records of other nodes only, lru_.end() for records of this node.
+			std::list<Record*>::iterator lruPos;
+		};
+
+		static size_t recordBytes(const Record& record) {
+			return RECORD_OVERHEAD + record.value.size();
+		}
+
+		void erase(std::map<uint160_t, std::unique_ptr<Record> >::iterator it);
+
+		// Evicts least recently used records until extra more bytes fit, false if they never would. pKeep, the record
+		// about to be replaced, is not evicted.
+		bool makeRoom(size_t extra, const Record* pKeep = NULL);
+
+	protected:
+		std::map<uint160_t, std::unique_ptr<Record> > records_;
+
+		// Most recently used first.
+		std::list<Record*> lru_;
+
+		TimerWheel timerWheel_;
+
+		size_t maxBytes_;
+		size_t bytes_;
+		size_t localBytes_;
+
+		uint64_t hits_;
+		uint64_t misses_;
+		uint64_t evictions_;
+		uint64_t expirations_;
+	};
+
+}
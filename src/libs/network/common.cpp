@@ -11,6 +11,8 @@ namespace P2pClouds {
             case NetRcvMsg: return "NetRcvMsg";
             case NetLagNotify: return "NetLagNotify";
 			case NetTimeout: return "NetTimeout";
+			case NetWritable: return "NetWritable";
+			case NetPunchFailed: return "NetPunchFailed";
             default: return "NetEventUnknown";
         }
     }
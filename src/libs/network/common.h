@@ -11,6 +11,71 @@ namespace P2pClouds {
 
 	#define LISTEN_PORT 27776
 
+	// Send backpressure, in KCP segments waiting to be sent or acked (ikcp_waitsnd).
+	// Above the high watermark sends fail with NetSendWouldBlock, NetWritable fires once the backlog drains to the low one.
+	#define P2PCLOUDS_SEND_HIGH_WATERMARK 512
+	#define P2PCLOUDS_SEND_LOW_WATERMARK 128
+
+	// Path MTU probing (see MtuProber), needs datagrams with DF set.
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX && defined(IP_PMTUDISC_PROBE)
+	#define P2PCLOUDS_HAS_PMTU_PROBE 1
+#else
+	#define P2PCLOUDS_HAS_PMTU_PROBE 0
+#endif
+
+	// UDP payload every path is expected to carry, and the largest link MTU probed for (jumbo frames).
+	#define P2PCLOUDS_PMTU_BASE 1200
+	#define P2PCLOUDS_PMTU_MAX_LINK_MTU 9000
+
+	// Forward error correction (see FecEncoder), at most one parity datagram per this many data datagrams.
+	#define P2PCLOUDS_FEC_MAX_DATA_SHARDS 10
+
+	// Small messages are coalesced into one KCP payload for up to this many milliseconds.
+	#define P2PCLOUDS_SEND_COALESCE_DELAY 5
+
+	// Events of one session that may wait for a HandlerExecutor before the session stops receiving.
+	#define P2PCLOUDS_HANDLER_QUEUE_DEPTH 256
+
+	// Receive rate limits (see FloodGuard), datagrams per second and burst, per source IP of a shard and per session.
+	#define P2PCLOUDS_FLOOD_SOURCE_RATE 20000
+	#define P2PCLOUDS_FLOOD_SOURCE_BURST 20000
+	#define P2PCLOUDS_FLOOD_SESSION_RATE 10000
+	#define P2PCLOUDS_FLOOD_SESSION_BURST 10000
+
+	// Hole punching (see NetworkInterface::connectPeer), a HELLO or PUNCH is sent every interval, up to the given attempts.
+	// A CONNECT is repeated for a new cookie only after the retry time, repeated HELLOs bring several cookies.
+	#define P2PCLOUDS_PUNCH_INTERVAL 200
+	#define P2PCLOUDS_PUNCH_ATTEMPTS 25
+	#define P2PCLOUDS_CONNECT_RETRY_TIME 1000
+
+	// The shard of a session is chosen by the low byte of its KCP conv (see NetworkInterface::shardOfSessionID).
+	#define P2PCLOUDS_MAX_NETWORK_SHARDS 256
+
+	// Batched datagram I/O with recvmmsg()/sendmmsg().
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX
+	#define P2PCLOUDS_HAS_MMSG 1
+#else
+	#define P2PCLOUDS_HAS_MMSG 0
+#endif
+
+	// UDP transport on io_uring (see UdpUring), the kernel decides at runtime whether it is usable.
+#if P2PCLOUDS_HAS_MMSG && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+	#define P2PCLOUDS_HAS_IO_URING 1
+#endif
+#endif
+
+#if !defined(P2PCLOUDS_HAS_IO_URING)
+	#define P2PCLOUDS_HAS_IO_URING 0
+#endif
+
+	// How a NetworkInterface moves datagrams, NetTransportUring falls back to the reactor where io_uring is unavailable.
+	enum NetTransport
+	{
+		NetTransportReactor,		// asio reactor, recvmmsg()/sendmmsg()
+		NetTransportUring
+	};
+
 	typedef uint32_t SessionID;
 
     enum NetEventType
@@ -20,14 +85,33 @@ namespace P2pClouds {
 		NetRcvMsg,
 		NetLagNotify,
 		NetTimeout,
+		NetWritable,
+		NetPunchFailed,
 
         NetCountOfEventType
     };
 
+	// Logical channels of a session, in the order of their priority (see Session::sendPacketKCP).
+	enum NetChannel
+	{
+		NetChannelOrdered,			// reliable and ordered, the default, meant for control and latency critical traffic
+		NetChannelUnordered,		// reliable, a KCP stream of its own, so bulk transfers do not hold back NetChannelOrdered
+		NetChannelUnreliable,		// single datagrams that are never resent, one message has to fit into one segment
+
+		NetChannelCount
+	};
+
+	enum NetSendStatus
+	{
+		NetSendOK,
+		NetSendWouldBlock,
+		NetSendError
+	};
+
     const char* netEventType2Str(NetEventType eventType);
 
 	class Session;
-    typedef void(net_event_callback_t)(std::shared_ptr<Session> /*Session*/, NetEventType /*event_type*/, ByteBuffer* /*datas*/);
+    typedef void(net_event_callback_t)(std::shared_ptr<Session> /*Session*/, NetEventType /*event_type*/, ByteBufferPtr /*datas*/, NetChannel /*channel*/);
 
 
 }
@@ -1,65 +1,351 @@
 #include "connect_packet.h"
 
-namespace P2pClouds {
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 
-	#define CMD_P2PCLOUDS_CONNECT_PACKET "p2pclouds_connect_package hello"
-	#define CMD_P2PCLOUDS_CONNECT_ACK_PACKET "p2pclouds_connect_back_package ack:"
-	#define CMD_P2PCLOUDS_DISCONNECT_PACKET "p2pclouds_disconnect_package request"
+namespace P2pClouds {
 
-	bool ConnectPacket::isConnectPacket(ByteBuffer& datas)
+	ConnectPacket::Type ConnectPacket::controlType(const ByteBuffer& datas)
 	{
-		return (datas.length() == sizeof(CMD_P2PCLOUDS_CONNECT_PACKET) &&
-			memcmp(datas.data(), CMD_P2PCLOUDS_CONNECT_PACKET, sizeof(CMD_P2PCLOUDS_CONNECT_PACKET) - 1) == 0);
+		if (datas.length() < HEADER_SIZE)
+			return CONTROL_NONE;
+
+		const uint8_t* p = datas.data() + datas.rpos();
+		if (p[0] != 0 || p[1] != 0 || p[2] != 0 || p[3] != 0)
+			return CONTROL_NONE;
+
+		if (p[4] != (MAGIC & 0xff) || p[5] != (MAGIC >> 8) || p[6] != VERSION)
+			return CONTROL_NONE;
+
+		if (p[7] <= CONTROL_NONE || p[7] >= CONTROL_MAX)
+			return CONTROL_NONE;
+
+		return (Type)p[7];
 	}
 
-	ByteBuffer ConnectPacket::makeConnectPacket(void)
+	ByteBuffer ConnectPacket::makeHeader(Type type)
 	{
 		ByteBuffer packet;
-		packet << CMD_P2PCLOUDS_CONNECT_PACKET;
+		packet << (uint32_t)0;
+		packet << (uint16_t)MAGIC;
+		packet << (uint8_t)VERSION;
+		packet << (uint8_t)type;
 		return packet;
 	}
 
-	bool ConnectPacket::is_connect_ack_packet(ByteBuffer& datas)
+	ByteBuffer ConnectPacket::makeHelloPacket()
 	{
-		return (datas.length() > sizeof(CMD_P2PCLOUDS_CONNECT_ACK_PACKET) &&
-			memcmp(datas.data(), CMD_P2PCLOUDS_CONNECT_ACK_PACKET, sizeof(CMD_P2PCLOUDS_CONNECT_ACK_PACKET) - 1) == 0);
+		ByteBuffer packet = makeHeader(CONTROL_HELLO);
+
+		// Zero padding, a server answers no more bytes than it got.
+		packet.data_resize(HELLO_SIZE);
+		packet.wpos(HELLO_SIZE);
+		return packet;
 	}
 
-	ByteBuffer ConnectPacket::make_connect_ack_packet(SessionID sessionID)
+	ByteBuffer ConnectPacket::makeCookiePacket(uint32_t timestamp, uint64_t cookie)
 	{
-		ByteBuffer packet;
-		packet << CMD_P2PCLOUDS_CONNECT_ACK_PACKET;
+		ByteBuffer packet = makeHeader(CONTROL_COOKIE);
+		packet << timestamp;
+		packet << cookie;
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makeConnectPacket(uint32_t timestamp, uint64_t cookie)
+	{
+		ByteBuffer packet = makeHeader(CONTROL_CONNECT);
+		packet << timestamp;
+		packet << cookie;
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makeAcceptPacket(SessionID sessionID)
+	{
+		ByteBuffer packet = makeHeader(CONTROL_ACCEPT);
 		packet << sessionID;
 		return packet;
 	}
 
-	SessionID ConnectPacket::get_sessionid_from_connect_ack_packet(ByteBuffer& datas)
+	ByteBuffer ConnectPacket::makeDisconnectPacket(SessionID sessionID)
 	{
-		datas.read_skip<char*>();
-		SessionID sessionID;
-		datas >> sessionID;
-		return sessionID;
+		ByteBuffer packet = makeHeader(CONTROL_DISCONNECT);
+		packet << sessionID;
+		return packet;
 	}
 
-	bool ConnectPacket::is_disconnect_packet(ByteBuffer& datas)
+	ByteBuffer ConnectPacket::makeMtuProbePacket(SessionID sessionID, uint32_t size)
 	{
-		return (datas.length() > sizeof(CMD_P2PCLOUDS_DISCONNECT_PACKET) &&
-			memcmp(datas.data(), CMD_P2PCLOUDS_DISCONNECT_PACKET, sizeof(CMD_P2PCLOUDS_DISCONNECT_PACKET) - 1) == 0);
+		ByteBuffer packet = makeHeader(CONTROL_MTU_PROBE);
+		packet << sessionID;
+		packet << (uint16_t)size;
+
+		// Zero padding up to the probed size.
+		if (size > packet.length())
+		{
+			packet.data_resize(size);
+			packet.wpos((int)size);
+		}
+
+		return packet;
 	}
 
-	ByteBuffer ConnectPacket::make_disconnect_packet(SessionID sessionID)
+	ByteBuffer ConnectPacket::makeMtuAckPacket(SessionID sessionID, uint32_t size)
 	{
-		ByteBuffer packet;
-		packet << CMD_P2PCLOUDS_DISCONNECT_PACKET;
+		ByteBuffer packet = makeHeader(CONTROL_MTU_ACK);
+		packet << sessionID;
+		packet << (uint16_t)size;
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makeFecPacket(Type type, SessionID sessionID, uint32_t dataShards)
+	{
+		ByteBuffer packet = makeHeader(type);
+		packet << sessionID;
+		packet << (uint8_t)dataShards;
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makePathPacket(Type type, SessionID sessionID, uint64_t token)
+	{
+		ByteBuffer packet = makeHeader(type);
 		packet << sessionID;
+		packet << token;
 		return packet;
 	}
 
-	SessionID ConnectPacket::get_sessionid_from_disconnect_packet(ByteBuffer& datas)
+	ByteBuffer ConnectPacket::makePeerPacket(Type type, SessionID sessionID, uint64_t peerID)
 	{
-		datas.read_skip<char*>();
-		SessionID sessionID;
+		ByteBuffer packet = makeHeader(type);
+		packet << sessionID;
+		packet << peerID;
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makeIntroducePacket(SessionID sessionID, uint64_t peerID, bool initiator, const asio::ip::udp::endpoint& peerEndpoint)
+	{
+		ByteBuffer packet = makeHeader(CONTROL_PEER_INTRODUCE);
+		packet << sessionID;
+		packet << peerID;
+		packet << (uint8_t)(initiator ? 1 : 0);
+		writeEndpoint(packet, peerEndpoint);
+		return packet;
+	}
+
+	ByteBuffer ConnectPacket::makePunchPacket()
+	{
+		return makeHeader(CONTROL_PEER_PUNCH);
+	}
+
+	ByteBuffer ConnectPacket::makeDatagramPacket(const ByteBuffer& payload)
+	{
+		ByteBuffer packet = makeHeader(CONTROL_DATAGRAM);
+		packet.append(payload.data() + payload.rpos(), payload.length());
+		return packet;
+	}
+
+	void ConnectPacket::writeEndpoint(ByteBuffer& datas, const asio::ip::udp::endpoint& endpoint)
+	{
+		if (endpoint.address().is_v4())
+		{
+			asio::ip::address_v4::bytes_type bytes = endpoint.address().to_v4().to_bytes();
+			datas << (uint8_t)4;
+			datas.append(bytes.data(), bytes.size());
+		}
+		else
+		{
+			asio::ip::address_v6::bytes_type bytes = endpoint.address().to_v6().to_bytes();
+			datas << (uint8_t)6;
+			datas.append(bytes.data(), bytes.size());
+		}
+
+		datas << (uint16_t)endpoint.port();
+	}
+
+	bool ConnectPacket::readEndpoint(ByteBuffer& datas, asio::ip::udp::endpoint& endpoint)
+	{
+		if (datas.length() < 1)
+			return false;
+
+		uint8_t family;
+		datas >> family;
+
+		uint16_t port;
+		if (family == 4)
+		{
+			asio::ip::address_v4::bytes_type bytes;
+			if (datas.length() < bytes.size() + sizeof(port))
+				return false;
+
+			datas.read(bytes.data(), bytes.size());
+			datas >> port;
+			endpoint = asio::ip::udp::endpoint(asio::ip::address_v4(bytes), port);
+		}
+		else if (family == 6)
+		{
+			asio::ip::address_v6::bytes_type bytes;
+			if (datas.length() < bytes.size() + sizeof(port))
+				return false;
+
+			datas.read(bytes.data(), bytes.size());
+			datas >> port;
+			endpoint = asio::ip::udp::endpoint(asio::ip::address_v6(bytes), port);
+		}
+		else
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	bool ConnectPacket::readCookie(ByteBuffer& datas, uint32_t& timestamp, uint64_t& cookie)
+	{
+		if (datas.length() < HEADER_SIZE + sizeof(timestamp) + sizeof(cookie))
+			return false;
+
+		datas.read_skip(HEADER_SIZE);
+		datas >> timestamp;
+		datas >> cookie;
+		return true;
+	}
+
+	bool ConnectPacket::readSessionID(ByteBuffer& datas, SessionID& sessionID)
+	{
+		if (datas.length() < HEADER_SIZE + sizeof(sessionID))
+			return false;
+
+		datas.read_skip(HEADER_SIZE);
+		datas >> sessionID;
+		return sessionID != 0;
+	}
+
+	ConnectCookie::ConnectCookie(uint32_t lifetime)
+		: secret_()
+		, lifetime_(lifetime)
+	{
+		if (RAND_bytes(secret_, sizeof(secret_)) != 1)
+		{
+			std::random_device rd;
+			for (size_t i = 0; i < sizeof(secret_); ++i)
+				secret_[i] = (uint8_t)rd();
+		}
+	}
+
+	uint64_t ConnectCookie::make(const asio::ip::udp::endpoint& endpoint, uint32_t timestamp) const
+	{
+		uint8_t input[4 + 2 + 16];
+		size_t len = 0;
+
+		memcpy(input, &timestamp, sizeof(timestamp));
+		len += sizeof(timestamp);
+
+		uint16_t port = endpoint.port();
+		memcpy(input + len, &port, sizeof(port));
+		len += sizeof(port);
+
+		if (endpoint.address().is_v4())
+		{
+			asio::ip::address_v4::bytes_type bytes = endpoint.address().to_v4().to_bytes();
+			memcpy(input + len, bytes.data(), bytes.size());
+			len += bytes.size();
+		}
+		else
+		{
+			asio::ip::address_v6::bytes_type bytes = endpoint.address().to_v6().to_bytes();
+			memcpy(input + len, bytes.data(), bytes.size());
+			len += bytes.size();
+		}
+
+		uint8_t mac[EVP_MAX_MD_SIZE];
+		unsigned int macLen = 0;
+		HMAC(EVP_sha256(), secret_, sizeof(secret_), input, len, mac, &macLen);
+
+		uint64_t cookie;
+		memcpy(&cookie, mac, sizeof(cookie));
+		return cookie;
+	}
+
+	bool ConnectCookie::verify(const asio::ip::udp::endpoint& endpoint, uint32_t timestamp, uint64_t cookie, uint32_t now) const
+	{
+		if (timestamp > now || now - timestamp > lifetime_)
+			return false;
+
+		uint64_t expected = make(endpoint, timestamp);
+		return CRYPTO_memcmp(&expected, &cookie, sizeof(cookie)) == 0;
+	}
+
+	bool ConnectPacket::readMtuProbe(ByteBuffer& datas, SessionID& sessionID, uint32_t& size)
+	{
+		size_t length = datas.length();
+		if (length < HEADER_SIZE + sizeof(sessionID) + sizeof(uint16_t))
+			return false;
+
+		bool isProbe = datas.data()[datas.rpos() + HEADER_SIZE - 1] == CONTROL_MTU_PROBE;
+
+		uint16_t probeSize;
+		datas.read_skip(HEADER_SIZE);
+		datas >> sessionID;
+		datas >> probeSize;
+		size = probeSize;
+
+		return sessionID != 0 && (!isProbe || size == length);
+	}
+
+	bool ConnectPacket::readFec(ByteBuffer& datas, SessionID& sessionID, uint32_t& dataShards)
+	{
+		if (datas.length() < HEADER_SIZE + sizeof(sessionID) + sizeof(uint8_t))
+			return false;
+
+		uint8_t shards;
+		datas.read_skip(HEADER_SIZE);
+		datas >> sessionID;
+		datas >> shards;
+		dataShards = shards;
+		return sessionID != 0;
+	}
+
+	bool ConnectPacket::readPeer(ByteBuffer& datas, SessionID& sessionID, uint64_t& peerID)
+	{
+		return readPath(datas, sessionID, peerID);
+	}
+
+	bool ConnectPacket::readIntroduce(ByteBuffer& datas, SessionID& sessionID, uint64_t& peerID, bool& initiator, asio::ip::udp::endpoint& peerEndpoint)
+	{
+		if (datas.length() < HEADER_SIZE + sizeof(sessionID) + sizeof(peerID) + 1)
+			return false;
+
+		uint8_t role;
+		datas.read_skip(HEADER_SIZE);
+		datas >> sessionID;
+		datas >> peerID;
+		datas >> role;
+
+		if (!readEndpoint(datas, peerEndpoint))
+			return false;
+
+		initiator = role != 0;
+		return sessionID != 0 && peerEndpoint.port() != 0;
+	}
+
+	bool ConnectPacket::readDatagram(ByteBuffer& datas)
+	{
+		if (datas.length() < HEADER_SIZE)
+			return false;
+
+		datas.read_skip(HEADER_SIZE);
+		return true;
+	}
+
+	bool ConnectPacket::readPath(ByteBuffer& datas, SessionID& sessionID, uint64_t& token)
+	{
+		if (datas.length() < HEADER_SIZE + sizeof(sessionID) + sizeof(token))
+			return false;
+
+		datas.read_skip(HEADER_SIZE);
 		datas >> sessionID;
-		return sessionID;
+		datas >> token;
+		return sessionID != 0 && token != 0;
 	}
 }
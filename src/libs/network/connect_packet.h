@@ -4,19 +4,134 @@
 
 namespace P2pClouds {
 
+	/*
+		Control packets of the connection handshake.
+
+		Every control packet starts with an 8 byte header: conv 0, which KCP packets never carry because
+		SessionID 0 is never handed out, a 16 bit magic, the protocol version and the packet type.
+
+		client                      server
+		HELLO        ------------>                  no state is kept, padded to the size of the COOKIE
+		             <------------  COOKIE          timestamp + MAC(secret, endpoint, timestamp)
+		CONNECT      ------------>                  echoes the cookie, a session is created only if it verifies
+		             <------------  ACCEPT          sessionID
+
+		MTU_PROBE packets are padded to the probed size and answered with a MTU_ACK (see MtuProber).
+		FEC_REQUEST asks the peer to accept parity datagrams in groups of the given size, FEC_ACK answers
+		with the group size it accepts, 0 for none (see FecEncoder).
+		PATH_CHALLENGE is sent to a new endpoint of a session's peer, which echoes its random token in a
+		PATH_RESPONSE from there before replies are moved to it (see Session::onPathChange).
+
+		Hole punching through a rendezvous node (see NetworkInterface::connectPeer):
+
+		peer A                      rendezvous                  peer B
+		PEER_REGISTER ------------>             <------------   PEER_REGISTER          peer IDs, over their sessions
+		PEER_INTRODUCE_REQUEST --->                                                    the peer ID of B, repeated
+		             <------------  PEER_INTRODUCE ---------->                         public endpoint of the other side
+		             <------------  PEER_UNKNOWN                                       instead, if B is not registered
+		HELLO ...    ---------------------------------------->                         repeated, until the handshake completes
+		             <----------------------------------------  PEER_PUNCH ...         repeated, opens the NAT of B for A
+
+		A request is repeated until the introduction arrives, and while the handshake runs now and then, which
+		also repeats a lost introduction of B. A peer ID stays with the session that registered it first.
+
+		DATAGRAM carries an application payload outside of any session (see NetworkInterface::sendDatagram).
+	*/
 	class ConnectPacket
 	{
 	public:
-		static bool isConnectPacket(ByteBuffer& datas);
-		static ByteBuffer makeConnectPacket(void);
+		enum {
+			HEADER_SIZE = 8,
+			HELLO_SIZE = 20,		// a HELLO is padded to the size of the COOKIE, shorter ones are dropped
+			MAGIC = 0x5032,			// "2P" in little endian
+			VERSION = 1
+		};
+
+		enum Type {
+			CONTROL_NONE = 0,		// not a control packet, or one of another protocol version
+			CONTROL_HELLO,
+			CONTROL_COOKIE,
+			CONTROL_CONNECT,
+			CONTROL_ACCEPT,
+			CONTROL_DISCONNECT,
+			CONTROL_MTU_PROBE,
+			CONTROL_MTU_ACK,
+			CONTROL_FEC_REQUEST,
+			CONTROL_FEC_ACK,
+			CONTROL_PATH_CHALLENGE,
+			CONTROL_PATH_RESPONSE,
+			CONTROL_PEER_REGISTER,
+			CONTROL_PEER_INTRODUCE_REQUEST,
+			CONTROL_PEER_INTRODUCE,
+			CONTROL_PEER_PUNCH,
+			CONTROL_DATAGRAM,
+			CONTROL_PEER_UNKNOWN,
+
+			CONTROL_MAX
+		};
+
+		static Type controlType(const ByteBuffer& datas);
+
+		static ByteBuffer makeHelloPacket();
+		static ByteBuffer makeCookiePacket(uint32_t timestamp, uint64_t cookie);
+		static ByteBuffer makeConnectPacket(uint32_t timestamp, uint64_t cookie);
+		static ByteBuffer makeAcceptPacket(SessionID sessionID);
+		static ByteBuffer makeDisconnectPacket(SessionID sessionID);
+		static ByteBuffer makeMtuProbePacket(SessionID sessionID, uint32_t size);
+		static ByteBuffer makeMtuAckPacket(SessionID sessionID, uint32_t size);
+		static ByteBuffer makeFecPacket(Type type, SessionID sessionID, uint32_t dataShards);
+		static ByteBuffer makePathPacket(Type type, SessionID sessionID, uint64_t token);
+		static ByteBuffer makePeerPacket(Type type, SessionID sessionID, uint64_t peerID);
+		static ByteBuffer makeIntroducePacket(SessionID sessionID, uint64_t peerID, bool initiator, const asio::ip::udp::endpoint& peerEndpoint);
+		static ByteBuffer makePunchPacket();
+		static ByteBuffer makeDatagramPacket(const ByteBuffer& payload);
+
+		// Payload readers of COOKIE/CONNECT and ACCEPT/DISCONNECT, false if the packet is truncated.
+		static bool readCookie(ByteBuffer& datas, uint32_t& timestamp, uint64_t& cookie);
+		static bool readSessionID(ByteBuffer& datas, SessionID& sessionID);
+
+		// Payload reader of MTU_PROBE and MTU_ACK, a probe is only valid if it really has the size it claims.
+		static bool readMtuProbe(ByteBuffer& datas, SessionID& sessionID, uint32_t& size);
+
+		// Payload reader of FEC_REQUEST and FEC_ACK.
+		static bool readFec(ByteBuffer& datas, SessionID& sessionID, uint32_t& dataShards);
+
+		// Payload reader of PATH_CHALLENGE and PATH_RESPONSE.
+		static bool readPath(ByteBuffer& datas, SessionID& sessionID, uint64_t& token);
+
+		// Payload readers of PEER_REGISTER / PEER_INTRODUCE_REQUEST / PEER_UNKNOWN and PEER_INTRODUCE.
+		static bool readPeer(ByteBuffer& datas, SessionID& sessionID, uint64_t& peerID);
+		static bool readIntroduce(ByteBuffer& datas, SessionID& sessionID, uint64_t& peerID, bool& initiator, asio::ip::udp::endpoint& peerEndpoint);
+
+		// Moves the read position of a DATAGRAM to its payload.
+		static bool readDatagram(ByteBuffer& datas);
+
+		// Address family (4 or 6), address bytes and port.
+		static void writeEndpoint(ByteBuffer& datas, const asio::ip::udp::endpoint& endpoint);
+		static bool readEndpoint(ByteBuffer& datas, asio::ip::udp::endpoint& endpoint);
+
+	protected:
+		static ByteBuffer makeHeader(Type type);
+	};
+
+	/*
+		SYN cookie style proof that a peer can receive at its source address.
+		The cookie is a truncated HMAC-SHA256 over the endpoint and a timestamp in seconds, keyed with
+		a random secret of this process, so verifying it needs no per-peer state.
+	*/
+	class ConnectCookie
+	{
+	public:
+		enum { LIFETIME = 10 };		// seconds a cookie is accepted after it was issued
+
+		ConnectCookie(uint32_t lifetime = LIFETIME);
 
-		static ByteBuffer make_connect_ack_packet(SessionID sessionID);
-		static bool is_connect_ack_packet(ByteBuffer& datas);
-		static SessionID get_sessionid_from_connect_ack_packet(ByteBuffer& datas);
+		uint64_t make(const asio::ip::udp::endpoint& endpoint, uint32_t timestamp) const;
+		bool verify(const asio::ip::udp::endpoint& endpoint, uint32_t timestamp, uint64_t cookie, uint32_t now) const;
 
-		static ByteBuffer make_disconnect_packet(SessionID sessionID);
-		static bool is_disconnect_packet(ByteBuffer& datas);
-		static SessionID get_sessionid_from_disconnect_packet(ByteBuffer& datas);
+	protected:
+		uint8_t secret_[32];
+		uint32_t lifetime_;
 	};
 
 }
@@ -0,0 +1,215 @@
+#include "fec.h"
+
+namespace P2pClouds {
+
+	namespace {
+
+		void writeFecHeader(uint8_t* p, uint32_t conv, uint8_t type, uint8_t index, uint16_t lengthXor, uint32_t groupID)
+		{
+			EndianConvert(conv);
+			EndianConvert(lengthXor);
+			EndianConvert(groupID);
+
+			memcpy(p, &conv, sizeof(conv));
+			p[4] = type;
+			p[5] = index;
+			memcpy(p + 6, &lengthXor, sizeof(lengthXor));
+			memcpy(p + 8, &groupID, sizeof(groupID));
+		}
+	}
+
+	FecEncoder::FecEncoder()
+		: dataShards_(0)
+		, groupID_(0)
+		, count_(0)
+		, packet_()
+		, parity_()
+		, parityLength_(0)
+		, lengthXor_(0)
+	{
+	}
+
+	void FecEncoder::setDataShards(uint32_t dataShards)
+	{
+		if (dataShards > 0)
+			dataShards = std::min(std::max(dataShards, (uint32_t)2), (uint32_t)P2PCLOUDS_FEC_MAX_DATA_SHARDS);
+
+		dataShards_ = dataShards;
+	}
+
+	void FecEncoder::wrap(const char* buf, int len)
+	{
+		if (count_ == 0)
+		{
+			parity_.assign(FEC_HEADER_SIZE, 0);
+			parityLength_ = 0;
+			lengthXor_ = 0;
+		}
+
+		uint32_t conv;
+		memcpy(&conv, buf, sizeof(conv));
+		EndianConvert(conv);
+
+		packet_.resize(FEC_HEADER_SIZE + len);
+		writeFecHeader(packet_.data(), conv, FEC_TYPE_DATA, (uint8_t)count_, 0, groupID_);
+		memcpy(packet_.data() + FEC_HEADER_SIZE, buf, len);
+
+		if ((size_t)len > parityLength_)
+		{
+			parity_.resize(FEC_HEADER_SIZE + len, 0);
+			parityLength_ = len;
+		}
+
+		uint8_t* pParity = parity_.data() + FEC_HEADER_SIZE;
+		for (int i = 0; i < len; ++i)
+			pParity[i] ^= (uint8_t)buf[i];
+
+		// The parity takes the conv of the data packets.
+		memcpy(parity_.data(), packet_.data(), sizeof(uint32_t));
+		lengthXor_ ^= (uint16_t)len;
+		++count_;
+	}
+
+	void FecEncoder::finishParity()
+	{
+		uint32_t conv;
+		memcpy(&conv, parity_.data(), sizeof(conv));
+		EndianConvert(conv);
+
+		writeFecHeader(parity_.data(), conv, FEC_TYPE_PARITY, (uint8_t)count_, lengthXor_, groupID_);
+
+		++groupID_;
+		count_ = 0;
+	}
+
+	FecDecoder::FecDecoder()
+		: newestGroupID_(0)
+		, hasGroups_(false)
+		, pLastGroup_(NULL)
+		, recovered_()
+		, recoveredCount_(0)
+	{
+	}
+
+	FecDecoder::Group* FecDecoder::group(uint32_t groupID)
+	{
+		if (!hasGroups_)
+		{
+			newestGroupID_ = groupID;
+			hasGroups_ = true;
+		}
+
+		int32_t diff = (int32_t)(groupID - newestGroupID_);
+		if (diff > 0)
+			newestGroupID_ = groupID;
+		else if (-diff >= GROUP_WINDOW)
+			return NULL;
+
+		// Slots are reused without giving back the capacity of their buffers.
+		Group& group = groups_[groupID % GROUP_WINDOW];
+		if (!group.used || group.id != groupID)
+		{
+			group.id = groupID;
+			group.used = true;
+			group.done = false;
+			group.count = 0;
+			group.received = 0;
+			group.lengthXor = 0;
+			group.hasParity = false;
+		}
+
+		return &group;
+	}
+
+	const uint8_t* FecDecoder::addShard(const uint8_t* p, size_t len, size_t& dataLength)
+	{
+		pLastGroup_ = NULL;
+
+		uint8_t type = p[4];
+		uint8_t index = p[5];
+
+		uint16_t lengthXor;
+		uint32_t groupID;
+		memcpy(&lengthXor, p + 6, sizeof(lengthXor));
+		memcpy(&groupID, p + 8, sizeof(groupID));
+		EndianConvert(lengthXor);
+		EndianConvert(groupID);
+
+		const uint8_t* pPayload = p + FEC_HEADER_SIZE;
+		size_t payloadLength = len - FEC_HEADER_SIZE;
+
+		Group* pGroup = group(groupID);
+
+		if (type == FEC_TYPE_DATA)
+		{
+			dataLength = payloadLength;
+
+			if (pGroup && !pGroup->done && index < P2PCLOUDS_FEC_MAX_DATA_SHARDS && (pGroup->received & (1u << index)) == 0)
+			{
+				pGroup->shards[index].assign(pPayload, pPayload + payloadLength);
+				pGroup->received |= 1u << index;
+				pLastGroup_ = pGroup;
+			}
+
+			return pPayload;
+		}
+
+		if (pGroup && !pGroup->done && !pGroup->hasParity && index > 0 && index <= P2PCLOUDS_FEC_MAX_DATA_SHARDS)
+		{
+			pGroup->parity.assign(pPayload, pPayload + payloadLength);
+			pGroup->lengthXor = lengthXor;
+			pGroup->count = index;
+			pGroup->hasParity = true;
+			pLastGroup_ = pGroup;
+		}
+
+		return NULL;
+	}
+
+	bool FecDecoder::recover(Group& group)
+	{
+		if (group.done || !group.hasParity)
+			return false;
+
+		uint32_t all = group.count >= 32 ? 0xffffffff : ((1u << group.count) - 1);
+		uint32_t missing = all & ~group.received;
+
+		if (missing == 0)
+		{
+			group.done = true;
+			return false;
+		}
+
+		// Only a single loss can be rebuilt.
+		if ((missing & (missing - 1)) != 0)
+			return false;
+
+		group.done = true;
+
+		recovered_ = group.parity;
+		uint16_t length = group.lengthXor;
+
+		for (uint32_t i = 0; i < group.count; ++i)
+		{
+			if ((missing & (1u << i)) != 0)
+				continue;
+
+			const std::vector<uint8_t>& shard = group.shards[i];
+			if (shard.size() > recovered_.size())
+				return false;
+
+			for (size_t j = 0; j < shard.size(); ++j)
+				recovered_[j] ^= shard[j];
+
+			length ^= (uint16_t)shard.size();
+		}
+
+		if (length == 0 || length > recovered_.size())
+			return false;
+
+		recovered_.resize(length);
+		++recoveredCount_;
+		return true;
+	}
+
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	/*
+		Optional XOR parity forward error correction beneath KCP.
+
+		The datagrams KCP outputs are grouped, every group of up to dataShards datagrams is followed by one
+		parity datagram, so one lost datagram per group is rebuilt by the receiver without waiting for a
+		KCP retransmission. Groups are closed early at the end of every KCP flush to keep latency low.
+
+		Every FEC datagram keeps the conv of the session in front, so it is routed like any KCP datagram.
+		The byte after it (the KCP cmd) tells FEC apart from plain KCP:
+
+		conv(4) type(1) index(1) lengthXor(2) groupID(4) payload
+		- data:   index in the group, payload is the KCP datagram
+		- parity: index is the number of data datagrams, payload and lengthXor are the XOR of theirs
+	*/
+	enum {
+		FEC_HEADER_SIZE = 12,
+		FEC_TYPE_DATA = 0xf1,
+		FEC_TYPE_PARITY = 0xf2
+	};
+
+	inline bool isFecPacket(const uint8_t* p, size_t len)
+	{
+		return len >= FEC_HEADER_SIZE && (p[4] == FEC_TYPE_DATA || p[4] == FEC_TYPE_PARITY);
+	}
+
+	class FecEncoder
+	{
+	public:
+		FecEncoder();
+
+		// 0 turns FEC off, otherwise clamped to [2, P2PCLOUDS_FEC_MAX_DATA_SHARDS].
+		void setDataShards(uint32_t dataShards);
+
+		uint32_t dataShards() const {
+			return dataShards_;
+		}
+
+		// Wraps a KCP datagram and passes it to emit(const char*, int), followed by the parity once the group is full.
+		template<typename F>
+		void encode(const char* buf, int len, F&& emit)
+		{
+			wrap(buf, len);
+			emit((const char*)packet_.data(), (int)packet_.size());
+
+			if (count_ >= dataShards_)
+				flush(emit);
+		}
+
+		// Emits the parity of a partly filled group.
+		template<typename F>
+		void flush(F&& emit)
+		{
+			if (count_ == 0)
+				return;
+
+			finishParity();
+			emit((const char*)parity_.data(), (int)(FEC_HEADER_SIZE + parityLength_));
+		}
+
+	protected:
+		void wrap(const char* buf, int len);
+		void finishParity();
+
+	protected:
+		uint32_t dataShards_;
+		uint32_t groupID_;
+		uint32_t count_;
+
+		std::vector<uint8_t> packet_;
+
+		std::vector<uint8_t> parity_;
+		size_t parityLength_;
+		uint16_t lengthXor_;
+	};
+
+	class FecDecoder
+	{
+	public:
+		enum { GROUP_WINDOW = 8 };
+
+		FecDecoder();
+
+		// Passes the KCP datagram of a data packet, and one rebuilt from parity, to deliver(const char*, int).
+		template<typename F>
+		void input(const uint8_t* p, size_t len, F&& deliver)
+		{
+			size_t dataLength;
+			const uint8_t* pData = addShard(p, len, dataLength);
+
+			if (pData)
+				deliver((const char*)pData, (int)dataLength);
+
+			if (pLastGroup_ && recover(*pLastGroup_))
+				deliver((const char*)recovered_.data(), (int)recovered_.size());
+		}
+
+		uint64_t recoveredCount() const {
+			return recoveredCount_;
+		}
+
+	protected:
+		struct Group
+		{
+			Group() : id(0), used(false), done(false), count(0), received(0), lengthXor(0), hasParity(false) {}
+
+			uint32_t id;
+			bool used;
+			bool done;
+			uint32_t count;					// data datagrams in the group, known once the parity arrived
+			uint32_t received;				// bit mask of the data datagrams received
+
+			std::vector<uint8_t> shards[P2PCLOUDS_FEC_MAX_DATA_SHARDS];
+			std::vector<uint8_t> parity;
+			uint16_t lengthXor;
+			bool hasParity;
+		};
+
+		const uint8_t* addShard(const uint8_t* p, size_t len, size_t& dataLength);
+		Group* group(uint32_t groupID);
+		bool recover(Group& group);
+
+	protected:
+		Group groups_[GROUP_WINDOW];
+		uint32_t newestGroupID_;
+		bool hasGroups_;
+
+		Group* pLastGroup_;
+		std::vector<uint8_t> recovered_;
+		uint64_t recoveredCount_;
+	};
+
+}
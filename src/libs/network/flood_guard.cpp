@@ -0,0 +1,182 @@
+#include "flood_guard.h"
+
+#include "log/log.h"
+
+#include <random>
+
+namespace P2pClouds {
+
+	bool TokenBucket::consume(uint64_t now, uint32_t rate, uint32_t burst)
+	{
+		uint64_t capacity = (uint64_t)burst * 1000;
+
+		// Capping the elapsed time first keeps the product from overflowing after a long idle time.
+		uint64_t elapsed = std::min(now - std::min(now, time), capacity / std::max(rate, (uint32_t)1) + 1);
+		tokens = (uint32_t)std::min(capacity, tokens + elapsed * rate);
+		time = now;
+
+		if (tokens < 1000)
+			return false;
+
+		tokens -= 1000;
+		return true;
+	}
+
+	FloodGuard::FloodGuard()
+		: salt_(((uint64_t)std::random_device{}() << 32) | std::random_device{}() | 1)
+		, sources_(SOURCE_SLOTS, SourceSlot{0, TokenBucket()})
+		, prefixes_(PREFIX_SLOTS, PrefixSlot{0, 0})
+		, drops_()
+		, reportedDrops_(0)
+		, reportTime_(0)
+	{
+	}
+
+	uint64_t FloodGuard::sourceKey(const asio::ip::address& address) const
+	{
+		if (address.is_v4())
+			return address.to_v4().to_ulong();
+
+		asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+
+		uint64_t high, low;
+		memcpy(&high, &bytes[0], sizeof(high));
+		memcpy(&low, &bytes[8], sizeof(low));
+		return high ^ (low * 0x9E3779B97F4A7C15ull) ^ (1ull << 63);
+	}
+
+	uint64_t FloodGuard::prefixKey(const asio::ip::address& address) const
+	{
+		if (address.is_v4())
+			return address.to_v4().to_ulong() & 0xffffff00;
+
+		asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
+
+		uint64_t key = 1ull << 63;
+		memcpy(&key, &bytes[0], 6);
+		return key;
+	}
+
+	size_t FloodGuard::slotOf(uint64_t key, size_t numSlots) const
+	{
+		// Multiplicative hashing, the high bits of the product are the best mixed.
+		uint64_t hash = (key ^ salt_) * 0x9E3779B97F4A7C15ull;
+		return (size_t)(hash >> 32) % numSlots;
+	}
+
+	FloodGuard::PrefixSlot& FloodGuard::decayedPrefix(const asio::ip::address& address, uint64_t now)
+	{
+		PrefixSlot& slot = prefixes_[slotOf(prefixKey(address), prefixes_.size())];
+
+		uint64_t halvings = (now - std::min(now, slot.time)) / DECAY_INTERVAL;
+		if (halvings > 0)
+		{
+			slot.score = halvings >= 32 ? 0 : slot.score >> halvings;
+			slot.time = now;
+		}
+
+		return slot;
+	}
+
+	bool FloodGuard::isBlocked(const asio::ip::address& address, uint64_t now)
+	{
+		return decayedPrefix(address, now).score >= BLOCK_THRESHOLD;
+	}
+
+	bool FloodGuard::admit(const asio::ip::address& address, uint64_t now)
+	{
+		if (isBlocked(address, now))
+		{
+			drop(DROP_BLOCKED, address, now);
+			return false;
+		}
+
+		uint64_t key = sourceKey(address);
+		SourceSlot& slot = sources_[slotOf(key, sources_.size())];
+		if (slot.key != key)
+		{
+			slot.key = key;
+			slot.bucket = TokenBucket();
+		}
+
+		if (!slot.bucket.consume(now, P2PCLOUDS_FLOOD_SOURCE_RATE, P2PCLOUDS_FLOOD_SOURCE_BURST))
+		{
+			drop(DROP_SOURCE_RATE, address, now);
+			return false;
+		}
+
+		return true;
+	}
+
+	void FloodGuard::drop(DropReason reason, const asio::ip::address& address, uint64_t now)
+	{
+		++drops_[reason];
+
+		// Garbage, unknown convs and bad cookies are free to send from spoofed addresses, scoring them would let
+		// anyone block the prefix of a peer. Blocked drops do not score either, a prefix is let in again once
+		// it decayed, and blocked again if it is still above the source rate.
+		if (reason != DROP_SOURCE_RATE)
+			return;
+
+		PrefixSlot& slot = decayedPrefix(address, now);
+		if (slot.score < MAX_SCORE)
+			++slot.score;
+	}
+
+	uint64_t FloodGuard::totalDrops() const
+	{
+		uint64_t total = 0;
+		for (int i = 0; i < DROP_REASON_MAX; ++i)
+			total += drops_[i];
+
+		return total;
+	}
+
+	bool FloodGuard::isReportDue(uint64_t now)
+	{
+		uint64_t total = totalDrops();
+		if (total == reportedDrops_ || now < reportTime_)
+			return false;
+
+		reportedDrops_ = total;
+		reportTime_ = now + REPORT_INTERVAL;
+		return true;
+	}
+
+	std::string FloodGuard::statsString() const
+	{
+		std::string s;
+
+		for (int i = 0; i < DROP_REASON_MAX; ++i)
+		{
+			if (i > 0)
+				s += ", ";
+
+			s += fmt::format("{}={}", dropReason2Str((DropReason)i), drops_[i]);
+		}
+
+		return s;
+	}
+
+	const char* FloodGuard::dropReason2Str(DropReason reason)
+	{
+		switch (reason)
+		{
+		case DROP_BLOCKED:
+			return "blocked";
+		case DROP_SOURCE_RATE:
+			return "sourceRate";
+		case DROP_SESSION_RATE:
+			return "sessionRate";
+		case DROP_MALFORMED:
+			return "malformed";
+		case DROP_UNKNOWN_SESSION:
+			return "unknownSession";
+		case DROP_HANDSHAKE:
+			return "handshake";
+		default:
+			return "unknown";
+		}
+	}
+
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	// Token bucket in thousandths of a datagram, refilled from the millisecond tick time.
+	struct TokenBucket
+	{
+		TokenBucket()
+			: tokens(0)
+			, time(0)
+		{
+		}
+
+		// rate in datagrams per second, burst is the capacity. A bucket that was idle long enough is full.
+		bool consume(uint64_t now, uint32_t rate, uint32_t burst);
+
+		uint32_t tokens;
+		uint64_t time;
+	};
+
+	/*
+		Cheap admission checks of the receive path, run before anything is parsed, allocated or logged.
+
+		Every source IP has a token bucket in a direct-mapped table, a new source takes over the slot
+		of an old one (and starts with a full bucket). Datagrams dropped for the rate of their source
+		add to a decaying score of the sender's /24 (/48 for IPv6), a prefix whose score reaches
+		BLOCK_THRESHOLD is dropped entirely until it decays below again. Drops that depend on the
+		content of a datagram do not score, those cost a spoofer nothing, and an open session
+		receiving from its own endpoint is not checked here at all (NetworkInterface::handleDatagram),
+		so spoofed traffic can not cut established peers off.
+		Scores live in a keyless hashed table salted per process, so a collision can only block more,
+		and the salt keeps attackers from aiming collisions at a given prefix.
+
+		Drops are counted per reason instead of being logged one by one. Each shard has its own guard
+		and uses it from its own thread only.
+	*/
+	class FloodGuard
+	{
+	public:
+		enum DropReason
+		{
+			DROP_BLOCKED,				// prefix is on the blocklist
+			DROP_SOURCE_RATE,			// source IP above P2PCLOUDS_FLOOD_SOURCE_RATE
+			DROP_SESSION_RATE,			// session above P2PCLOUDS_FLOOD_SESSION_RATE
+			DROP_MALFORMED,				// too short or an unknown control packet
+			DROP_UNKNOWN_SESSION,		// KCP datagram for a conv that is not open
+			DROP_HANDSHAKE,				// unexpected cookie or accept, invalid cookie
+			DROP_REASON_MAX
+		};
+
+		enum {
+			SOURCE_SLOTS = 4096,
+			PREFIX_SLOTS = 4096,
+			BLOCK_THRESHOLD = 256,		// drops of a prefix, halved every DECAY_INTERVAL
+			MAX_SCORE = BLOCK_THRESHOLD * 4,
+			DECAY_INTERVAL = 1000,		// ms
+			REPORT_INTERVAL = 10000		// ms between two drop reports
+		};
+
+		FloodGuard();
+
+		// False if the datagram is dropped (and counted), the blocklist and the source bucket are checked.
+		bool admit(const asio::ip::address& address, uint64_t now);
+
+		// Counts a dropped datagram, only DROP_SOURCE_RATE adds to the prefix score.
+		void drop(DropReason reason, const asio::ip::address& address, uint64_t now);
+
+		bool isBlocked(const asio::ip::address& address, uint64_t now);
+
+		uint64_t drops(DropReason reason) const {
+			return drops_[reason];
+		}
+
+		uint64_t totalDrops() const;
+
+		// True at most once per REPORT_INTERVAL, and only if there were new drops since the last report.
+		bool isReportDue(uint64_t now);
+
+		std::string statsString() const;
+
+		static const char* dropReason2Str(DropReason reason);
+
+	protected:
+		struct SourceSlot
+		{
+			uint64_t key;
+			TokenBucket bucket;
+		};
+
+		struct PrefixSlot
+		{
+			uint32_t score;
+			uint64_t time;
+		};
+
+		uint64_t sourceKey(const asio::ip::address& address) const;
+		uint64_t prefixKey(const asio::ip::address& address) const;
+
+		size_t slotOf(uint64_t key, size_t numSlots) const;
+
+		PrefixSlot& decayedPrefix(const asio::ip::address& address, uint64_t now);
+
+	protected:
+		uint64_t salt_;
+
+		std::vector<SourceSlot> sources_;
+		std::vector<PrefixSlot> prefixes_;
+
+		uint64_t drops_[DROP_REASON_MAX];
+
+		uint64_t reportedDrops_;
+		uint64_t reportTime_;
+	};
+
+}
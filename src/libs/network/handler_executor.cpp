@@ -0,0 +1,183 @@
+#include "handler_executor.h"
+#include "session.h"
+#include "network_interface.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	namespace {
+		thread_local bool inHandlerThread = false;
+	}
+
+	HandlerExecutor::HandlerExecutor(size_t numThreads, uint32_t maxQueueDepth)
+		: maxQueueDepth_(std::max(maxQueueDepth, (uint32_t)1))
+		, pendingMutex_()
+		, pendingCondition_()
+		, pending_(0)
+		, tasks_(0)
+		, totalWaitMicros_(0)
+		, maxWaitMicros_(0)
+		, throttles_(0)
+		, pool_(std::max(numThreads, (size_t)1))
+	{
+	}
+
+	HandlerExecutor::~HandlerExecutor()
+	{
+	}
+
+	void HandlerExecutor::post(const std::shared_ptr<Session>& pSession, std::function<void()> task)
+	{
+		HandlerStrand& strand = pSession->handlerStrand();
+		++strand.depth_;
+
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+			++pending_;
+		}
+
+		bool idle;
+
+		{
+			std::lock_guard<std::mutex> lock(strand.mutex_);
+			strand.tasks_.push_back(HandlerStrand::Task{ std::move(task), std::chrono::steady_clock::now() });
+
+			idle = !strand.scheduled_;
+			strand.scheduled_ = true;
+		}
+
+		if (idle)
+			schedule(pSession);
+	}
+
+	void HandlerExecutor::schedule(std::shared_ptr<Session> pSession)
+	{
+		// A scheduled run counts as pending too, drain() must not return before it handed its session back.
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+			++pending_;
+		}
+
+		// Moved into run(), the pool must not keep a reference after it.
+		pool_.enqueue([this, pSession](ThreadContex&) mutable { run(std::move(pSession)); });
+	}
+
+	bool HandlerExecutor::isFull(Session& session)
+	{
+		HandlerStrand& strand = session.handlerStrand();
+		if (strand.depth_ < maxQueueDepth_)
+			return false;
+
+		if (!strand.throttled_.exchange(true))
+			++throttles_;
+
+		// The strand may have drained between the check and the flag, its last run() saw no flag then and
+		// nobody would resume the session. Taking the flag back means receiving goes on here.
+		if (strand.depth_ <= maxQueueDepth_ / 2 && strand.throttled_.exchange(false))
+			return false;
+
+		return true;
+	}
+
+	void HandlerExecutor::drain()
+	{
+		std::unique_lock<std::mutex> lock(pendingMutex_);
+		pendingCondition_.wait(lock, [this]() { return pending_ == 0; });
+	}
+
+	bool HandlerExecutor::isHandlerThread()
+	{
+		return inHandlerThread;
+	}
+
+	void HandlerExecutor::run(std::shared_ptr<Session> pSession)
+	{
+		inHandlerThread = true;
+
+		HandlerStrand& strand = pSession->handlerStrand();
+		bool idle = false;
+
+		for (int i = 0; i < MAX_TASKS_PER_RUN; ++i)
+		{
+			HandlerStrand::Task task;
+
+			{
+				std::lock_guard<std::mutex> lock(strand.mutex_);
+				if (strand.tasks_.empty())
+				{
+					strand.scheduled_ = false;
+					idle = true;
+					break;
+				}
+
+				task = std::move(strand.tasks_.front());
+				strand.tasks_.pop_front();
+			}
+
+			uint64_t wait = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - task.queuedTime).count();
+
+			++tasks_;
+			totalWaitMicros_ += wait;
+
+			uint64_t maxWait = maxWaitMicros_;
+			while (wait > maxWait && !maxWaitMicros_.compare_exchange_weak(maxWait, wait))
+				;
+
+			// A throwing handler must not leave the strand scheduled forever.
+			try
+			{
+				task.function();
+			}
+			catch (std::exception& e)
+			{
+				LOG_ERROR("HandlerExecutor::run(): handler error: {}! {}", e.what(), pSession->c_str());
+			}
+			catch (...)
+			{
+				LOG_ERROR("HandlerExecutor::run(): handler error! {}", pSession->c_str());
+			}
+
+			uint32_t depth = --strand.depth_;
+			if (depth <= maxQueueDepth_ / 2 && strand.throttled_.exchange(false))
+				pSession->resumeReceive();
+
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+			if (--pending_ == 0)
+				pendingCondition_.notify_all();
+		}
+
+		// Still scheduled, queue up behind the other sessions. Otherwise this may be the last reference to the session,
+		// it is handed back to its shard so ~Session() runs on the io thread.
+		if (idle)
+		{
+			NetworkInterface& networkInterface = pSession->networkInterface();
+			networkInterface.releaseSession(std::move(pSession));
+		}
+		else
+			schedule(std::move(pSession));
+
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+		if (--pending_ == 0)
+			pendingCondition_.notify_all();
+	}
+
+	HandlerExecutor::Stats HandlerExecutor::stats() const
+	{
+		Stats stats;
+		stats.tasks = tasks_;
+		stats.totalWaitMicros = totalWaitMicros_;
+		stats.maxWaitMicros = maxWaitMicros_;
+		stats.throttles = throttles_;
+		return stats;
+	}
+
+	std::string HandlerExecutor::statsString() const
+	{
+		Stats s = stats();
+		return fmt::format("tasks={}, avgWait={}us, maxWait={}us, throttles={}",
+			s.tasks, s.tasks > 0 ? s.totalWaitMicros / s.tasks : 0, s.maxWaitMicros, s.throttles);
+	}
+
+}
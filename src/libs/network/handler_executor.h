@@ -0,0 +1,117 @@
+#pragma once
+
+#include "common.h"
+#include "common/threadpool.h"
+
+namespace P2pClouds {
+
+	class Session;
+
+	// The events of one session waiting for or running on a HandlerExecutor, owned by the session.
+	class HandlerStrand
+	{
+	public:
+		HandlerStrand()
+			: mutex_()
+			, tasks_()
+			, scheduled_(false)
+			, depth_(0)
+			, throttled_(false)
+		{
+		}
+
+		// Events queued or running.
+		uint32_t depth() const {
+			return depth_;
+		}
+
+	protected:
+		friend class HandlerExecutor;
+
+		struct Task
+		{
+			std::function<void()> function;
+			std::chrono::steady_clock::time_point queuedTime;
+		};
+
+		std::mutex mutex_;
+		std::deque<Task> tasks_;
+		bool scheduled_;				// a pool thread runs the strand or is about to
+
+		std::atomic<uint32_t> depth_;
+		std::atomic<bool> throttled_;	// the session stopped receiving until the strand drains
+	};
+
+	/*
+		Runs the event callbacks of sessions on a ThreadPool instead of the io threads, so a slow handler
+		(block validation) does not stall receiving for every peer.
+
+		Every session has a strand, its events run one after another in the order they were raised while
+		the events of different sessions run in parallel. A strand gives its thread back after MAX_TASKS_PER_RUN
+		events so busy sessions can not starve the others.
+
+		Once maxQueueDepth events of a session wait, the session stops taking messages out of KCP. Its receive
+		window closes and the peer has to wait, receiving resumes when the strand drained to half of it.
+
+		Handlers must not touch a session directly, Session::sendPacketKCP() posts itself to the io thread of the
+		session when it is called on a handler thread. The NetworkInterface drains the executor when it goes down,
+		so no handler is left that could post to it afterwards. A strand that ran dry hands its session back to the shard,
+		the last reference of a session is never dropped on a handler thread.
+	*/
+	class HandlerExecutor
+	{
+	public:
+		enum { MAX_TASKS_PER_RUN = 16 };
+
+		struct Stats
+		{
+			uint64_t tasks;
+			uint64_t totalWaitMicros;		// time from post() until the task started
+			uint64_t maxWaitMicros;
+			uint64_t throttles;				// times a session stopped receiving because its strand was full
+		};
+
+		HandlerExecutor(size_t numThreads, uint32_t maxQueueDepth = P2PCLOUDS_HANDLER_QUEUE_DEPTH);
+		virtual ~HandlerExecutor();
+
+		// Called on the io thread of the session.
+		void post(const std::shared_ptr<Session>& pSession, std::function<void()> task);
+
+		// Called on the io thread of the session before it takes the next message out of KCP.
+		bool isFull(Session& session);
+
+		// Blocks until every posted event ran. Called after the io threads stopped, nothing posts anymore then.
+		void drain();
+
+		uint32_t maxQueueDepth() const {
+			return maxQueueDepth_;
+		}
+
+		// True on the threads of any HandlerExecutor.
+		static bool isHandlerThread();
+
+		Stats stats() const;
+		std::string statsString() const;
+
+	protected:
+		void run(std::shared_ptr<Session> pSession);
+		void schedule(std::shared_ptr<Session> pSession);
+
+	protected:
+		uint32_t maxQueueDepth_;
+
+		// Events posted and not finished yet, drain() waits for 0.
+		std::mutex pendingMutex_;
+		std::condition_variable pendingCondition_;
+		uint64_t pending_;
+
+		std::atomic<uint64_t> tasks_;
+		std::atomic<uint64_t> totalWaitMicros_;
+		std::atomic<uint64_t> maxWaitMicros_;
+		std::atomic<uint64_t> throttles_;
+
+		// Last, so the threads are joined before anything they use goes away.
+		ThreadPool<ThreadContex> pool_;
+	};
+
+}
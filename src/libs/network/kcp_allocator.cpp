@@ -0,0 +1,401 @@
+#include "kcp_allocator.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	// IKCPSEG is 64 bytes plus payload, 1536 holds a full segment of the default 1400 byte MTU, 9216 of jumbo frames.
+	const size_t KcpAllocator::CLASS_SIZES[KcpAllocator::NUM_CLASSES] = { 64, 128, 256, 512, 1024, 1536, 2048, 4096, 9216 };
+
+	namespace {
+
+		const uint32_t BLOCK_MAGIC = 0x4b435041; // "KCPA"
+		const int32_t LARGE_CLASS = -1;
+
+		struct BlockHeader
+		{
+			uint32_t magic;
+			int32_t sizeClass;
+			uint64_t reserved;
+		};
+
+		// Lives in the payload of a free block.
+		struct FreeBlock
+		{
+			FreeBlock* next;
+		};
+
+		struct Depot
+		{
+			Depot() : mutex(), head(NULL), count(0), capacity(0) {}
+
+			std::mutex mutex;
+			FreeBlock* head;
+			size_t count;
+			size_t capacity;
+		};
+
+		struct ThreadCache;
+
+		struct Registry
+		{
+			Registry() : mutex(), caches(), slabBytes(0), largeInUse(0)
+			{
+				for (int i = 0; i < KcpAllocator::NUM_CLASSES; ++i)
+					retiredInUse[i] = 0;
+			}
+
+			Depot depots[KcpAllocator::NUM_CLASSES];
+
+			std::mutex mutex;
+			std::set<ThreadCache*> caches;
+			int64_t retiredInUse[KcpAllocator::NUM_CLASSES];
+
+			std::atomic<size_t> slabBytes;
+			std::atomic<int64_t> largeInUse;
+		};
+
+		// Never destroyed, threads may still free blocks during process exit.
+		Registry& registry()
+		{
+			static Registry* pRegistry = new Registry();
+			return *pRegistry;
+		}
+
+		struct ThreadCache
+		{
+			ThreadCache()
+			{
+				for (int i = 0; i < KcpAllocator::NUM_CLASSES; ++i)
+				{
+					heads[i] = NULL;
+					counts[i] = 0;
+					inUse[i] = 0;
+				}
+
+				std::lock_guard<std::mutex> lg(registry().mutex);
+				registry().caches.insert(this);
+			}
+
+			~ThreadCache()
+			{
+				Registry& reg = registry();
+
+				for (int i = 0; i < KcpAllocator::NUM_CLASSES; ++i)
+				{
+					if (!heads[i])
+						continue;
+
+					FreeBlock* tail = heads[i];
+					while (tail->next)
+						tail = tail->next;
+
+					Depot& depot = reg.depots[i];
+					std::lock_guard<std::mutex> lg(depot.mutex);
+					tail->next = depot.head;
+					depot.head = heads[i];
+					depot.count += counts[i];
+				}
+
+				std::lock_guard<std::mutex> lg(reg.mutex);
+				for (int i = 0; i < KcpAllocator::NUM_CLASSES; ++i)
+					reg.retiredInUse[i] += inUse[i].load(std::memory_order_relaxed);
+
+				reg.caches.erase(this);
+			}
+
+			FreeBlock* heads[KcpAllocator::NUM_CLASSES];
+			size_t counts[KcpAllocator::NUM_CLASSES];
+
+			// Only written by the owning thread, may go negative if blocks are freed by other threads.
+			std::atomic<int64_t> inUse[KcpAllocator::NUM_CLASSES];
+		};
+
+		enum ThreadCacheState { CACHE_NONE, CACHE_ACTIVE, CACHE_DEAD };
+
+		thread_local ThreadCache* t_pCache = NULL;
+		thread_local ThreadCacheState t_cacheState = CACHE_NONE;
+
+		struct ThreadCacheGuard
+		{
+			void touch() {}
+
+			~ThreadCacheGuard()
+			{
+				t_cacheState = CACHE_DEAD;
+				delete t_pCache;
+				t_pCache = NULL;
+			}
+		};
+
+		thread_local ThreadCacheGuard t_cacheGuard;
+
+		ThreadCache* threadCache()
+		{
+			if (t_cacheState == CACHE_NONE)
+			{
+				t_cacheGuard.touch();
+				t_pCache = new ThreadCache();
+				t_cacheState = CACHE_ACTIVE;
+			}
+
+			return t_pCache;
+		}
+
+		int sizeClassOf(size_t size)
+		{
+			for (int i = 0; i < KcpAllocator::NUM_CLASSES; ++i)
+			{
+				if (size <= KcpAllocator::CLASS_SIZES[i])
+					return i;
+			}
+
+			return LARGE_CLASS;
+		}
+
+		size_t blockStride(int sizeClass)
+		{
+			return KcpAllocator::HEADER_SIZE + KcpAllocator::CLASS_SIZES[sizeClass];
+		}
+
+		size_t threadCacheLimit(int sizeClass)
+		{
+			return std::max((size_t)KcpAllocator::TRANSFER_BATCH * 2, (size_t)KcpAllocator::THREAD_CACHE_BYTES / KcpAllocator::CLASS_SIZES[sizeClass]);
+		}
+
+		// Takes up to TRANSFER_BATCH blocks from the depot, carving a new slab if it is empty. Called with the depot locked.
+		FreeBlock* takeFromDepot(Depot& depot, int sizeClass, size_t& count)
+		{
+			if (!depot.head)
+			{
+				size_t stride = blockStride(sizeClass);
+				size_t numBlocks = std::max((size_t)KcpAllocator::SLAB_SIZE / stride, (size_t)8);
+
+				char* pSlab = (char*)malloc(stride * numBlocks);
+				if (!pSlab)
+				{
+					count = 0;
+					return NULL;
+				}
+
+				for (size_t i = 0; i < numBlocks; ++i)
+				{
+					BlockHeader* pHeader = (BlockHeader*)(pSlab + i * stride);
+					pHeader->magic = BLOCK_MAGIC;
+					pHeader->sizeClass = sizeClass;
+
+					FreeBlock* pBlock = (FreeBlock*)(pHeader + 1);
+					pBlock->next = depot.head;
+					depot.head = pBlock;
+				}
+
+				depot.count += numBlocks;
+				depot.capacity += numBlocks;
+				registry().slabBytes += stride * numBlocks;
+			}
+
+			FreeBlock* head = depot.head;
+			FreeBlock* tail = head;
+			count = 1;
+
+			while (count < KcpAllocator::TRANSFER_BATCH && tail->next)
+			{
+				tail = tail->next;
+				++count;
+			}
+
+			depot.head = tail->next;
+			depot.count -= count;
+			tail->next = NULL;
+			return head;
+		}
+	}
+
+	void KcpAllocator::install()
+	{
+		static std::once_flag installed;
+
+		std::call_once(installed, []()
+		{
+			ikcp_allocator(&KcpAllocator::allocate, &KcpAllocator::deallocate);
+			LOG_INFO("KcpAllocator::install(): KCP segments use the slab allocator.");
+		});
+	}
+
+	void* KcpAllocator::allocate(size_t size)
+	{
+		int sizeClass = sizeClassOf(size);
+
+		if (sizeClass == LARGE_CLASS)
+		{
+			BlockHeader* pHeader = (BlockHeader*)malloc(HEADER_SIZE + size);
+			if (!pHeader)
+				return NULL;
+
+			pHeader->magic = BLOCK_MAGIC;
+			pHeader->sizeClass = LARGE_CLASS;
+			registry().largeInUse++;
+			return pHeader + 1;
+		}
+
+		ThreadCache* pCache = threadCache();
+		FreeBlock* pBlock;
+
+		if (pCache)
+		{
+			if (!pCache->heads[sizeClass])
+			{
+				Depot& depot = registry().depots[sizeClass];
+				std::lock_guard<std::mutex> lg(depot.mutex);
+				pCache->heads[sizeClass] = takeFromDepot(depot, sizeClass, pCache->counts[sizeClass]);
+
+				if (!pCache->heads[sizeClass])
+					return NULL;
+			}
+
+			pBlock = pCache->heads[sizeClass];
+			pCache->heads[sizeClass] = pBlock->next;
+			pCache->counts[sizeClass]--;
+			pCache->inUse[sizeClass].store(pCache->inUse[sizeClass].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+		else
+		{
+			// The thread is exiting, go to the depot directly.
+			Depot& depot = registry().depots[sizeClass];
+			std::lock_guard<std::mutex> lg(depot.mutex);
+
+			size_t count;
+			pBlock = takeFromDepot(depot, sizeClass, count);
+			if (!pBlock)
+				return NULL;
+
+			if (pBlock->next)
+			{
+				FreeBlock* tail = pBlock->next;
+				while (tail->next)
+					tail = tail->next;
+
+				tail->next = depot.head;
+				depot.head = pBlock->next;
+				depot.count += count - 1;
+			}
+
+			std::lock_guard<std::mutex> lgr(registry().mutex);
+			registry().retiredInUse[sizeClass]++;
+		}
+
+		return pBlock;
+	}
+
+	void KcpAllocator::deallocate(void* ptr)
+	{
+		if (!ptr)
+			return;
+
+		BlockHeader* pHeader = (BlockHeader*)ptr - 1;
+		assert(pHeader->magic == BLOCK_MAGIC);
+
+		int sizeClass = pHeader->sizeClass;
+		if (sizeClass == LARGE_CLASS)
+		{
+			registry().largeInUse--;
+			free(pHeader);
+			return;
+		}
+
+		FreeBlock* pBlock = (FreeBlock*)ptr;
+		ThreadCache* pCache = threadCache();
+
+		if (!pCache)
+		{
+			Depot& depot = registry().depots[sizeClass];
+			{
+				std::lock_guard<std::mutex> lg(depot.mutex);
+				pBlock->next = depot.head;
+				depot.head = pBlock;
+				depot.count++;
+			}
+
+			std::lock_guard<std::mutex> lgr(registry().mutex);
+			registry().retiredInUse[sizeClass]--;
+			return;
+		}
+
+		pBlock->next = pCache->heads[sizeClass];
+		pCache->heads[sizeClass] = pBlock;
+		pCache->counts[sizeClass]++;
+		pCache->inUse[sizeClass].store(pCache->inUse[sizeClass].load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+
+		// Hand a batch back once this thread holds more than its share, e.g. when it frees what others allocated.
+		if (pCache->counts[sizeClass] > threadCacheLimit(sizeClass))
+		{
+			FreeBlock* head = pCache->heads[sizeClass];
+			FreeBlock* tail = head;
+
+			for (int i = 1; i < TRANSFER_BATCH; ++i)
+				tail = tail->next;
+
+			pCache->heads[sizeClass] = tail->next;
+			pCache->counts[sizeClass] -= TRANSFER_BATCH;
+
+			Depot& depot = registry().depots[sizeClass];
+			std::lock_guard<std::mutex> lg(depot.mutex);
+			tail->next = depot.head;
+			depot.head = head;
+			depot.count += TRANSFER_BATCH;
+		}
+	}
+
+	KcpAllocator::Stats KcpAllocator::stats()
+	{
+		Registry& reg = registry();
+		Stats stats;
+
+		for (int i = 0; i < NUM_CLASSES; ++i)
+		{
+			ClassStats& classStats = stats.classes[i];
+			classStats.blockSize = CLASS_SIZES[i];
+
+			Depot& depot = reg.depots[i];
+			std::lock_guard<std::mutex> lg(depot.mutex);
+			classStats.capacity = depot.capacity;
+			classStats.cached = depot.count;
+		}
+
+		{
+			std::lock_guard<std::mutex> lg(reg.mutex);
+
+			for (int i = 0; i < NUM_CLASSES; ++i)
+			{
+				int64_t inUse = reg.retiredInUse[i];
+
+				for (ThreadCache* pCache : reg.caches)
+					inUse += pCache->inUse[i].load(std::memory_order_relaxed);
+
+				stats.classes[i].inUse = (size_t)std::max(inUse, (int64_t)0);
+			}
+		}
+
+		stats.slabBytes = reg.slabBytes.load();
+		stats.largeInUse = (size_t)std::max(reg.largeInUse.load(), (int64_t)0);
+		return stats;
+	}
+
+	std::string KcpAllocator::statsString()
+	{
+		Stats s = stats();
+		std::string str = fmt::format("slabBytes={}, large={}", s.slabBytes, s.largeInUse);
+
+		for (int i = 0; i < NUM_CLASSES; ++i)
+		{
+			const ClassStats& c = s.classes[i];
+			if (c.capacity == 0)
+				continue;
+
+			str += fmt::format(", [{}]: {}/{} ({:.1f}%)", c.blockSize, c.inUse, c.capacity, c.inUse * 100.0 / c.capacity);
+		}
+
+		return str;
+	}
+
+}
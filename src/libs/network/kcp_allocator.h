@@ -0,0 +1,54 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	/*
+		Size-class slab allocator installed into KCP with ikcp_allocator().
+
+		Every KCP segment is a malloc/free of IKCPSEG plus its payload, so the classes are sized around
+		the MTU. Blocks are carved from slabs, each thread keeps its own free lists and only goes to the
+		shared depot (under a lock) in batches, so the io threads of different shards do not contend.
+		Slabs are never returned to the system. Blocks larger than the largest class use malloc().
+	*/
+	class KcpAllocator
+	{
+	public:
+		enum {
+			NUM_CLASSES = 9,
+			HEADER_SIZE = 16,			// keeps the payload 16 byte aligned
+			SLAB_SIZE = 64 * 1024,
+			THREAD_CACHE_BYTES = 256 * 1024,
+			TRANSFER_BATCH = 32
+		};
+
+		struct ClassStats
+		{
+			size_t blockSize;
+			size_t capacity;			// blocks carved from slabs
+			size_t inUse;				// blocks handed out to KCP
+			size_t cached;				// blocks in the shared depot
+		};
+
+		struct Stats
+		{
+			ClassStats classes[NUM_CLASSES];
+			size_t slabBytes;
+			size_t largeInUse;			// blocks above the largest class
+		};
+
+		// Installs the allocator into KCP, only the first call has an effect.
+		// Must happen before the first ikcp_create(), memory from malloc() can not be freed here.
+		static void install();
+
+		static void* allocate(size_t size);
+		static void deallocate(void* ptr);
+
+		static Stats stats();
+		static std::string statsString();
+
+		static const size_t CLASS_SIZES[NUM_CLASSES];
+	};
+
+}
@@ -0,0 +1,135 @@
+#include "kcp_tuner.h"
+
+namespace P2pClouds {
+
+	namespace {
+
+		const IUINT32 KCP_OVERHEAD = 24;
+		const uint8_t KCP_CMD_PUSH = 81;
+	}
+
+	KcpTuner::KcpTuner(const KcpTuningPolicy& policy)
+		: policy_(policy)
+		, nextSampleTime_(0)
+		, lastSndNxt_(0)
+		, lastTimeouts_(0)
+		, nextSn_(0)
+		, retransmits_(0)
+		, lagging_(false)
+	{
+	}
+
+	void KcpTuner::reset(ikcpcb* pKCP, uint64_t now)
+	{
+		nextSampleTime_ = now + policy_.sampleInterval;
+		lastSndNxt_ = pKCP->snd_nxt;
+		lastTimeouts_ = pKCP->xmit;
+		nextSn_ = pKCP->snd_nxt;
+		retransmits_ = 0;
+		lagging_ = false;
+	}
+
+	void KcpTuner::onOutput(const char* buf, int len)
+	{
+		if (!policy_.enabled)
+			return;
+
+		// A datagram holds whole segments: conv(4) cmd(1) frg(1) wnd(2) ts(4) sn(4) una(4) len(4) data(len).
+		const uint8_t* p = (const uint8_t*)buf;
+		const uint8_t* pEnd = p + len;
+
+		while (pEnd - p >= (ptrdiff_t)KCP_OVERHEAD)
+		{
+			uint32_t sn, dataLen;
+			memcpy(&sn, p + 12, sizeof(sn));
+			memcpy(&dataLen, p + 20, sizeof(dataLen));
+			EndianConvert(sn);
+			EndianConvert(dataLen);
+
+			if (p[4] == KCP_CMD_PUSH)
+			{
+				if ((int32_t)(sn - nextSn_) < 0)
+					++retransmits_;
+				else
+					nextSn_ = sn + 1;
+			}
+
+			if (dataLen > (uint32_t)(pEnd - p) - KCP_OVERHEAD)
+				break;
+
+			p += KCP_OVERHEAD + dataLen;
+		}
+	}
+
+	KcpTuner::LagChange KcpTuner::update(ikcpcb* pKCP, uint64_t now)
+	{
+		if (!policy_.enabled || now < nextSampleTime_)
+			return LAG_NONE;
+
+		nextSampleTime_ = now + policy_.sampleInterval;
+
+		uint32_t sent = pKCP->snd_nxt - lastSndNxt_;
+		uint32_t timeouts = pKCP->xmit - lastTimeouts_;
+		uint32_t retransmits = std::max(retransmits_, timeouts);
+
+		lastSndNxt_ = pKCP->snd_nxt;
+		lastTimeouts_ = pKCP->xmit;
+		retransmits_ = 0;
+
+		// No RTT sample yet.
+		if (pKCP->rx_srtt <= 0)
+			return LAG_NONE;
+
+		adjust(pKCP, sent, retransmits, timeouts);
+
+		if (!lagging_ && (uint32_t)pKCP->rx_srtt >= policy_.lagRtt)
+		{
+			lagging_ = true;
+			return LAG_ENTER;
+		}
+
+		if (lagging_ && (uint32_t)pKCP->rx_srtt < policy_.lagRtt * 3 / 4)
+		{
+			lagging_ = false;
+			return LAG_LEAVE;
+		}
+
+		return LAG_NONE;
+	}
+
+	void KcpTuner::adjust(ikcpcb* pKCP, uint32_t sent, uint32_t retransmits, uint32_t timeouts)
+	{
+		uint32_t srtt = (uint32_t)pKCP->rx_srtt;
+		uint32_t rttval = (uint32_t)pKCP->rx_rttval;
+
+		double lossRate = (double)retransmits / std::max(sent + retransmits, (uint32_t)1);
+		bool highJitter = rttval * 2 > srtt;
+
+		uint32_t sendWindow = pKCP->snd_wnd;
+
+		if (lossRate > policy_.highLossRate)
+			sendWindow = std::max(sendWindow / 2, policy_.minSendWindow);
+		else if (pKCP->nsnd_que > 0)
+			sendWindow = std::min(sendWindow * 2, policy_.maxSendWindow);
+
+		sendWindow = std::min(std::max(sendWindow, policy_.minSendWindow), policy_.maxSendWindow);
+
+		// The peer's window is our receive window, keep it at least as large (and never below 256, see Session::init_kcp).
+		if (sendWindow != pKCP->snd_wnd)
+			ikcp_wndsize(pKCP, (int)sendWindow, (int)std::max(sendWindow, std::max(pKCP->rcv_wnd, (IUINT32)256)));
+
+		uint32_t interval = std::min(std::max(srtt / 8, policy_.minInterval), policy_.maxInterval);
+
+		// Fast retransmits beyond the timeouts on a jittery path are mostly reordering.
+		int resend = pKCP->fastresend;
+		if (highJitter && retransmits > timeouts)
+			resend = std::min(resend + 1, (int)policy_.maxResend);
+		else if (!highJitter)
+			resend = std::max(resend - 1, (int)policy_.minResend);
+
+		resend = std::min(std::max(resend, (int)policy_.minResend), (int)policy_.maxResend);
+
+		ikcp_nodelay(pKCP, highJitter ? 0 : 1, (int)interval, resend, -1);
+	}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	// Bounds and thresholds of KcpTuner, shared by all sessions of a NetworkInterface.
+	struct KcpTuningPolicy
+	{
+		KcpTuningPolicy()
+			: enabled(true)
+			, sampleInterval(1000)
+			, minSendWindow(32)
+			, maxSendWindow(1024)
+			, minInterval(10)
+			, maxInterval(100)
+			, minResend(2)
+			, maxResend(5)
+			, highLossRate(0.05)
+			, lagRtt(300)
+		{
+		}
+
+		bool enabled;
+
+		uint32_t sampleInterval;		// ms between two adjustments
+
+		uint32_t minSendWindow;			// segments
+		uint32_t maxSendWindow;
+
+		uint32_t minInterval;			// ms, KCP clamps to [10, 5000]
+		uint32_t maxInterval;
+
+		uint32_t minResend;				// duplicate acks that trigger a fast retransmit
+		uint32_t maxResend;
+
+		double highLossRate;			// retransmitted / sent segments above which the window shrinks
+
+		uint32_t lagRtt;				// ms of smoothed RTT at which NetLagNotify is raised
+	};
+
+	/*
+		Adjusts the KCP parameters of one session from what the connection measures.
+
+		Every sampleInterval the retransmissions since the last sample (counted from the segments passed
+		to output, KCP itself only counts timeouts) and the RTT estimates of KCP are looked at:
+
+		- the send window doubles while messages wait in the send queue and loss is low, and halves on high loss
+		- the flush interval follows the RTT (srtt / 8), LAN peers get the minimum
+		- with high jitter (rttval > srtt / 2) most fast retransmits are reorderings, the fast resend threshold
+		  goes up and nodelay is switched off for a more conservative RTO, with low jitter both go back
+	*/
+	class KcpTuner
+	{
+	public:
+		enum LagChange { LAG_NONE, LAG_ENTER, LAG_LEAVE };
+
+		KcpTuner(const KcpTuningPolicy& policy);
+
+		void reset(ikcpcb* pKCP, uint64_t now);
+
+		// Counts the retransmitted data segments of a datagram produced by KCP output.
+		void onOutput(const char* buf, int len);
+
+		// Called from the session update, adjusts pKCP once per sampleInterval.
+		LagChange update(ikcpcb* pKCP, uint64_t now);
+
+		bool isLagging() const {
+			return lagging_;
+		}
+
+	protected:
+		void adjust(ikcpcb* pKCP, uint32_t sent, uint32_t retransmits, uint32_t timeouts);
+
+	protected:
+		KcpTuningPolicy policy_;
+
+		uint64_t nextSampleTime_;
+
+		uint32_t lastSndNxt_;
+		uint32_t lastTimeouts_;
+		uint32_t nextSn_;				// sn after the highest data segment sent so far
+		uint32_t retransmits_;
+
+		bool lagging_;
+	};
+
+}
@@ -0,0 +1,100 @@
+#include "message.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	MessageRegistry::MessageRegistry()
+		: handlers_()
+		, reportTime_(0)
+	{
+		for (std::atomic<uint64_t>& errors : errors_)
+			errors = 0;
+	}
+
+	MessageRegistry::~MessageRegistry()
+	{
+	}
+
+	void MessageRegistry::setHandler(uint16_t opcode, void* pObject, Invoker invoker)
+	{
+		// Dense, opcodes are expected to be numbered from 1 without large gaps.
+		if (opcode >= handlers_.size())
+			handlers_.resize(opcode + 1, Entry{ NULL, NULL });
+
+		handlers_[opcode] = Entry{ pObject, invoker };
+	}
+
+	void MessageRegistry::unregisterHandler(uint16_t opcode)
+	{
+		if (opcode < handlers_.size())
+			handlers_[opcode] = Entry{ NULL, NULL };
+	}
+
+	bool MessageRegistry::readHeader(ByteBuffer& datas, MessageHeader& header)
+	{
+		if (datas.length() < MessageHeader::SIZE)
+			return false;
+
+		datas >> header.opcode >> header.flags >> header.length;
+		return true;
+	}
+
+	MessageRegistry::DispatchResult MessageRegistry::dispatch(Session& session, ByteBuffer& datas) const
+	{
+		MessageHeader header;
+		if (!readHeader(datas, header) || header.length > datas.length())
+		{
+			datas.rpos((int)datas.wpos());
+			countError(DISPATCH_MALFORMED, session);
+			return DISPATCH_MALFORMED;
+		}
+
+		size_t end = datas.rpos() + header.length;
+
+		if (!hasHandler(header.opcode))
+		{
+			datas.rpos((int)end);
+			countError(DISPATCH_UNKNOWN, session);
+			return DISPATCH_UNKNOWN;
+		}
+
+		// The handler decodes straight from datas, limited to the body so it can not read into the next message.
+		size_t wpos = datas.wpos();
+		datas.wpos((int)end);
+
+		const Entry& entry = handlers_[header.opcode];
+		bool decoded = entry.invoker(entry.pObject, session, datas);
+
+		datas.wpos((int)wpos);
+		datas.rpos((int)end);
+
+		if (!decoded)
+		{
+			countError(DISPATCH_MALFORMED, session);
+			return DISPATCH_MALFORMED;
+		}
+
+		return DISPATCH_OK;
+	}
+
+	void MessageRegistry::countError(DispatchResult result, Session& session) const
+	{
+		++errors_[result];
+
+		uint64_t now = getMonotonicTime();
+		uint64_t reportTime = reportTime_;
+
+		// One thread wins the report, the others only count.
+		if (now < reportTime || !reportTime_.compare_exchange_strong(reportTime, now + REPORT_INTERVAL))
+			return;
+
+		LOG_WARNING("MessageRegistry::dispatch(): bad messages: {}, last from {}", statsString(), session.c_str());
+	}
+
+	std::string MessageRegistry::statsString() const
+	{
+		return fmt::format("unknown={}, malformed={}", errors_[DISPATCH_UNKNOWN].load(), errors_[DISPATCH_MALFORMED].load());
+	}
+
+}
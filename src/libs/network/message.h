@@ -0,0 +1,197 @@
+#pragma once
+
+#include "common.h"
+#include "session.h"
+
+namespace P2pClouds {
+
+	/*
+		Typed application messages.
+
+		Every message starts with a 7 byte header, opcode(2) flags(1) length(4) of the body, followed by its fields.
+		A message is a plain struct with a compile time opcode and one template that lists its fields,
+		it generates both the encoder and the decoder:
+
+		struct PingMessage
+		{
+			enum { OPCODE = 1 };
+
+			uint64_t nonce;
+
+			template<typename S>
+			void fields(S& s) {
+				s & nonce;
+			}
+		};
+
+		Fields are written with the ByteBuffer operators, fields appended in a later version are skipped by
+		older decoders since the body length is known.
+	*/
+	struct MessageHeader
+	{
+		enum { SIZE = 7 };
+
+		uint16_t opcode;
+		uint8_t flags;
+		uint32_t length;
+	};
+
+	class MessageWriter
+	{
+	public:
+		MessageWriter(ByteBuffer& datas)
+			: datas_(datas)
+		{
+		}
+
+		template<typename T>
+		MessageWriter& operator&(const T& value)
+		{
+			datas_ << value;
+			return *this;
+		}
+
+	protected:
+		ByteBuffer& datas_;
+	};
+
+	// Throws ByteBuffer::Exception if the body is shorter than the fields.
+	class MessageReader
+	{
+	public:
+		MessageReader(ByteBuffer& datas)
+			: datas_(datas)
+		{
+		}
+
+		template<typename T>
+		MessageReader& operator&(T& value)
+		{
+			datas_ >> value;
+			return *this;
+		}
+
+	protected:
+		ByteBuffer& datas_;
+	};
+
+	// Appends the header and the fields of message to datas.
+	template<typename M>
+	void encodeMessage(ByteBuffer& datas, const M& message, uint8_t flags = 0)
+	{
+		static_assert(M::OPCODE > 0 && M::OPCODE <= 0xffff, "message opcodes are 1..0xffff");
+
+		size_t start = datas.wpos();
+		datas << (uint16_t)M::OPCODE << flags << (uint32_t)0;
+
+		// fields() only reads the message while encoding.
+		MessageWriter writer(datas);
+		const_cast<M&>(message).fields(writer);
+
+		uint32_t length = (uint32_t)(datas.wpos() - start - MessageHeader::SIZE);
+		EndianConvert(length);
+		datas.put(start + 3, (const uint8_t*)&length, sizeof(length));
+	}
+
+	template<typename M>
+	NetSendStatus sendMessage(Session& session, const M& message, NetChannel channel = NetChannelOrdered)
+	{
+		ByteBuffer datas;
+		encodeMessage(datas, message);
+		return session.sendPacketKCP(datas, channel);
+	}
+
+	/*
+		Decodes messages and calls the handler registered for their type.
+
+		Handlers are member functions bound at compile time, the table is indexed by opcode and holds
+		one object pointer and one function pointer per opcode, so a dispatch is a bounds check,
+		an indirect call and the decoding of the fields.
+
+		registry.registerHandler<PingMessage, App, &App::onPing>(this);
+	*/
+	class MessageRegistry
+	{
+	public:
+		enum DispatchResult
+		{
+			DISPATCH_OK,
+			DISPATCH_UNKNOWN,			// no handler for the opcode
+			DISPATCH_MALFORMED,			// truncated header or body
+			DISPATCH_RESULT_MAX
+		};
+
+		enum { REPORT_INTERVAL = 10000 };	// ms between two error reports
+
+		MessageRegistry();
+		virtual ~MessageRegistry();
+
+		template<typename M, typename T, void (T::*Handler)(Session&, const M&)>
+		void registerHandler(T* pObject)
+		{
+			static_assert(M::OPCODE > 0 && M::OPCODE <= 0xffff, "message opcodes are 1..0xffff");
+			setHandler((uint16_t)M::OPCODE, pObject, &invoke<M, T, Handler>);
+		}
+
+		void unregisterHandler(uint16_t opcode);
+
+		bool hasHandler(uint16_t opcode) const {
+			return opcode < handlers_.size() && handlers_[opcode].invoker != NULL;
+		}
+
+		// Decodes the message at the read position of datas and calls its handler.
+		// The read position is moved past the message even if it is not handled, so several messages can follow each other.
+		DispatchResult dispatch(Session& session, ByteBuffer& datas) const;
+
+		static bool readHeader(ByteBuffer& datas, MessageHeader& header);
+
+		// Messages that failed with result, on all sessions.
+		uint64_t errors(DispatchResult result) const {
+			return errors_[result];
+		}
+
+		std::string statsString() const;
+
+	protected:
+		// datas is limited to the body of the message, false if it is too short for the fields.
+		typedef bool (*Invoker)(void* pObject, Session& session, ByteBuffer& datas);
+
+		struct Entry
+		{
+			void* pObject;
+			Invoker invoker;
+		};
+
+		template<typename M, typename T, void (T::*Handler)(Session&, const M&)>
+		static bool invoke(void* pObject, Session& session, ByteBuffer& datas)
+		{
+			M message;
+
+			try
+			{
+				MessageReader reader(datas);
+				message.fields(reader);
+			}
+			catch (ByteBuffer::Exception&)
+			{
+				return false;
+			}
+
+			(static_cast<T*>(pObject)->*Handler)(session, message);
+			return true;
+		}
+
+		void setHandler(uint16_t opcode, void* pObject, Invoker invoker);
+
+		// A peer could flood the log with bad messages, errors are counted and reported at most once per REPORT_INTERVAL.
+		void countError(DispatchResult result, Session& session) const;
+
+	protected:
+		std::vector<Entry> handlers_;
+
+		// dispatch() runs on the threads of all shards.
+		mutable std::atomic<uint64_t> errors_[DISPATCH_RESULT_MAX];
+		mutable std::atomic<uint64_t> reportTime_;
+	};
+
+}
@@ -0,0 +1,106 @@
+#include "message_pool.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	MessagePool::MessagePool()
+		: mutex_()
+	{
+	}
+
+	MessagePool::~MessagePool()
+	{
+		for (int i = 0; i < NUM_CLASSES; ++i)
+		{
+			for (ByteBuffer* pBuffer : freeLists_[i])
+				delete pBuffer;
+
+			freeLists_[i].clear();
+		}
+	}
+
+	std::shared_ptr<MessagePool> MessagePool::create()
+	{
+		return std::make_shared<MessagePool>();
+	}
+
+	int MessagePool::sizeClass(size_t size)
+	{
+		int bits = MIN_CLASS_BITS;
+		while (bits <= MAX_CLASS_BITS && ((size_t)1 << bits) < size)
+			++bits;
+
+		return bits > MAX_CLASS_BITS ? -1 : bits - MIN_CLASS_BITS;
+	}
+
+	ByteBufferPtr MessagePool::allocate(size_t size)
+	{
+		int cls = sizeClass(size);
+
+		if (cls < 0)
+		{
+			ByteBufferPtr pBuffer = std::make_shared<ByteBuffer>(size);
+			pBuffer->data_resize(size);
+			pBuffer->wpos((int)size);
+			return pBuffer;
+		}
+
+		ByteBuffer* pBuffer = NULL;
+
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			std::vector<ByteBuffer*>& freeList = freeLists_[cls];
+
+			if (!freeList.empty())
+			{
+				pBuffer = freeList.back();
+				freeList.pop_back();
+			}
+		}
+
+		if (!pBuffer)
+		{
+			size_t classSize = (size_t)1 << (cls + MIN_CLASS_BITS);
+			pBuffer = new ByteBuffer(classSize);
+			pBuffer->data_resize(classSize);
+		}
+
+		pBuffer->rpos(0);
+		pBuffer->wpos((int)size);
+
+		std::shared_ptr<MessagePool> pool = shared_from_this();
+		return ByteBufferPtr(pBuffer, [pool, cls](ByteBuffer* pBuffer) { pool->release(pBuffer, cls); });
+	}
+
+	void MessagePool::release(ByteBuffer* pBuffer, int sizeClass)
+	{
+		{
+			std::lock_guard<std::mutex> lg(mutex_);
+			std::vector<ByteBuffer*>& freeList = freeLists_[sizeClass];
+
+			size_t classSize = (size_t)1 << (sizeClass + MIN_CLASS_BITS);
+			size_t maxCached = std::min((size_t)MAX_CACHED_PER_CLASS, std::max((size_t)2, (size_t)MAX_CACHED_BYTES_PER_CLASS / classSize));
+
+			if (freeList.size() < maxCached)
+			{
+				freeList.push_back(pBuffer);
+				return;
+			}
+		}
+
+		delete pBuffer;
+	}
+
+	size_t MessagePool::cachedCount()
+	{
+		std::lock_guard<std::mutex> lg(mutex_);
+
+		size_t count = 0;
+		for (int i = 0; i < NUM_CLASSES; ++i)
+			count += freeLists_[i].size();
+
+		return count;
+	}
+
+}
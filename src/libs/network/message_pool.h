@@ -0,0 +1,46 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	/*
+		Recycles the ByteBuffers that carry received messages.
+
+		Buffers are kept in power-of-two size classes, so a buffer of the right size is handed out
+		without touching the heap once the pool is warm. The returned ByteBufferPtr owns the buffer,
+		a handler may keep it as long as it likes, it goes back to the pool when the last reference
+		is dropped, from any thread. Outstanding buffers keep the pool alive.
+	*/
+	class MessagePool : public std::enable_shared_from_this<MessagePool>
+	{
+	public:
+		enum {
+			MIN_CLASS_BITS = 6,			// 64 bytes
+			MAX_CLASS_BITS = 19,		// 512KB, holds the largest KCP message at the base MTU (255 fragments of ~1.2KB),
+										// larger ones on a probed jumbo path (up to ~2.3MB) come from the heap
+			NUM_CLASSES = MAX_CLASS_BITS - MIN_CLASS_BITS + 1,
+			MAX_CACHED_PER_CLASS = 256,
+			MAX_CACHED_BYTES_PER_CLASS = 1024 * 1024	// large classes keep at least 2 buffers
+		};
+
+		MessagePool();
+		virtual ~MessagePool();
+
+		static std::shared_ptr<MessagePool> create();
+
+		// A buffer with rpos 0 and wpos size, ready to be written to from data().
+		ByteBufferPtr allocate(size_t size);
+
+		size_t cachedCount();
+
+	protected:
+		static int sizeClass(size_t size);
+		void release(ByteBuffer* pBuffer, int sizeClass);
+
+	protected:
+		std::mutex mutex_;
+		std::vector<ByteBuffer*> freeLists_[NUM_CLASSES];
+	};
+
+}
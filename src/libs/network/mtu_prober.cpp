@@ -0,0 +1,161 @@
+#include "mtu_prober.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	MtuProber::MtuProber()
+		: state_(STATE_IDLE)
+		, maxMtu_(P2PCLOUDS_PMTU_BASE)
+		, headroom_(0)
+		, low_(P2PCLOUDS_PMTU_BASE)
+		, high_(P2PCLOUDS_PMTU_BASE)
+		, probeSize_(0)
+		, attempts_(0)
+		, probeDeadline_(0)
+		, raiseTime_(0)
+		, lastUna_(0)
+		, timeoutsAtUna_(0)
+	{
+	}
+
+	void MtuProber::reset(ikcpcb* pKCP, const asio::ip::udp::endpoint& endpoint)
+	{
+		// IP and UDP headers of the largest link MTU we search up to.
+		maxMtu_ = P2PCLOUDS_PMTU_MAX_LINK_MTU - (endpoint.address().is_v6() ? 48 : 28);
+
+		state_ = STATE_IDLE;
+		low_ = P2PCLOUDS_PMTU_BASE;
+		high_ = maxMtu_;
+		probeSize_ = 0;
+		attempts_ = 0;
+		applyMtu(pKCP);
+
+		lastUna_ = pKCP->snd_una;
+		timeoutsAtUna_ = pKCP->xmit;
+	}
+
+	void MtuProber::start(uint64_t now)
+	{
+		if (state_ == STATE_IDLE)
+			startSearch(low_, now);
+	}
+
+	void MtuProber::setHeadroom(ikcpcb* pKCP, uint32_t headroom)
+	{
+		headroom_ = headroom;
+		applyMtu(pKCP);
+	}
+
+	void MtuProber::applyMtu(ikcpcb* pKCP)
+	{
+		ikcp_setmtu(pKCP, (int)(low_ - headroom_));
+	}
+
+	void MtuProber::startSearch(uint32_t low, uint64_t now)
+	{
+		state_ = STATE_SEARCHING;
+		low_ = low;
+		high_ = maxMtu_;
+		probeSize_ = 0;
+		attempts_ = 0;
+		probeDeadline_ = now;
+	}
+
+	bool MtuProber::isBlackHole(ikcpcb* pKCP)
+	{
+		if (pKCP->snd_una != lastUna_ || pKCP->nsnd_buf == 0)
+		{
+			lastUna_ = pKCP->snd_una;
+			timeoutsAtUna_ = pKCP->xmit;
+			return false;
+		}
+
+		return pKCP->xmit - timeoutsAtUna_ >= BLACK_HOLE_TIMEOUTS;
+	}
+
+	uint32_t MtuProber::update(ikcpcb* pKCP, uint64_t now)
+	{
+		if (state_ == STATE_IDLE)
+			return 0;
+
+		if (isBlackHole(pKCP) && low_ > P2PCLOUDS_PMTU_BASE)
+		{
+			LOG_WARNING("MtuProber::update(): no acks at mtu {}, falling back to {}! conv={}", low_, P2PCLOUDS_PMTU_BASE, pKCP->conv);
+
+			startSearch(P2PCLOUDS_PMTU_BASE, now);
+			applyMtu(pKCP);
+			timeoutsAtUna_ = pKCP->xmit;
+		}
+
+		if (state_ == STATE_DONE)
+		{
+			if (now < raiseTime_)
+				return 0;
+
+			startSearch(low_, now);
+		}
+
+		if (probeSize_ != 0)
+		{
+			if (now < probeDeadline_)
+				return 0;
+
+			if (attempts_ < MAX_PROBES)
+			{
+				++attempts_;
+				probeDeadline_ = now + std::max((uint64_t)pKCP->rx_rto, (uint64_t)MIN_PROBE_TIMEOUT);
+				return probeSize_;
+			}
+
+			high_ = probeSize_ - 1;
+			probeSize_ = 0;
+		}
+
+		if (high_ < low_ + SEARCH_GRANULARITY)
+		{
+			state_ = STATE_DONE;
+			raiseTime_ = now + RAISE_TIMER;
+			return 0;
+		}
+
+		probeSize_ = (low_ + high_ + 1) / 2;
+		attempts_ = 1;
+		probeDeadline_ = now + std::max((uint64_t)pKCP->rx_rto, (uint64_t)MIN_PROBE_TIMEOUT);
+		return probeSize_;
+	}
+
+	void MtuProber::onProbeAck(ikcpcb* pKCP, uint32_t size)
+	{
+		if (state_ != STATE_SEARCHING || size != probeSize_)
+			return;
+
+		low_ = size;
+		probeSize_ = 0;
+		probeDeadline_ = 0;
+
+		applyMtu(pKCP);
+	}
+
+	void MtuProber::onProbeTooLarge(uint32_t size)
+	{
+		if (state_ != STATE_SEARCHING || size != probeSize_)
+			return;
+
+		high_ = size - 1;
+		probeSize_ = 0;
+		probeDeadline_ = 0;
+	}
+
+	uint64_t MtuProber::nextTime() const
+	{
+		if (state_ == STATE_IDLE)
+			return std::numeric_limits<uint64_t>::max();
+
+		if (state_ == STATE_DONE)
+			return raiseTime_;
+
+		return probeSize_ != 0 ? probeDeadline_ : 0;
+	}
+
+}
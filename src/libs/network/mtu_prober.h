@@ -0,0 +1,82 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	/*
+		Packetization layer path MTU discovery (RFC 8899 style) for one session.
+
+		KCP starts at P2PCLOUDS_PMTU_BASE, which every path is expected to carry. Padded probe datagrams
+		(ConnectPacket::CONTROL_MTU_PROBE) are sent with DF set, the peer acks each probe it receives, and
+		the largest acked size is found by binary search and applied with ikcp_setmtu(). A size counts as
+		lost after MAX_PROBES unanswered probes.
+
+		The search is repeated every RAISE_TIMER ms in case the path grew. If data stops being acked while
+		KCP keeps timing out (the path shrank, a black hole), the MTU falls back to the base and the search
+		starts over. Segments KCP already split at the larger size can not be re-split, they still need
+		the old path to get through.
+	*/
+	class MtuProber
+	{
+	public:
+		enum {
+			MAX_PROBES = 2,
+			SEARCH_GRANULARITY = 8,		// bytes, the search stops once the range is smaller
+			MIN_PROBE_TIMEOUT = 100,	// ms
+			BLACK_HOLE_TIMEOUTS = 4,	// timeout retransmits without ack progress
+			RAISE_TIMER = 600 * 1000	// ms
+		};
+
+		MtuProber();
+
+		// Sets the base MTU on pKCP, the search waits for start().
+		void reset(ikcpcb* pKCP, const asio::ip::udp::endpoint& endpoint);
+
+		// Starts searching once the peer has the session too, probes it can not answer would count as too large.
+		// Does nothing if the search was started already.
+		void start(uint64_t now);
+
+		// Returns the size of a probe to send now, 0 if there is none.
+		uint32_t update(ikcpcb* pKCP, uint64_t now);
+
+		void onProbeAck(ikcpcb* pKCP, uint32_t size);
+
+		// The probe could not be sent because it is larger than the local interface allows.
+		void onProbeTooLarge(uint32_t size);
+
+		// Bytes a layer below KCP adds to every datagram (FEC), the KCP MTU is the path MTU minus these.
+		void setHeadroom(ikcpcb* pKCP, uint32_t headroom);
+
+		// Time of the next probe or probe timeout, 0 if due now, never before start().
+		uint64_t nextTime() const;
+
+		uint32_t mtu() const {
+			return low_;
+		}
+
+	protected:
+		void startSearch(uint32_t low, uint64_t now);
+		void applyMtu(ikcpcb* pKCP);
+		bool isBlackHole(ikcpcb* pKCP);
+
+	protected:
+		enum State { STATE_IDLE, STATE_SEARCHING, STATE_DONE };
+
+		State state_;
+
+		uint32_t maxMtu_;
+		uint32_t headroom_;
+		uint32_t low_;					// largest size known to get through, the MTU in use
+		uint32_t high_;					// largest size that may still get through
+
+		uint32_t probeSize_;			// 0 while no probe is outstanding
+		uint32_t attempts_;
+		uint64_t probeDeadline_;
+		uint64_t raiseTime_;
+
+		uint32_t lastUna_;
+		uint32_t timeoutsAtUna_;
+	};
+
+}
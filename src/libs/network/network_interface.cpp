@@ -1,258 +1,1726 @@
 #include "network_interface.h"
-#include "connect_packet.h"
+#include "kcp_allocator.h"
 #include "session.h"
 
 #include "log/log.h"
 
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX
+#include <linux/filter.h>
+#endif
+
 namespace P2pClouds {
 
-	NetworkInterface::NetworkInterface(asio::io_service& io_service, const std::string& address, int udp_port)
-	    : udp_socket_(io_service, asio::ip::udp::endpoint(asio::ip::address::from_string(address), udp_port))
+	NetworkInterface::NetworkInterface(asio::io_service& io_service, const std::string& address, int udp_port, int numShards,
+		NetTransport transport)
+	    : pOwnedIoService_()
+		, udp_socket_(io_service)
+		, stopped_(true)
+		, remoteEndpoint_()
+		, buffer_(UDP_RECV_BUFFER_SIZE)
+#if P2PCLOUDS_HAS_MMSG
+		, recvBatch_(UDP_RECV_BUFFER_SIZE)
+		, sendBatch_()
+		, sendWaitPosted_(false)
+#endif
+		, transport_(transport)
+#if P2PCLOUDS_HAS_IO_URING
+		, pUring_()
+		, uringDescriptor_(io_service)
+		, uringDrainPosted_(false)
+#endif
+		, tick_timer_(io_service)
+		, tickTime_(getMonotonicTime())
+		, timerWheel_(tickTime_)
+		, sessions_(0, std::max(1, std::min(numShards, P2PCLOUDS_MAX_NETWORK_SHARDS)))
+		, floodGuard_()
+		, punches_()
+		, acceptedSessions_()
+		, releaseMutex_()
+		, releasedSessions_()
+		, pMessagePool_(MessagePool::create())
+		, event_callback_()
+		, pHandlerExecutor_()
+		, datagramCallback_()
+		, kcpTuningPolicy_()
+		, pPrimary_(this)
+		, shardIndex_(0)
+		, shards_()
+		, shardThreads_()
+		, connectCookie_()
+		, pendingConnectsMutex_()
+		, pendingConnects_()
+		, peersMutex_()
+		, peers_()
+		, peerOfSession_()
+	{
+		buffer_.data_resize(UDP_RECV_BUFFER_SIZE);
+
+#if !defined(SO_REUSEPORT)
+		numShards = 1;
+#endif
+
+		numShards = std::max(1, std::min(numShards, P2PCLOUDS_MAX_NETWORK_SHARDS));
+
+		openSocket(asio::ip::udp::endpoint(asio::ip::address::from_string(address), udp_port), numShards > 1);
+		shards_.push_back(this);
+
+		for (int i = 1; i < numShards; ++i)
+			shards_.push_back(new NetworkInterface(*this, i, numShards));
+
+		if (numShards > 1 && !attachReusePortFilter())
+		{
+			LOG_WARNING("NetworkInterface(): reuseport filter unavailable, packets will be forwarded between {} shards.", numShards);
+		}
+	}
+
+	NetworkInterface::NetworkInterface(NetworkInterface& primary, int shardIndex, int numShards)
+		: pOwnedIoService_(new asio::io_service())
+		, udp_socket_(*pOwnedIoService_)
 		, stopped_(true)
 		, remoteEndpoint_()
-		, buffer_(1024 * 32)
-		, tick_timer_(udp_socket_.get_io_service())
-		, sessions_()
+		, buffer_(UDP_RECV_BUFFER_SIZE)
+#if P2PCLOUDS_HAS_MMSG
+		, recvBatch_(UDP_RECV_BUFFER_SIZE)
+		, sendBatch_()
+		, sendWaitPosted_(false)
+#endif
+		, transport_(primary.transport_)
+#if P2PCLOUDS_HAS_IO_URING
+		, pUring_()
+		, uringDescriptor_(*pOwnedIoService_)
+		, uringDrainPosted_(false)
+#endif
+		, tick_timer_(*pOwnedIoService_)
+		, tickTime_(getMonotonicTime())
+		, timerWheel_(tickTime_)
+		, sessions_(shardIndex, numShards)
+		, floodGuard_()
+		, punches_()
+		, acceptedSessions_()
+		, releaseMutex_()
+		, releasedSessions_()
+		, pMessagePool_(MessagePool::create())
 		, event_callback_()
+		, pHandlerExecutor_()
+		, datagramCallback_()
+		, kcpTuningPolicy_()
+		, pPrimary_(&primary)
+		, shardIndex_(shardIndex)
+		, shards_()
+		, shardThreads_()
+		, connectCookie_()
+		, pendingConnectsMutex_()
+		, pendingConnects_()
+		, peersMutex_()
+		, peers_()
+		, peerOfSession_()
 	{
-		buffer_.data_resize(1024 * 32);
+		buffer_.data_resize(UDP_RECV_BUFFER_SIZE);
+		openSocket(primary.udp_socket_.local_endpoint(), true);
 	}
 
 	NetworkInterface::~NetworkInterface()
 	{
 		stopAll();
+		joinShardThreads();
+		drainHandlers();
+
+		for (size_t i = 1; i < shards_.size(); ++i)
+			SAFE_RELEASE(shards_[i]);
+
+		shards_.clear();
+	}
+
+	void NetworkInterface::openSocket(const asio::ip::udp::endpoint& endpoint, bool reusePort)
+	{
+		udp_socket_.open(endpoint.protocol());
+
+#if defined(SO_REUSEPORT)
+		if (reusePort)
+			udp_socket_.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		// Datagrams are sent with DF set and never fragmented, MtuProber sizes KCP segments to the path instead.
+		int pmtuDisc = endpoint.address().is_v6() ? IPV6_PMTUDISC_PROBE : IP_PMTUDISC_PROBE;
+		if (endpoint.address().is_v6())
+			setsockopt(udp_socket_.native_handle(), IPPROTO_IPV6, IPV6_MTU_DISCOVER, &pmtuDisc, sizeof(pmtuDisc));
+		else
+			setsockopt(udp_socket_.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &pmtuDisc, sizeof(pmtuDisc));
+#endif
+
+		udp_socket_.bind(endpoint);
+
+#if P2PCLOUDS_HAS_MMSG
+		// Bulk transfers to one peer leave as one GSO send and arrive as one GRO buffer.
+		sendBatch_.enableGso(udp_socket_.native_handle());
+		bool gro = recvBatch_.enableGro(udp_socket_.native_handle());
+#endif
+
+#if P2PCLOUDS_HAS_IO_URING
+		if (transport_ == NetTransportUring)
+		{
+			pUring_.reset(new UdpUring());
+
+			if (pUring_->initialize(udp_socket_.native_handle(), UDP_RECV_BUFFER_SIZE, gro))
+			{
+				uringDescriptor_.assign(pUring_->ringFd());
+			}
+			else
+			{
+				LOG_WARNING("NetworkInterface::openSocket(): io_uring unavailable, shard({}) uses the reactor.", shardIndex_);
+				pUring_.reset();
+				transport_ = NetTransportReactor;
+			}
+		}
+#else
+		transport_ = NetTransportReactor;
+#endif
+	}
+
+	bool NetworkInterface::attachReusePortFilter()
+	{
+#if P2PCLOUDS_PLATFORM == PLATFORM_UNIX && defined(SO_ATTACH_REUSEPORT_CBPF)
+		// The kernel runs the filter on the UDP payload and uses the result as an index into the
+		// reuseport group, whose order is the order in which the shards were bound.
+		struct sock_filter code[] = {
+			{ BPF_LD | BPF_B | BPF_ABS, 0, 0, 0 },						// A = conv & 0xff
+			{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)numShards() },	// A %= numShards
+			{ BPF_RET | BPF_A, 0, 0, 0 },								// return A
+		};
+
+		struct sock_fprog prog = { (unsigned short)(sizeof(code) / sizeof(code[0])), code };
+
+		return setsockopt(udp_socket_.native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+#else
+		return false;
+#endif
 	}
 
 	bool NetworkInterface::initialize()
 	{
-		stopped_ = false;
-		hookAsyncReceive();
-		hookUpdateTimer();
-		
+		// Before any session is created, KCP must not free blocks it got from malloc() with the slab allocator.
+		KcpAllocator::install();
+
+		for (NetworkInterface* pShard : shards_)
+		{
+			pShard->stopped_ = false;
+			pShard->hookAsyncReceive();
+			pShard->hookUpdateTimer();
+		}
+
+		startShardThreads();
 		return true;
 	}
 
 	bool NetworkInterface::finalise()
 	{
 		stopAll();
+		joinShardThreads();
+		drainHandlers();
+
+		LOG_INFO("NetworkInterface::finalise(): kcp allocator: {}", KcpAllocator::statsString());
+
+		for (NetworkInterface* pShard : shards_)
+		{
+			if (pShard->floodGuard_.totalDrops() > 0)
+				LOG_INFO("NetworkInterface::finalise(): shard({}) dropped datagrams: {}", pShard->shardIndex_, pShard->floodGuard_.statsString());
+		}
+
+		if (pHandlerExecutor_)
+			LOG_INFO("NetworkInterface::finalise(): handler executor: {}", pHandlerExecutor_->statsString());
 		return true;
 	}
 
+	void NetworkInterface::startShardThreads()
+	{
+		for (size_t i = 1; i < shards_.size(); ++i)
+		{
+			NetworkInterface* pShard = shards_[i];
+
+			shardThreads_.emplace_back([pShard]()
+			{
+				try
+				{
+					pShard->ioService().run();
+				}
+				catch (std::exception& e)
+				{
+					LOG_ERROR("NetworkInterface::shard({}): error! what={}", pShard->shardIndex(), e.what());
+				}
+			});
+		}
+	}
+
+	void NetworkInterface::joinShardThreads()
+	{
+		for (std::thread& thread : shardThreads_)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+
+		shardThreads_.clear();
+	}
+
 	void NetworkInterface::stopAll()
+	{
+		// Other shards are stopped on their own threads, their io_service returns once the socket is closed.
+		for (size_t i = 1; i < shards_.size(); ++i)
+		{
+			if (shardThreads_.empty())
+				shards_[i]->stopShard();
+			else
+				shards_[i]->ioService().post(std::bind(&NetworkInterface::stopShard, shards_[i]));
+		}
+
+		stopShard();
+	}
+
+	void NetworkInterface::stopShard()
 	{
 		stopped_ = true;
 
+		// Sessions say goodbye when they are removed, so they must go before the socket. Removed one by one,
+		// their peers and accepts are forgotten and they leave the timer wheel even if a handler still holds them.
+		std::vector<SessionID> sessionIDs;
+		sessionIDs.reserve(sessions_.size());
+		sessions_.forEach([&sessionIDs](Session& session) { sessionIDs.push_back(session.id()); });
+
+		for (SessionID sessionID : sessionIDs)
+			removeSession(sessionID);
+
+		sessions_.clear();
+		flushPackets();
+
         if (udp_socket_.is_open())
         {
-            udp_socket_.cancel();
-            udp_socket_.close();
+			std::error_code ec;
+            udp_socket_.cancel(ec);
+            udp_socket_.close(ec);
         }
-        
-		sessions_.clear();
+
+#if P2PCLOUDS_HAS_IO_URING
+		// The ring fd belongs to pUring_, which lives until the interface is destroyed.
+		if (uringDescriptor_.is_open())
+		{
+			std::error_code ec;
+			uringDescriptor_.cancel(ec);
+			uringDescriptor_.release();
+		}
+#endif
+
+		tick_timer_.cancel();
 	}
 
 	bool NetworkInterface::connect(const std::string& address, int udp_port)
 	{
 		asio::ip::udp::endpoint remoteEndpoint = asio::ip::udp::endpoint(asio::ip::address::from_string(address), udp_port);
 
-		// send a connect cmd.
-		ByteBuffer packet = ConnectPacket::makeConnectPacket();
-		LOG_INFO("send connect packet! endpoint={}:{}", remoteEndpoint.address().to_string(), remoteEndpoint.port());
+		addPendingConnect(remoteEndpoint);
+
+		// The server answers with a cookie, see handleCookiePacket().
+		ByteBuffer packet = ConnectPacket::makeHelloPacket();
+		LOG_INFO("send hello packet! endpoint={}:{}", remoteEndpoint.address().to_string(), remoteEndpoint.port());
 		sendPacket(packet, remoteEndpoint);
 		return true;
 	}
 
 	void NetworkInterface::disconnect(SessionID sessionID)
 	{
-		std::shared_ptr<Session> session = findSession(sessionID);
-		if (!session)
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::disconnect, &owner, sessionID));
+			return;
+		}
+
+		Session* pSession = findSession(sessionID);
+		if (!pSession)
 			return;
 
-		LOG_INFO("session disconnect(): {}", session->c_str());
-		callEventCallbackFunc(session, NetEventType::NetDisconnect, NULL);
+		LOG_INFO("session disconnect(): {}", pSession->c_str());
+		callEventCallbackFunc(pSession->shared_from_this(), NetEventType::NetDisconnect, NULL);
 		removeSession(sessionID);
 	}
 
-	void NetworkInterface::callEventCallbackFunc(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas)
+	void NetworkInterface::registerPeer(SessionID rendezvousSessionID, uint64_t peerID)
 	{
-		event_callback_(pSession, event_type, pdatas);
+		sendPeerRequest(ConnectPacket::CONTROL_PEER_REGISTER, rendezvousSessionID, peerID);
 	}
 
-	void NetworkInterface::setEventCallback(const std::function<net_event_callback_t>& eventCallback)
+	void NetworkInterface::connectPeer(SessionID rendezvousSessionID, uint64_t peerID)
 	{
-		event_callback_ = eventCallback;
+		if (peerID == 0)
+			return;
+
+		PunchAttempt punch;
+		punch.rendezvousSessionID = rendezvousSessionID;
+		punch.peerID = peerID;
+		punch.endpoint = asio::ip::udp::endpoint();
+		punch.state = PUNCH_INTRODUCING;
+		punch.attempts = 0;
+		punch.nextTime = 0;
+		punch.requestTime = 0;
+
+		NetworkInterface& owner = shardOf(rendezvousSessionID);
+		owner.ioService().post(std::bind(&NetworkInterface::addPunch, &owner, punch));
 	}
 
-	void NetworkInterface::hookUpdateTimer(void)
+	void NetworkInterface::sendPeerRequest(ConnectPacket::Type type, SessionID rendezvousSessionID, uint64_t peerID)
 	{
-		if (stopped_)
+		NetworkInterface& owner = shardOf(rendezvousSessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::sendPeerRequest, &owner, type, rendezvousSessionID, peerID));
 			return;
+		}
 
-		tick_timer_.expires_from_now(std::chrono::milliseconds(5));
-		tick_timer_.async_wait(std::bind(&NetworkInterface::handleUpdateTimer, this));
+		Session* pSession = findSession(rendezvousSessionID);
+		if (!pSession || peerID == 0)
+			return;
+
+		ByteBuffer packet = ConnectPacket::makePeerPacket(type, rendezvousSessionID, peerID);
+		sendPacket(packet, pSession->endpoint());
 	}
 
-	void NetworkInterface::handleUpdateTimer(void)
+	void NetworkInterface::introducePeers(SessionID targetSessionID, uint64_t targetPeerID, SessionID requesterSessionID, uint64_t requesterPeerID,
+		const asio::ip::udp::endpoint& requesterEndpoint)
 	{
-		hookUpdateTimer();
-		
-		time_t timeStamp = getTimeStamp();
+		Session* pTarget = findSession(targetSessionID);
+		if (!pTarget)
+			return;
+
+		LOG_INFO("introducePeers(): {}:{} -> peer {} at {}:{}", requesterEndpoint.address().to_string(), requesterEndpoint.port(),
+			targetPeerID, pTarget->endpoint().address().to_string(), pTarget->endpoint().port());
+
+		// The requester runs the handshake, the target only opens its NAT for it, so exactly one session is created.
+		ByteBuffer targetPacket = ConnectPacket::makeIntroducePacket(targetSessionID, requesterPeerID, false, requesterEndpoint);
+		sendPacket(targetPacket, pTarget->endpoint());
+
+		ByteBuffer requesterPacket = ConnectPacket::makeIntroducePacket(requesterSessionID, targetPeerID, true, pTarget->endpoint());
+		sendPacket(requesterPacket, requesterEndpoint);
+	}
+
+	void NetworkInterface::handleIntroducePacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		SessionID sessionID;
+		uint64_t peerID;
+		bool initiator;
+		asio::ip::udp::endpoint peerEndpoint;
+
+		if (!ConnectPacket::readIntroduce(datas, sessionID, peerID, initiator, peerEndpoint))
+		{
+			floodGuard_.drop(FloodGuard::DROP_MALFORMED, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::startPunch, &owner, sessionID, peerID, initiator, peerEndpoint, remoteEndpoint));
+			return;
+		}
+
+		startPunch(sessionID, peerID, initiator, peerEndpoint, remoteEndpoint);
+	}
+
+	void NetworkInterface::startPunch(SessionID rendezvousSessionID, uint64_t peerID, bool initiator, const asio::ip::udp::endpoint& peerEndpoint,
+		const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		// Introductions are only taken from the rendezvous node itself.
+		Session* pSession = findSession(rendezvousSessionID);
+		if (!pSession || pSession->endpoint() != remoteEndpoint)
+		{
+			floodGuard_.drop(FloodGuard::DROP_HANDSHAKE, remoteEndpoint.address(), tickTime_);
+			return;
+		}
 
-		for (auto iter = sessions_.begin(); iter != sessions_.end();)
+		if (!initiator)
 		{
-			if (!iter->second->update(timeStamp))
-				sessions_.erase(iter++);
+			PunchAttempt punch;
+			punch.rendezvousSessionID = rendezvousSessionID;
+			punch.peerID = peerID;
+			punch.endpoint = peerEndpoint;
+			punch.state = PUNCH_OPENING;
+			punch.attempts = 0;
+			punch.nextTime = 0;
+			punch.requestTime = 0;
+
+			// Punched from where the session will be accepted, which ends it.
+			NetworkInterface& owner = acceptShardOf(peerEndpoint);
+			if (&owner != this)
+				owner.ioService().post(std::bind(&NetworkInterface::addPunch, &owner, punch));
 			else
-				iter++;
+				addPunch(punch);
+
+			return;
 		}
+
+		// Only for a request of this node, repeated introductions are ignored.
+		PunchAttempt* pPunch = findPunch(rendezvousSessionID, peerID, PUNCH_INTRODUCING);
+		if (!pPunch)
+			return;
+
+		LOG_INFO("startPunch(): peer {} at {}:{}, connecting", peerID, peerEndpoint.address().to_string(), peerEndpoint.port());
+
+		addPendingConnect(peerEndpoint);
+
+		pPunch->endpoint = peerEndpoint;
+		pPunch->state = PUNCH_CONNECTING;
+		pPunch->attempts = 0;
+		pPunch->nextTime = 0;
+
+		updateTickTime();
+		updatePunches();
+		flushPackets();
 	}
 
-	void NetworkInterface::hookAsyncReceive(void)
+	void NetworkInterface::addPunch(const PunchAttempt& punch)
 	{
 		if (stopped_)
 			return;
 
-		udp_socket_.async_receive_from(
-			asio::buffer(buffer_.data(), buffer_.size()), remoteEndpoint_,
+		if (findPunch(punch.rendezvousSessionID, punch.peerID, punch.state))
+			return;
 
-			std::bind(&NetworkInterface::handleReceiveFrom, this,
-				std::placeholders::_1,
-				std::placeholders::_2)
-		);
+		// A peer that is being connected to already is not requested again.
+		if (punch.state == PUNCH_INTRODUCING && findPunch(punch.rendezvousSessionID, punch.peerID, PUNCH_CONNECTING))
+			return;
+
+		if (punch.state == PUNCH_OPENING)
+			LOG_INFO("addPunch(): peer {} at {}:{}, punching", punch.peerID, punch.endpoint.address().to_string(), punch.endpoint.port());
+
+		punches_.push_back(punch);
+
+		updateTickTime();
+		updatePunches();
+		flushPackets();
 	}
 
-	void NetworkInterface::handleReceiveFrom(const std::error_code& error, size_t bytes_recvd)
+	NetworkInterface::PunchAttempt* NetworkInterface::findPunch(SessionID rendezvousSessionID, uint64_t peerID, PunchState state)
 	{
-		if (!error && bytes_recvd > 0)
+		for (PunchAttempt& punch : punches_)
 		{
-#if ENABLE_UDP_PACKET_LOG
-			LOG_DEBUG("udpRecv(): senderaddr={}:{}, size={}", remoteEndpoint_.address().to_string(), remoteEndpoint_.port(), bytes_recvd);
-#endif
+			if (punch.rendezvousSessionID == rendezvousSessionID && punch.peerID == peerID && punch.state == state)
+				return &punch;
+		}
 
-			assert(bytes_recvd < buffer_.size());
-			buffer_.rpos(0);
-			buffer_.wpos((int)bytes_recvd);
+		return NULL;
+	}
+
+	void NetworkInterface::punchFailed(const PunchAttempt& punch)
+	{
+		LOG_WARNING("punchFailed(): no direct path to peer {}{}!", punch.peerID,
+			punch.state == PUNCH_INTRODUCING ? ", not introduced" : "");
+
+		Session* pSession = findSession(punch.rendezvousSessionID);
+		if (pSession)
+		{
+			ByteBufferPtr pDatas = std::make_shared<ByteBuffer>();
+			(*pDatas) << punch.peerID;
+			callEventCallbackFunc(pSession->shared_from_this(), NetEventType::NetPunchFailed, pDatas);
+		}
+	}
+
+	void NetworkInterface::updatePunches()
+	{
+		for (size_t i = 0; i < punches_.size(); )
+		{
+			PunchAttempt& punch = punches_[i];
 
-			if (ConnectPacket::isConnectPacket(buffer_))
+			// The accept of the peer ends the pending connect, and the session accepted from the peer the punching.
+			uint64_t connectTime = 0;
+			bool connected = false;
+
+			if (punch.state == PUNCH_CONNECTING)
+				connected = !findPendingConnect(punch.endpoint, connectTime);
+			else if (punch.state == PUNCH_OPENING)
+				connected = acceptedSessions_.find(punch.endpoint) != acceptedSessions_.end();
+
+			if (connected)
 			{
-				handleConnectPacket();
-				goto END;
+				LOG_INFO("updatePunches(): direct path to peer {} at {}:{} after {} attempts.", punch.peerID,
+					punch.endpoint.address().to_string(), punch.endpoint.port(), punch.attempts);
+
+				punches_[i] = punches_.back();
+				punches_.pop_back();
+				continue;
 			}
-			else if (ConnectPacket::is_connect_ack_packet(buffer_))
+
+			if (tickTime_ < punch.nextTime)
 			{
-				handleConnectAckPacket();
-				goto END;
+				++i;
+				continue;
 			}
-			else if (ConnectPacket::is_disconnect_packet(buffer_))
+
+			if (punch.attempts >= P2PCLOUDS_PUNCH_ATTEMPTS)
 			{
-				handleDisconnectPacket();
-				goto END;
+				if (punch.state == PUNCH_CONNECTING)
+					isPendingConnect(punch.endpoint, true);
+
+				if (punch.state != PUNCH_OPENING)
+					punchFailed(punch);
+
+				punches_[i] = punches_.back();
+				punches_.pop_back();
+				continue;
 			}
-			else
+
+			++punch.attempts;
+			punch.nextTime = tickTime_ + P2PCLOUDS_PUNCH_INTERVAL;
+
+			if (punch.state == PUNCH_OPENING)
 			{
-				handlePacketKCP(bytes_recvd);
+				ByteBuffer packet = ConnectPacket::makePunchPacket();
+				queuePacket((const char*)packet.data(), (int)packet.length(), punch.endpoint);
+				++i;
+				continue;
 			}
+
+			if (punch.state == PUNCH_CONNECTING && (connectTime == 0 || tickTime_ - connectTime >= P2PCLOUDS_CONNECT_RETRY_TIME))
+			{
+				ByteBuffer packet = ConnectPacket::makeHelloPacket();
+				queuePacket((const char*)packet.data(), (int)packet.length(), punch.endpoint);
+			}
+
+			// Lost requests and introductions are repeated with the request.
+			if (punch.state == PUNCH_INTRODUCING || tickTime_ - punch.requestTime >= P2PCLOUDS_CONNECT_RETRY_TIME)
+			{
+				Session* pSession = findSession(punch.rendezvousSessionID);
+				if (pSession)
+				{
+					punch.requestTime = tickTime_;
+
+					ByteBuffer packet = ConnectPacket::makePeerPacket(ConnectPacket::CONTROL_PEER_INTRODUCE_REQUEST, punch.rendezvousSessionID, punch.peerID);
+					queuePacket((const char*)packet.data(), (int)packet.length(), pSession->endpoint());
+				}
+				else if (punch.state == PUNCH_INTRODUCING)
+				{
+					punches_[i] = punches_.back();
+					punches_.pop_back();
+					continue;
+				}
+			}
+
+			++i;
 		}
-		else
-		{
-			LOG_ERROR("handleReceiveFrom error end! error: {}, bytes_recvd: {}\n", error.message().c_str(), bytes_recvd);
-		}
+	}
 
-	END:
-		hookAsyncReceive();
+	void NetworkInterface::sendDatagram(const ByteBuffer& payload, const asio::ip::udp::endpoint& endpoint)
+	{
+		ByteBuffer packet = ConnectPacket::makeDatagramPacket(payload);
+		queuePacket((const char*)packet.data(), (int)packet.length(), endpoint);
 	}
 
-	void NetworkInterface::handlePacketKCP(size_t bytes_recvd)
+	void NetworkInterface::handleDatagramPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
 	{
-		SessionID sessionID = ikcp_getconv((const char*)buffer_.data());
+		// The callback is only touched on the thread of the primary.
+		if (pPrimary_ != this)
+		{
+			ByteBufferPtr pPacket = pMessagePool_->allocate(datas.length());
+			memcpy(pPacket->data(), datas.data() + datas.rpos(), datas.length());
 
-		std::shared_ptr<Session> session = findSession(sessionID);
-		if (!session)
+			NetworkInterface* pPrimary = pPrimary_;
+			pPrimary->ioService().post([pPrimary, pPacket, remoteEndpoint]()
+			{
+				if (pPrimary->stopped_)
+					return;
+
+				pPrimary->updateTickTime();
+				pPrimary->handleDatagramPacket(*pPacket, remoteEndpoint);
+				pPrimary->flushPackets();
+			});
+
+			return;
+		}
+
+		if (!datagramCallback_ || !ConnectPacket::readDatagram(datas))
 		{
-			LOG_ERROR("handlePacketKCP(): connection not exist with sessionID: {}", sessionID);
+			floodGuard_.drop(FloodGuard::DROP_MALFORMED, remoteEndpoint.address(), tickTime_);
 			return;
 		}
 
-		if(session->endpoint() != remoteEndpoint_)
+		datagramCallback_(datas, remoteEndpoint);
+	}
+
+	void NetworkInterface::callEventCallbackFunc(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel)
+	{
+		if (pHandlerExecutor_)
 		{
-			LOG_ERROR("handlePacketKCP(): endpoint({}:{}) != sessionEndPoint({}:{}) with sessionID: {}", remoteEndpoint_.address().to_string(), remoteEndpoint_.port(),
-				session->endpoint().address().to_string(), session->endpoint().port(), sessionID);
+			// All events of a session go through its strand, so they stay in order with its messages.
+			// The task keeps its own callback, setEventCallback() may replace ours while it waits.
+			std::function<net_event_callback_t> callback = event_callback_;
+			pHandlerExecutor_->post(pSession, [callback, pSession, event_type, pdatas, channel]()
+			{
+				callback(pSession, event_type, pdatas, channel);
+			});
 
 			return;
 		}
 
-		session->input(buffer_, remoteEndpoint_);
+		event_callback_(std::move(pSession), event_type, std::move(pdatas), channel);
 	}
 
-	size_t NetworkInterface::sendPacket(const char *buf, int len, const asio::ip::udp::endpoint& endpoint)
+	void NetworkInterface::drainHandlers()
 	{
-#if ENABLE_UDP_PACKET_LOG
-		LOG_DEBUG("udpSend(): senderAddr={}:{}, size={}", endpoint.address().to_string(), endpoint.port(), len);
-#endif
+		// Handlers still running may post sends and resumes to the shards, those must stay alive until they are done.
+		if (pHandlerExecutor_)
+			pHandlerExecutor_->drain();
 
-		return udp_socket_.send_to(asio::buffer(buf, len), endpoint);
+		// The io threads are stopped, the sessions the handlers handed back go here.
+		for (NetworkInterface* pShard : shards_)
+			pShard->freeReleasedSessions();
 	}
 
-	void NetworkInterface::handleConnectPacket()
+	void NetworkInterface::setHandlerExecutor(std::shared_ptr<HandlerExecutor> pExecutor)
 	{
-		static SessionID sessionID = 1;
-		std::shared_ptr<Session> session = Session::create(*this, sessionID++, remoteEndpoint_);
+		pHandlerExecutor_ = pExecutor;
 
-		ByteBuffer packet = ConnectPacket::make_connect_ack_packet(session->id());
+		for (size_t i = 1; i < shards_.size(); ++i)
+			shards_[i]->setHandlerExecutor(pExecutor);
+	}
 
-		udp_socket_.send_to(asio::buffer(packet.data(), packet.wpos()), remoteEndpoint_);
-		
-		addSession(session->id(), session);
-		callEventCallbackFunc(session, NetEventType::NetConnect, NULL);
+	bool NetworkInterface::isSessionOpen(const Session& session) const
+	{
+		return findSession(session.id()) == &session;
 	}
 
-	void NetworkInterface::handleConnectAckPacket()
+	void NetworkInterface::setEventCallback(const std::function<net_event_callback_t>& eventCallback)
 	{
-		LOG_INFO("connect {}:{} success!", remoteEndpoint_.address().to_string(), remoteEndpoint_.port());
-		SessionID sessionID = ConnectPacket::get_sessionid_from_connect_ack_packet(buffer_);
-		std::shared_ptr<Session> session = Session::create(*this, sessionID, remoteEndpoint_);
-		addSession(session->id(), session);
-		callEventCallbackFunc(session, NetEventType::NetConnect, NULL);
+		event_callback_ = eventCallback;
+
+		for (size_t i = 1; i < shards_.size(); ++i)
+			shards_[i]->setEventCallback(eventCallback);
 	}
 
-	void NetworkInterface::handleDisconnectPacket()
+	struct NetworkInterface::BroadcastState
 	{
-		LOG_INFO("session disconnected: {}:{} !", remoteEndpoint_.address().to_string(), remoteEndpoint_.port());
-		SessionID sessionID = ConnectPacket::get_sessionid_from_connect_ack_packet(buffer_);
+		std::shared_ptr<const ByteBuffer> pPayload;
+		ByteBuffer frame;					// the payload with its frame length, for the reliable channels
+		BroadcastFilter filter;
+		NetChannel channel;
+		BroadcastCallback onDone;
+		NetworkInterface* pCaller;
+
+		// Indexed by shard, each one is only touched by the thread of its shard.
+		std::vector< std::vector<SessionID> > targets;
+		std::vector< std::vector<BroadcastResult> > results;
+		std::atomic<int> pendingShards;
+	};
 
-		std::shared_ptr<Session> session = findSession(sessionID);
+	void NetworkInterface::broadcast(std::shared_ptr<const ByteBuffer> pPayload, const BroadcastFilter& filter,
+		NetChannel channel, const BroadcastCallback& onDone)
+	{
+		std::shared_ptr<BroadcastState> pState = std::make_shared<BroadcastState>();
+		pState->pPayload = pPayload;
+		pState->filter = filter;
+		pState->channel = channel;
+		pState->onDone = onDone;
+		pState->pCaller = this;
 
-		if (session)
+		if (channel < NetChannelUnreliable)
 		{
-			callEventCallbackFunc(session, NetEventType::NetDisconnect, NULL);
-			removeSession(sessionID);
+			ByteBuffer frame = Session::makeFrame(*pPayload);
+			pState->frame.swap(frame);
 		}
-	}
-	
-	bool NetworkInterface::addSession(SessionID sessionID, std::shared_ptr<Session> session)
-	{
-		auto iter = sessions_.find(sessionID);
 
-		if (iter != sessions_.end())
-			return false;
+		int count = numShards();
+		pState->targets.resize(count);
+		pState->results.resize(count);
+		pState->pendingShards = count;
 
-		sessions_[sessionID] = session;
-		return true;
+		for (int i = 0; i < count; ++i)
+			shard(i).ioService().post(std::bind(&NetworkInterface::broadcastShard, &shard(i), pState, 0));
 	}
 
-	bool NetworkInterface::removeSession(SessionID sessionID)
+	void NetworkInterface::broadcastShard(std::shared_ptr<BroadcastState> pState, size_t pos)
 	{
-		sessions_.erase(sessionID);
-		return true;
-	}
+		std::vector<SessionID>& targets = pState->targets[shardIndex_];
+		std::vector<BroadcastResult>& results = pState->results[shardIndex_];
 
-	std::shared_ptr<Session> NetworkInterface::findSession(SessionID sessionID)
-	{
-		auto iter = sessions_.find(sessionID);
+		// The sessions are picked once, a session that goes away before its batch is reported as an error.
+		if (pos == 0)
+		{
+			sessions_.forEach([&pState, &targets](Session& session)
+			{
+				if (!pState->filter || pState->filter(session))
+					targets.push_back(session.id());
+			});
+
+			results.reserve(targets.size());
+		}
+
+		updateTickTime();
+
+		size_t end = std::min(pos + (size_t)BROADCAST_BATCH_SIZE, targets.size());
+		for (; pos < end; ++pos)
+		{
+			Session* pSession = stopped_ ? NULL : findSession(targets[pos]);
+
+			NetSendStatus status = NetSendError;
+			if (pSession)
+			{
+				if (pState->channel < NetChannelUnreliable)
+					status = pSession->sendFrameKCP(pState->frame, pState->channel);
+				else
+					status = pSession->sendPacketKCP(*pState->pPayload, pState->channel);
+			}
+
+			results.push_back(BroadcastResult{ targets[pos], status });
+		}
+
+		flushPackets();
 
-		if (iter == sessions_.end())
-			return NULL;
+		if (pos < targets.size())
+		{
+			ioService().post(std::bind(&NetworkInterface::broadcastShard, this, pState, pos));
+			return;
+		}
 
-		return iter->second;
+		if (--pState->pendingShards == 0)
+			pState->pCaller->ioService().post(std::bind(&NetworkInterface::finishBroadcast, pState->pCaller, pState));
+	}
+
+	void NetworkInterface::finishBroadcast(std::shared_ptr<BroadcastState> pState)
+	{
+		if (!pState->onDone)
+			return;
+
+		std::vector<BroadcastResult> results;
+		for (const std::vector<BroadcastResult>& shardResults : pState->results)
+			results.insert(results.end(), shardResults.begin(), shardResults.end());
+
+		pState->onDone(results);
+	}
+
+	void NetworkInterface::setKcpTuningPolicy(const KcpTuningPolicy& policy)
+	{
+		kcpTuningPolicy_ = policy;
+
+		for (size_t i = 1; i < shards_.size(); ++i)
+			shards_[i]->setKcpTuningPolicy(policy);
+	}
+
+	void NetworkInterface::hookUpdateTimer(void)
+	{
+		if (stopped_)
+			return;
+
+		tick_timer_.expires_from_now(std::chrono::milliseconds(5));
+		tick_timer_.async_wait(std::bind(&NetworkInterface::handleUpdateTimer, this));
+	}
+
+	void NetworkInterface::handleUpdateTimer(void)
+	{
+		hookUpdateTimer();
+		updateTickTime();
+
+		// Only sessions whose KCP wants an update (or whose timeout is due) are touched.
+		timerWheel_.advance(tickTime_, [this](TimerWheelNode* pNode)
+		{
+			Session* pSession = static_cast<Session*>(pNode);
+
+			if (!pSession->update(tickTime_))
+				removeSession(pSession->id());
+		});
+
+		freeReleasedSessions();
+
+		if (!punches_.empty())
+			updatePunches();
+
+		if (this == pPrimary_)
+			expirePendingConnects();
+
+		if (floodGuard_.isReportDue(tickTime_))
+			LOG_WARNING("NetworkInterface::shard({}): dropped datagrams: {}", shardIndex_, floodGuard_.statsString());
+
+		flushPackets();
+	}
+
+	void NetworkInterface::scheduleSession(Session& session, uint64_t expire)
+	{
+		timerWheel_.schedule(session, expire);
+	}
+
+	void NetworkInterface::hookAsyncReceive(void)
+	{
+		if (stopped_)
+			return;
+
+#if P2PCLOUDS_HAS_IO_URING
+		if (pUring_)
+		{
+			uringDescriptor_.async_wait(asio::posix::descriptor_base::wait_read,
+				std::bind(&NetworkInterface::handleUringReady, this,
+					std::placeholders::_1)
+			);
+
+			return;
+		}
+#endif
+
+#if P2PCLOUDS_HAS_MMSG
+		udp_socket_.async_wait(asio::ip::udp::socket::wait_read,
+			std::bind(&NetworkInterface::handleReceiveReady, this,
+				std::placeholders::_1)
+		);
+#else
+		udp_socket_.async_receive_from(
+			asio::buffer(buffer_.data(), buffer_.size()), remoteEndpoint_,
+
+			std::bind(&NetworkInterface::handleReceiveFrom, this,
+				std::placeholders::_1,
+				std::placeholders::_2)
+		);
+#endif
+	}
+
+	void NetworkInterface::handleReceiveFrom(const std::error_code& error, size_t bytes_recvd)
+	{
+		updateTickTime();
+
+		if (!error && bytes_recvd > 0)
+		{
+#if ENABLE_UDP_PACKET_LOG
+			LOG_DEBUG("udpRecv(): senderaddr={}:{}, size={}", remoteEndpoint_.address().to_string(), remoteEndpoint_.port(), bytes_recvd);
+#endif
+
+			assert(bytes_recvd < buffer_.size());
+			buffer_.rpos(0);
+			buffer_.wpos((int)bytes_recvd);
+
+			handleDatagram(buffer_, remoteEndpoint_);
+			flushPackets();
+		}
+		else
+		{
+			LOG_ERROR("handleReceiveFrom error end! error: {}, bytes_recvd: {}\n", error.message().c_str(), bytes_recvd);
+		}
+
+		hookAsyncReceive();
+	}
+
+	void NetworkInterface::handleReceiveReady(const std::error_code& error)
+	{
+#if P2PCLOUDS_HAS_MMSG
+		if (error)
+		{
+			LOG_ERROR("handleReceiveReady error end! error: {}\n", error.message().c_str());
+			hookAsyncReceive();
+			return;
+		}
+
+		updateTickTime();
+
+		// One recvmmsg() per readiness event keeps the other handlers of this shard responsive.
+		int count = recvBatch_.receive(udp_socket_.native_handle());
+		if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			LOG_ERROR("handleReceiveReady(): recvmmsg error: {}", strerror(errno));
+		}
+
+		for (int i = 0; i < count && !stopped_; ++i)
+			handleReceived(recvBatch_.buffer(i), recvBatch_.endpoint(i), recvBatch_.segmentSize(i));
+
+		flushPackets();
+		hookAsyncReceive();
+#endif
+	}
+
+	void NetworkInterface::handleUringReady(const std::error_code& error)
+	{
+#if P2PCLOUDS_HAS_IO_URING
+		if (error)
+		{
+			if (error != asio::error::operation_aborted)
+				LOG_ERROR("handleUringReady error end! error: {}\n", error.message().c_str());
+
+			hookAsyncReceive();
+			return;
+		}
+
+		updateTickTime();
+		receiveUring();
+		flushPackets();
+
+		// The ring fd only signals new completions, so the ones left over are picked up by a posted handler.
+		if (!stopped_ && pUring_->hasCompletions())
+		{
+			ioService().post(std::bind(&NetworkInterface::handleUringReady, this, std::error_code()));
+			return;
+		}
+
+		hookAsyncReceive();
+#endif
+	}
+
+	void NetworkInterface::receiveUring()
+	{
+#if P2PCLOUDS_HAS_IO_URING
+		int count = pUring_->receive();
+
+		for (int i = 0; i < count && !stopped_; ++i)
+			handleReceived(pUring_->buffer(i), pUring_->endpoint(i), pUring_->segmentSize(i));
+#endif
+	}
+
+	void NetworkInterface::drainUring()
+	{
+#if P2PCLOUDS_HAS_IO_URING
+		uringDrainPosted_ = false;
+
+		if (stopped_)
+			return;
+
+		updateTickTime();
+		receiveUring();
+		flushPackets();
+
+		if (pUring_->hasCompletions())
+			postUringDrain();
+#endif
+	}
+
+	void NetworkInterface::postUringDrain()
+	{
+#if P2PCLOUDS_HAS_IO_URING
+		// Not handleUringReady(), the wait on the ring fd stays armed meanwhile.
+		if (uringDrainPosted_ || stopped_)
+			return;
+
+		uringDrainPosted_ = true;
+		ioService().post(std::bind(&NetworkInterface::drainUring, this));
+#endif
+	}
+
+	void NetworkInterface::handleReceived(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint, size_t segmentSize)
+	{
+		if (datas.length() == 0)
+			return;
+
+#if ENABLE_UDP_PACKET_LOG
+		LOG_DEBUG("udpRecv(): senderaddr={}:{}, size={}", remoteEndpoint.address().to_string(), remoteEndpoint.port(), datas.length());
+#endif
+
+		size_t begin = datas.rpos();
+		size_t end = datas.wpos();
+
+		if (segmentSize == 0 || segmentSize >= end - begin)
+		{
+			handleDatagram(datas, remoteEndpoint);
+			return;
+		}
+
+		// Split a GRO buffer back into its datagrams, each one is a window of the same buffer.
+		for (size_t offset = begin; offset < end && !stopped_; offset += segmentSize)
+		{
+			datas.rpos((int)offset);
+			datas.wpos((int)std::min(offset + segmentSize, end));
+			handleDatagram(datas, remoteEndpoint);
+		}
+	}
+
+	void NetworkInterface::handleDatagram(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		// An open session receiving from its own endpoint is only held to its session rate, a flood spoofing
+		// its prefix must not cut it off.
+		SessionID conv = datas.length() >= sizeof(SessionID) ? ikcp_getconv((const char*)datas.data() + datas.rpos()) : 0;
+		if (conv != 0 && &shardOf(conv) == this)
+		{
+			Session* session = findSession(conv);
+			if (session && session->endpoint() == remoteEndpoint)
+			{
+				inputPacketKCP(session, datas, remoteEndpoint);
+				return;
+			}
+		}
+
+		// Before anything else, a flood must cost no more than a table lookup per datagram.
+		if (!floodGuard_.admit(remoteEndpoint.address(), tickTime_))
+			return;
+
+		// Control packets carry conv 0, so a single load separates them from KCP traffic.
+		if (datas.length() < sizeof(SessionID))
+		{
+			floodGuard_.drop(FloodGuard::DROP_MALFORMED, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		if (conv == 0)
+		{
+			ConnectPacket::Type type = ConnectPacket::controlType(datas);
+			if (type != ConnectPacket::CONTROL_NONE)
+				handleControlPacket(type, datas, remoteEndpoint);
+			else
+				floodGuard_.drop(FloodGuard::DROP_MALFORMED, remoteEndpoint.address(), tickTime_);
+
+			return;
+		}
+
+		handlePacketKCP(datas, remoteEndpoint);
+	}
+
+	void NetworkInterface::handlePacketKCP(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		SessionID sessionID = ikcp_getconv((const char*)datas.data() + datas.rpos());
+
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			forwardPacket(owner, datas, remoteEndpoint);
+			return;
+		}
+
+		Session* session = findSession(sessionID);
+		if (!session)
+		{
+			floodGuard_.drop(FloodGuard::DROP_UNKNOWN_SESSION, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		inputPacketKCP(session, datas, remoteEndpoint);
+	}
+
+	void NetworkInterface::inputPacketKCP(Session* session, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		if (!session->admitDatagram(tickTime_))
+		{
+			floodGuard_.drop(FloodGuard::DROP_SESSION_RATE, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		// The peer moved (NAT rebinding, new address). Its data is taken right away so the KCP state carries on,
+		// replies follow to the new endpoint once it answered a path challenge.
+		if (session->endpoint() != remoteEndpoint)
+			session->onPathChange(remoteEndpoint);
+
+		session->input(datas);
+	}
+
+	void NetworkInterface::forwardPacket(NetworkInterface& target, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		// The datagram reached the wrong shard (no reuseport filter, or a peer with another shard count),
+		// hand a copy to the owner.
+		ByteBufferPtr pPacket = pMessagePool_->allocate(datas.length());
+		memcpy(pPacket->data(), datas.data() + datas.rpos(), datas.length());
+
+		NetworkInterface* pTarget = &target;
+		target.ioService().post([pTarget, pPacket, remoteEndpoint]()
+		{
+			if (pTarget->stopped_)
+				return;
+
+			pTarget->updateTickTime();
+			pTarget->handlePacketKCP(*pPacket, remoteEndpoint);
+			pTarget->flushPackets();
+		});
+	}
+
+	size_t NetworkInterface::sendPacket(const char *buf, int len, const asio::ip::udp::endpoint& endpoint)
+	{
+#if ENABLE_UDP_PACKET_LOG
+		LOG_DEBUG("udpSend(): senderAddr={}:{}, size={}", endpoint.address().to_string(), endpoint.port(), len);
+#endif
+
+		std::error_code ec;
+		size_t sentSize = udp_socket_.send_to(asio::buffer(buf, len), endpoint, 0, ec);
+		if (ec)
+		{
+			LOG_ERROR("sendPacket(): send_to {}:{} error: {}", endpoint.address().to_string(), endpoint.port(), ec.message());
+			return 0;
+		}
+
+		return sentSize;
+	}
+
+	void NetworkInterface::queuePacket(const char *buf, int len, const asio::ip::udp::endpoint& endpoint)
+	{
+#if P2PCLOUDS_HAS_MMSG
+#if ENABLE_UDP_PACKET_LOG
+		LOG_DEBUG("udpQueue(): senderAddr={}:{}, size={}", endpoint.address().to_string(), endpoint.port(), len);
+#endif
+
+		if (sendBatch_.push(buf, len, endpoint))
+			return;
+
+		flushPackets();
+
+		if (sendBatch_.push(buf, len, endpoint))
+			return;
+#endif
+
+		sendPacket(buf, len, endpoint);
+	}
+
+	void NetworkInterface::flushPackets()
+	{
+#if P2PCLOUDS_HAS_MMSG
+		if (sendBatch_.empty() || !udp_socket_.is_open())
+			return;
+
+#if P2PCLOUDS_HAS_IO_URING
+		if (pUring_)
+		{
+			sendBatch_.flush(*pUring_);
+
+			// Receive completions reaped while waiting for the sends do not make the ring fd readable again.
+			if (pUring_->hasCompletions())
+				postUringDrain();
+
+			return;
+		}
+#endif
+
+		sendBatch_.flush(udp_socket_.native_handle());
+
+		// The socket buffer was full, the rest goes out once it is writable again.
+		if (!sendBatch_.empty() && !sendWaitPosted_ && !stopped_)
+		{
+			sendWaitPosted_ = true;
+
+			udp_socket_.async_wait(asio::ip::udp::socket::wait_write,
+				std::bind(&NetworkInterface::handleSendReady, this,
+					std::placeholders::_1)
+			);
+		}
+#endif
+	}
+
+	void NetworkInterface::handleSendReady(const std::error_code& error)
+	{
+#if P2PCLOUDS_HAS_MMSG
+		sendWaitPosted_ = false;
+
+		if (error || stopped_)
+			return;
+
+		updateTickTime();
+		flushPackets();
+#endif
+	}
+
+	void NetworkInterface::handleControlPacket(ConnectPacket::Type type, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		switch (type)
+		{
+		case ConnectPacket::CONTROL_HELLO:
+			// Padded by the sender, so the cookie never makes a reply larger than its request.
+			if (datas.length() < ConnectPacket::HELLO_SIZE)
+			{
+				floodGuard_.drop(FloodGuard::DROP_MALFORMED, remoteEndpoint.address(), tickTime_);
+				break;
+			}
+
+			handleHelloPacket(remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_COOKIE:
+			handleCookiePacket(datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_CONNECT:
+			handleConnectPacket(datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_ACCEPT:
+			handleAcceptPacket(datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_DISCONNECT:
+			handleDisconnectPacket(datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_MTU_PROBE:
+		case ConnectPacket::CONTROL_MTU_ACK:
+		case ConnectPacket::CONTROL_FEC_REQUEST:
+		case ConnectPacket::CONTROL_FEC_ACK:
+		case ConnectPacket::CONTROL_PATH_CHALLENGE:
+		case ConnectPacket::CONTROL_PATH_RESPONSE:
+		case ConnectPacket::CONTROL_PEER_REGISTER:
+		case ConnectPacket::CONTROL_PEER_INTRODUCE_REQUEST:
+		case ConnectPacket::CONTROL_PEER_UNKNOWN:
+			handleSessionControlPacket(type, datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_PEER_INTRODUCE:
+			handleIntroducePacket(datas, remoteEndpoint);
+			break;
+		case ConnectPacket::CONTROL_PEER_PUNCH:
+			// Only there to open the NAT mapping of the sender.
+			break;
+		case ConnectPacket::CONTROL_DATAGRAM:
+			handleDatagramPacket(datas, remoteEndpoint);
+			break;
+		default:
+			break;
+		};
+	}
+
+	void NetworkInterface::handleHelloPacket(const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		// Nothing is allocated for a hello, and the cookie is no larger than the padded hello.
+		uint32_t timestamp = cookieTime();
+		uint64_t cookie = pPrimary_->connectCookie_.make(remoteEndpoint, timestamp);
+
+		ByteBuffer packet = ConnectPacket::makeCookiePacket(timestamp, cookie);
+		queuePacket((const char*)packet.data(), (int)packet.length(), remoteEndpoint);
+	}
+
+	void NetworkInterface::handleCookiePacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		uint32_t timestamp;
+		uint64_t cookie;
+
+		if (!ConnectPacket::readCookie(datas, timestamp, cookie))
+			return;
+
+		uint64_t connectTime;
+		if (!findPendingConnect(remoteEndpoint, connectTime))
+		{
+			floodGuard_.drop(FloodGuard::DROP_HANDSHAKE, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		// Repeated HELLOs of hole punching bring several cookies, one CONNECT per retry time is enough.
+		if (connectTime != 0 && tickTime_ - connectTime < P2PCLOUDS_CONNECT_RETRY_TIME)
+			return;
+
+		setConnectTime(remoteEndpoint, tickTime_);
+
+		ByteBuffer packet = ConnectPacket::makeConnectPacket(timestamp, cookie);
+		queuePacket((const char*)packet.data(), (int)packet.length(), remoteEndpoint);
+	}
+
+	void NetworkInterface::handleConnectPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		uint32_t timestamp;
+		uint64_t cookie;
+
+		if (!ConnectPacket::readCookie(datas, timestamp, cookie))
+			return;
+
+		if (!pPrimary_->connectCookie_.verify(remoteEndpoint, timestamp, cookie, cookieTime()))
+		{
+			floodGuard_.drop(FloodGuard::DROP_HANDSHAKE, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		// New sessions are spread over the shards, the owner allocates the ID.
+		NetworkInterface& target = acceptShardOf(remoteEndpoint);
+		if (&target != this)
+		{
+			target.ioService().post(std::bind(&NetworkInterface::acceptSession, &target, remoteEndpoint));
+			return;
+		}
+
+		acceptSession(remoteEndpoint);
+	}
+
+	void NetworkInterface::handleAcceptPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		SessionID sessionID;
+		if (!ConnectPacket::readSessionID(datas, sessionID))
+			return;
+
+		if (!isPendingConnect(remoteEndpoint, true))
+		{
+			floodGuard_.drop(FloodGuard::DROP_HANDSHAKE, remoteEndpoint.address(), tickTime_);
+			return;
+		}
+
+		LOG_INFO("connect {}:{} success!", remoteEndpoint.address().to_string(), remoteEndpoint.port());
+
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::openSession, &owner, sessionID, remoteEndpoint));
+			return;
+		}
+
+		openSession(sessionID, remoteEndpoint);
+	}
+
+	bool NetworkInterface::isPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint, bool erase)
+	{
+		std::lock_guard<std::mutex> lg(pPrimary_->pendingConnectsMutex_);
+
+		auto iter = pPrimary_->pendingConnects_.find(remoteEndpoint);
+		if (iter == pPrimary_->pendingConnects_.end())
+			return false;
+
+		if (erase)
+			pPrimary_->pendingConnects_.erase(iter);
+
+		return true;
+	}
+
+	bool NetworkInterface::findPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint, uint64_t& connectTime)
+	{
+		std::lock_guard<std::mutex> lg(pPrimary_->pendingConnectsMutex_);
+
+		auto iter = pPrimary_->pendingConnects_.find(remoteEndpoint);
+		if (iter == pPrimary_->pendingConnects_.end())
+			return false;
+
+		connectTime = iter->second.connectTime;
+		return true;
+	}
+
+	void NetworkInterface::setConnectTime(const asio::ip::udp::endpoint& remoteEndpoint, uint64_t connectTime)
+	{
+		std::lock_guard<std::mutex> lg(pPrimary_->pendingConnectsMutex_);
+
+		auto iter = pPrimary_->pendingConnects_.find(remoteEndpoint);
+		if (iter != pPrimary_->pendingConnects_.end())
+			iter->second.connectTime = connectTime;
+	}
+
+	void NetworkInterface::addPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		std::lock_guard<std::mutex> lg(pPrimary_->pendingConnectsMutex_);
+
+		// Called from any thread, tickTime_ belongs to the primary.
+		pPrimary_->pendingConnects_[remoteEndpoint] = PendingConnect{ getMonotonicTime(), 0 };
+	}
+
+	void NetworkInterface::expirePendingConnects()
+	{
+		std::lock_guard<std::mutex> lg(pendingConnectsMutex_);
+
+		for (auto iter = pendingConnects_.begin(); iter != pendingConnects_.end(); )
+		{
+			if (tickTime_ >= iter->second.helloTime + P2PCLOUDS_CONNECTION_TIMEOUT_TIME)
+			{
+				LOG_WARNING("connect {}:{} timed out!", iter->first.address().to_string(), iter->first.port());
+				iter = pendingConnects_.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+	}
+
+	void NetworkInterface::handleDisconnectPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		SessionID sessionID;
+		if (!ConnectPacket::readSessionID(datas, sessionID))
+			return;
+
+		LOG_INFO("session disconnected: {}:{} !", remoteEndpoint.address().to_string(), remoteEndpoint.port());
+
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::closeSession, &owner, sessionID, remoteEndpoint));
+			return;
+		}
+
+		closeSession(sessionID, remoteEndpoint);
+	}
+
+	void NetworkInterface::handleSessionControlPacket(ConnectPacket::Type type, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		SessionID sessionID;
+		uint64_t value;
+		uint32_t value32;
+
+		if (type == ConnectPacket::CONTROL_PATH_CHALLENGE || type == ConnectPacket::CONTROL_PATH_RESPONSE)
+		{
+			if (!ConnectPacket::readPath(datas, sessionID, value))
+				return;
+		}
+		else if (type == ConnectPacket::CONTROL_PEER_REGISTER || type == ConnectPacket::CONTROL_PEER_INTRODUCE_REQUEST ||
+			type == ConnectPacket::CONTROL_PEER_UNKNOWN)
+		{
+			if (!ConnectPacket::readPeer(datas, sessionID, value))
+				return;
+		}
+		else
+		{
+			bool isMtu = type == ConnectPacket::CONTROL_MTU_PROBE || type == ConnectPacket::CONTROL_MTU_ACK;
+			if (isMtu ? !ConnectPacket::readMtuProbe(datas, sessionID, value32) : !ConnectPacket::readFec(datas, sessionID, value32))
+				return;
+
+			value = value32;
+		}
+
+		NetworkInterface& owner = shardOf(sessionID);
+		if (&owner != this)
+		{
+			owner.ioService().post(std::bind(&NetworkInterface::handleSessionControl, &owner, type, sessionID, value, remoteEndpoint));
+			return;
+		}
+
+		handleSessionControl(type, sessionID, value, remoteEndpoint);
+	}
+
+	void NetworkInterface::handleSessionControl(ConnectPacket::Type type, SessionID sessionID, uint64_t value, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		Session* pSession = findSession(sessionID);
+		if (!pSession)
+			return;
+
+		// Comes from the new endpoint, the session checks it against the one it challenged.
+		if (type == ConnectPacket::CONTROL_PATH_RESPONSE)
+		{
+			// A migrated session is in use, it is not looked up by its handshake endpoint anymore.
+			asio::ip::udp::endpoint oldEndpoint = pSession->endpoint();
+			pSession->onPathResponse(remoteEndpoint, value);
+
+			if (pSession->endpoint() != oldEndpoint)
+				forgetAccepted(oldEndpoint, sessionID);
+
+			return;
+		}
+
+		// Only peers of a session are answered, replies are never larger than the request.
+		if (pSession->endpoint() != remoteEndpoint)
+			return;
+
+		switch (type)
+		{
+		case ConnectPacket::CONTROL_MTU_PROBE:
+		{
+			pSession->startMtuProbe();
+
+			ByteBuffer packet = ConnectPacket::makeMtuAckPacket(sessionID, (uint32_t)value);
+			queuePacket((const char*)packet.data(), (int)packet.length(), remoteEndpoint);
+			break;
+		}
+		case ConnectPacket::CONTROL_PEER_REGISTER:
+		{
+			std::lock_guard<std::mutex> lg(pPrimary_->peersMutex_);
+
+			// Taken by another session, which would otherwise get the introductions meant for the first one.
+			auto owner = pPrimary_->peers_.find(value);
+			if (owner != pPrimary_->peers_.end() && owner->second != sessionID)
+			{
+				LOG_WARNING("handleSessionControl(): peer {} is registered by session {} already! {}", value, owner->second, pSession->c_str());
+				break;
+			}
+
+			auto iter = pPrimary_->peerOfSession_.find(sessionID);
+			if (iter != pPrimary_->peerOfSession_.end())
+				pPrimary_->peers_.erase(iter->second);
+
+			pPrimary_->peers_[value] = sessionID;
+			pPrimary_->peerOfSession_[sessionID] = value;
+
+			LOG_INFO("handleSessionControl(): peer {} registered. {}", value, pSession->c_str());
+			break;
+		}
+		case ConnectPacket::CONTROL_PEER_INTRODUCE_REQUEST:
+		{
+			SessionID targetSessionID;
+			uint64_t requesterPeerID = 0;
+
+			{
+				std::lock_guard<std::mutex> lg(pPrimary_->peersMutex_);
+
+				auto iter = pPrimary_->peers_.find(value);
+				if (iter == pPrimary_->peers_.end())
+				{
+					LOG_WARNING("handleSessionControl(): introduction to unknown peer {}! {}", value, pSession->c_str());
+
+					// The requester falls back to relaying at once instead of waiting for all attempts.
+					ByteBuffer packet = ConnectPacket::makePeerPacket(ConnectPacket::CONTROL_PEER_UNKNOWN, sessionID, value);
+					queuePacket((const char*)packet.data(), (int)packet.length(), remoteEndpoint);
+					break;
+				}
+
+				targetSessionID = iter->second;
+
+				auto requester = pPrimary_->peerOfSession_.find(sessionID);
+				if (requester != pPrimary_->peerOfSession_.end())
+					requesterPeerID = requester->second;
+			}
+
+			// The endpoint of the target is only known on the thread of its shard.
+			NetworkInterface& owner = shardOf(targetSessionID);
+			owner.ioService().post(std::bind(&NetworkInterface::introducePeers, &owner, targetSessionID, value,
+				sessionID, requesterPeerID, remoteEndpoint));
+			break;
+		}
+		case ConnectPacket::CONTROL_PEER_UNKNOWN:
+		{
+			PunchAttempt* pPunch = findPunch(sessionID, value, PUNCH_INTRODUCING);
+			if (!pPunch)
+				break;
+
+			PunchAttempt punch = *pPunch;
+			*pPunch = punches_.back();
+			punches_.pop_back();
+
+			punchFailed(punch);
+			break;
+		}
+		case ConnectPacket::CONTROL_MTU_ACK:
+			pSession->onMtuProbeAck((uint32_t)value);
+			break;
+		case ConnectPacket::CONTROL_FEC_REQUEST:
+			pSession->onFecRequest((uint32_t)value);
+			break;
+		case ConnectPacket::CONTROL_FEC_ACK:
+			pSession->onFecAck((uint32_t)value);
+			break;
+		case ConnectPacket::CONTROL_PATH_CHALLENGE:
+		{
+			ByteBuffer packet = ConnectPacket::makePathPacket(ConnectPacket::CONTROL_PATH_RESPONSE, sessionID, value);
+			queuePacket((const char*)packet.data(), (int)packet.length(), remoteEndpoint);
+			break;
+		}
+		default:
+			break;
+		};
+	}
+
+	NetworkInterface& NetworkInterface::acceptShardOf(const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		uint64_t hash = remoteEndpoint.port();
+
+		if (remoteEndpoint.address().is_v4())
+		{
+			hash ^= (uint64_t)remoteEndpoint.address().to_v4().to_ulong() << 16;
+		}
+		else
+		{
+			for (uint8_t byte : remoteEndpoint.address().to_v6().to_bytes())
+				hash = hash * 31 + byte;
+		}
+
+		hash *= 0x9E3779B97F4A7C15ull;
+		return shard((int)((hash >> 32) % (uint64_t)numShards()));
+	}
+
+	void NetworkInterface::acceptSession(const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		if (stopped_)
+			return;
+
+		updateTickTime();
+
+		// The cookie is valid for a while, a retried or replayed CONNECT must not open a second session.
+		auto accepted = acceptedSessions_.find(remoteEndpoint);
+		if (accepted != acceptedSessions_.end())
+		{
+			Session* pSession = findSession(accepted->second);
+			if (pSession && pSession->endpoint() == remoteEndpoint)
+			{
+				// The peer can not send on a session before it got the ACCEPT, a CONNECT after that means it restarted.
+				if (!pSession->hasReceived())
+				{
+					ByteBuffer packet = ConnectPacket::makeAcceptPacket(pSession->id());
+					sendPacket(packet, remoteEndpoint);
+					return;
+				}
+
+				LOG_INFO("acceptSession(): peer restarted, replacing {}", pSession->c_str());
+				callEventCallbackFunc(pSession->shared_from_this(), NetEventType::NetDisconnect, NULL);
+				removeSession(pSession->id());
+			}
+		}
+
+		SessionID sessionID = sessions_.acquire();
+		if (sessionID == 0)
+			return;
+
+		std::shared_ptr<Session> session = Session::create(*this, sessionID, remoteEndpoint);
+		if (!session)
+		{
+			sessions_.remove(sessionID);
+			return;
+		}
+
+		ByteBuffer packet = ConnectPacket::makeAcceptPacket(session->id());
+		sendPacket(packet, remoteEndpoint);
+		
+		addSession(session->id(), session);
+		acceptedSessions_[remoteEndpoint] = session->id();
+		callEventCallbackFunc(session, NetEventType::NetConnect, NULL);
+	}
+
+	void NetworkInterface::openSession(SessionID sessionID, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		if (stopped_)
+			return;
+
+		updateTickTime();
+
+		// A repeated ack, or the peer picked an ID that one of our own sessions already has.
+		if (findSession(sessionID))
+		{
+			LOG_ERROR("openSession(): sessionID {} already in use! endpoint={}:{}", sessionID, remoteEndpoint.address().to_string(), remoteEndpoint.port());
+			return;
+		}
+
+		std::shared_ptr<Session> session = Session::create(*this, sessionID, remoteEndpoint);
+		if (!session)
+			return;
+
+		addSession(session->id(), session);
+		session->startMtuProbe();
+		callEventCallbackFunc(session, NetEventType::NetConnect, NULL);
+	}
+
+	void NetworkInterface::closeSession(SessionID sessionID, const asio::ip::udp::endpoint& remoteEndpoint)
+	{
+		Session* pSession = findSession(sessionID);
+
+		// A disconnect is only taken from the peer of the session, the ID alone is easy to guess.
+		if (pSession && pSession->endpoint() == remoteEndpoint)
+		{
+			callEventCallbackFunc(pSession->shared_from_this(), NetEventType::NetDisconnect, NULL);
+			removeSession(sessionID);
+		}
+	}
+
+	bool NetworkInterface::addSession(SessionID sessionID, std::shared_ptr<Session> session)
+	{
+		return sessions_.add(sessionID, session);
+	}
+
+	bool NetworkInterface::removeSession(SessionID sessionID)
+	{
+		{
+			std::lock_guard<std::mutex> lg(pPrimary_->peersMutex_);
+
+			auto iter = pPrimary_->peerOfSession_.find(sessionID);
+			if (iter != pPrimary_->peerOfSession_.end())
+			{
+				pPrimary_->peers_.erase(iter->second);
+				pPrimary_->peerOfSession_.erase(iter);
+			}
+		}
+
+		Session* pSession = findSession(sessionID);
+		if (pSession)
+		{
+			// A handler may still hold the session, it must not be updated anymore in the meantime.
+			pSession->close();
+			forgetAccepted(pSession->endpoint(), sessionID);
+		}
+
+		return sessions_.remove(sessionID);
+	}
+
+	void NetworkInterface::releaseSession(std::shared_ptr<Session> pSession)
+	{
+		std::lock_guard<std::mutex> lock(releaseMutex_);
+		releasedSessions_.push_back(std::move(pSession));
+	}
+
+	void NetworkInterface::freeReleasedSessions()
+	{
+		std::vector<std::shared_ptr<Session>> sessions;
+
+		// Swapped out, a ~Session() must not run under the lock.
+		{
+			std::lock_guard<std::mutex> lock(releaseMutex_);
+			sessions.swap(releasedSessions_);
+		}
+	}
+
+	void NetworkInterface::forgetAccepted(const asio::ip::udp::endpoint& remoteEndpoint, SessionID sessionID)
+	{
+		auto accepted = acceptedSessions_.find(remoteEndpoint);
+		if (accepted != acceptedSessions_.end() && accepted->second == sessionID)
+			acceptedSessions_.erase(accepted);
 	}
 }
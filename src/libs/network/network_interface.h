@@ -1,15 +1,53 @@
 #pragma once
 
 #include "common.h"
+#include "udp_batch.h"
+#include "udp_uring.h"
+#include "session_table.h"
+#include "message_pool.h"
+#include "connect_packet.h"
+#include "kcp_tuner.h"
+#include "handler_executor.h"
+#include "flood_guard.h"
+#include "common/timer_wheel.h"
 
 namespace P2pClouds {
 
 	class Session;
 
+	// Outcome of a broadcast for one session.
+	struct BroadcastResult
+	{
+		SessionID sessionID;
+		NetSendStatus status;
+	};
+
+	typedef std::function<bool(const Session&)> BroadcastFilter;
+	typedef std::function<void(const std::vector<BroadcastResult>&)> BroadcastCallback;
+
+	// datas is positioned at the payload.
+	typedef std::function<void(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)> DatagramCallback;
+
+	/*
+		A NetworkInterface owns one UDP socket and the sessions that live on it.
+
+		With numShards > 1 the interface becomes the primary of a group of shards. Every shard
+		binds the same address with SO_REUSEPORT and runs on its own io_service thread, so all
+		work of a session (KCP input, update timers, callbacks) stays on one thread.
+		The low byte of the KCP conv (SessionID) selects the owning shard, on Linux a reuseport
+		BPF filter steers datagrams to it directly, otherwise they are forwarded between shards.
+
+		Event callbacks of different shards are invoked from different threads.
+
+		The transport is chosen at construction: the asio reactor with recvmmsg()/sendmmsg(), or io_uring
+		(see UdpUring) where a shard watches only its ring. Shards fall back to the reactor if the kernel has no
+		usable io_uring, transport() tells which one is in use.
+	*/
 	class NetworkInterface
 	{
 	public:
-		NetworkInterface(asio::io_service& io_service, const std::string& address, int udp_port = LISTEN_PORT);
+		NetworkInterface(asio::io_service& io_service, const std::string& address, int udp_port = LISTEN_PORT, int numShards = 1,
+			NetTransport transport = NetTransportReactor);
 		virtual ~NetworkInterface();
 
 		bool initialize();
@@ -20,6 +58,16 @@ namespace P2pClouds {
 		bool connect(const std::string& address, int udp_port = LISTEN_PORT);
 		void disconnect(SessionID sessionID);
 
+		// Hole punching through a rendezvous node, any node both peers have a session with.
+		// registerPeer() makes this node known there as peerID. connectPeer() asks it to introduce the registered peerID,
+		// both sides are told the public endpoint the rendezvous node sees of the other and send to it at the same time,
+		// which opens their NAT mappings, while this side runs the handshake over it. NetConnect is raised for the direct
+		// session on both sides. If no path opens, or the peerID is not registered there, NetPunchFailed is raised for the
+		// rendezvous session with the peerID as payload, messages for the peer can be relayed through the rendezvous node
+		// then. A peerID is kept by the first session that registers it.
+		void registerPeer(SessionID rendezvousSessionID, uint64_t peerID);
+		void connectPeer(SessionID rendezvousSessionID, uint64_t peerID);
+
 		// user level send packet.
 		size_t sendPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& endpoint) {
 			return sendPacket((const char *)datas.data(), (int)datas.length(), endpoint);
@@ -27,41 +75,290 @@ namespace P2pClouds {
 
 		size_t sendPacket(const char *buf, int len, const asio::ip::udp::endpoint& endpoint);
 
-		void callEventCallbackFunc(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBuffer* pdatas);
+		// Connectionless datagrams for protocols that need no session, such as the RPCs of Kademlia: no handshake, no
+		// retransmission, no ordering. They are sent and received by the primary, the callback runs on its thread and
+		// sendDatagram() must be called there. Set the callback before the io_service of the primary runs, or on its thread.
+		void setDatagramCallback(const DatagramCallback& callback) {
+			datagramCallback_ = callback;
+		}
+
+		void sendDatagram(const ByteBuffer& payload, const asio::ip::udp::endpoint& endpoint);
+
+		// Queues a datagram for the next batched send, used for KCP output.
+		// The queue is flushed at the end of every update tick and receive batch.
+		void queuePacket(const char *buf, int len, const asio::ip::udp::endpoint& endpoint);
+		void flushPackets();
+
+		// Sends one message to every session that filter accepts (all of them if filter is empty), on all shards.
+		// The payload is framed once and shared by the shards instead of being copied per session, every shard
+		// walks its own sessions on its own thread in batches of BROADCAST_BATCH_SIZE, so filter is called there.
+		// onDone gets the result of every session on the thread of this interface once all shards are through.
+		void broadcast(std::shared_ptr<const ByteBuffer> pPayload, const BroadcastFilter& filter,
+			NetChannel channel = NetChannelOrdered, const BroadcastCallback& onDone = BroadcastCallback());
+
+		// channel is the one a message came in on (NetRcvMsg) or that became writable (NetWritable).
+		void callEventCallbackFunc(std::shared_ptr<Session> pSession, NetEventType event_type, ByteBufferPtr pdatas, NetChannel channel = NetChannelOrdered);
 		void setEventCallback(const std::function<net_event_callback_t>& eventCallback);
 
+		// Runs the event callbacks on the threads of pExecutor instead of the io threads, on all shards.
+		// Set before initialize(), NULL runs them inline.
+		void setHandlerExecutor(std::shared_ptr<HandlerExecutor> pExecutor);
+
+		HandlerExecutor* handlerExecutor() const {
+			return pHandlerExecutor_.get();
+		}
+
+		// Applies to sessions created afterwards, on all shards.
+		void setKcpTuningPolicy(const KcpTuningPolicy& policy);
+
+		const KcpTuningPolicy& kcpTuningPolicy() const {
+			return kcpTuningPolicy_;
+		}
+
+		MessagePool& messagePool() {
+			return *pMessagePool_;
+		}
+
+		// Receive drops of this shard.
+		const FloodGuard& floodGuard() const {
+			return floodGuard_;
+		}
+
+		// Monotonic milliseconds, sampled once per io event so sessions share one clock read.
+		uint64_t tickTime() const {
+			return tickTime_;
+		}
+
+		void scheduleSession(Session& session, uint64_t expire);
+
+		// False once the session was removed, must be called on the thread of its shard.
+		bool isSessionOpen(const Session& session) const;
+
+		// Called by a handler thread done with the session, it is released on the next tick of its shard.
+		void releaseSession(std::shared_ptr<Session> pSession);
+
+		asio::io_service& ioService() {
+			return udp_socket_.get_io_service();
+		}
+
+		int shardIndex() const {
+			return shardIndex_;
+		}
+
+		NetTransport transport() const {
+			return transport_;
+		}
+
+		int numShards() const {
+			return (int)pPrimary_->shards_.size();
+		}
+
+		NetworkInterface& shard(int index) {
+			return *pPrimary_->shards_[index];
+		}
+
+		NetworkInterface& shardOf(SessionID sessionID) {
+			return shard(shardOfSessionID(sessionID, numShards()));
+		}
+
+		// KCP encodes conv in little endian, so the low byte is the first byte of every datagram.
+		static int shardOfSessionID(SessionID sessionID, int numShards) {
+			return (int)(sessionID & 0xff) % numShards;
+		}
+
 	protected:
+		// numShards is passed in, the primary's shards_ is still being filled while its shards are constructed.
+		NetworkInterface(NetworkInterface& primary, int shardIndex, int numShards);
+
+		// Sessions sent to per handler, the rest of a broadcast is posted again so receiving goes on in between.
+		enum { BROADCAST_BATCH_SIZE = 64 };
+
+		struct BroadcastState;
+		void broadcastShard(std::shared_ptr<BroadcastState> pState, size_t pos);
+		void finishBroadcast(std::shared_ptr<BroadcastState> pState);
+
+		// Hole punching towards one peer, driven by the update timer. The requester waits for the introduction and
+		// then sends HELLOs until the handshake completed, on the shard of the rendezvous session. The other side
+		// PUNCHes until the session is accepted, on the shard that accepts it (see acceptShardOf).
+		enum PunchState
+		{
+			PUNCH_INTRODUCING,
+			PUNCH_CONNECTING,
+			PUNCH_OPENING
+		};
+
+		struct PunchAttempt
+		{
+			SessionID rendezvousSessionID;
+			uint64_t peerID;
+			asio::ip::udp::endpoint endpoint;		// of the peer, once introduced
+			PunchState state;
+			int attempts;
+			uint64_t nextTime;
+			uint64_t requestTime;					// of the last PEER_INTRODUCE_REQUEST
+		};
+
+		void sendPeerRequest(ConnectPacket::Type type, SessionID rendezvousSessionID, uint64_t peerID);
+		void introducePeers(SessionID targetSessionID, uint64_t targetPeerID, SessionID requesterSessionID, uint64_t requesterPeerID,
+			const asio::ip::udp::endpoint& requesterEndpoint);
+		void handleIntroducePacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleDatagramPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void startPunch(SessionID rendezvousSessionID, uint64_t peerID, bool initiator, const asio::ip::udp::endpoint& peerEndpoint,
+			const asio::ip::udp::endpoint& remoteEndpoint);
+		void addPunch(const PunchAttempt& punch);
+		PunchAttempt* findPunch(SessionID rendezvousSessionID, uint64_t peerID, PunchState state);
+		void punchFailed(const PunchAttempt& punch);
+		void updatePunches();
+
+		void openSocket(const asio::ip::udp::endpoint& endpoint, bool reusePort);
+		bool attachReusePortFilter();
+
+		void startShardThreads();
+		void joinShardThreads();
+		void drainHandlers();
+		void stopShard();
+
 		void hookAsyncReceive(void);
 		void handleReceiveFrom(const std::error_code& error, size_t bytes_recvd);
-		void handlePacketKCP(size_t bytes_recvd);
+		void handleReceiveReady(const std::error_code& error);
+		void handleUringReady(const std::error_code& error);
+		void handleSendReady(const std::error_code& error);
+		void receiveUring();
+		void drainUring();
+		void postUringDrain();
+		void handleReceived(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint, size_t segmentSize);
+		void handleDatagram(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handlePacketKCP(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void inputPacketKCP(Session* session, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void forwardPacket(NetworkInterface& target, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+
+		void handleControlPacket(ConnectPacket::Type type, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleHelloPacket(const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleCookiePacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleConnectPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleAcceptPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleDisconnectPacket(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleSessionControlPacket(ConnectPacket::Type type, ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		void handleSessionControl(ConnectPacket::Type type, SessionID sessionID, uint64_t value, const asio::ip::udp::endpoint& remoteEndpoint);
+
+		// Seconds of the monotonic clock, the time base of handshake cookies.
+		uint32_t cookieTime() const {
+			return (uint32_t)(tickTime_ / 1000);
+		}
 
-		void handleConnectPacket();
-		void handleConnectAckPacket();
-		void handleDisconnectPacket();
+		bool isPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint, bool erase);
+
+		// False if no connect to remoteEndpoint is pending. connectTime is when the last CONNECT went to it, 0 if none did.
+		bool findPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint, uint64_t& connectTime);
+		void setConnectTime(const asio::ip::udp::endpoint& remoteEndpoint, uint64_t connectTime);
+		void addPendingConnect(const asio::ip::udp::endpoint& remoteEndpoint);
+		void expirePendingConnects();
+
+		// A CONNECT is accepted by the shard its endpoint hashes to, which finds a session it accepted from there before.
+		NetworkInterface& acceptShardOf(const asio::ip::udp::endpoint& remoteEndpoint);
+		void acceptSession(const asio::ip::udp::endpoint& remoteEndpoint);
+		void forgetAccepted(const asio::ip::udp::endpoint& remoteEndpoint, SessionID sessionID);
+		void openSession(SessionID sessionID, const asio::ip::udp::endpoint& remoteEndpoint);
+		void closeSession(SessionID sessionID, const asio::ip::udp::endpoint& remoteEndpoint);
+
+		void updateTickTime() {
+			tickTime_ = getMonotonicTime();
+		}
 
 		void hookUpdateTimer(void);
 		void handleUpdateTimer(void);
 
 		bool addSession(SessionID sessionID, std::shared_ptr<Session> session);
 		bool removeSession(SessionID sessionID);
-		std::shared_ptr<Session> findSession(SessionID sessionID);
 
+		void freeReleasedSessions();
+
+		Session* findSession(SessionID sessionID) const {
+			return sessions_.find(sessionID);
+		}
 	protected:
+		// Only set on the shards created by the primary, which run their own thread.
+		std::unique_ptr<asio::io_service> pOwnedIoService_;
+
 		asio::ip::udp::socket udp_socket_;
 		bool stopped_;
 
 		asio::ip::udp::endpoint remoteEndpoint_;
 
-		//enum { UDP_PACKET_MAX_LENGTH = 548 }; // maybe 1472 will be ok.
-		enum { UDP_PACKET_MAX_LENGTH = 1080 }; // (576-8-20 - 8) * 2
+		// Receive buffers only hold single datagrams, messages are reassembled into pooled buffers.
+		enum { UDP_RECV_BUFFER_SIZE = 1024 * 9 }; // jumbo frames
 
 		ByteBuffer buffer_;
 
+#if P2PCLOUDS_HAS_MMSG
+		UdpRecvBatch recvBatch_;
+		UdpSendBatch sendBatch_;
+		bool sendWaitPosted_;			// waiting for the socket to take the rest of sendBatch_
+#endif
+
+		NetTransport transport_;
+
+#if P2PCLOUDS_HAS_IO_URING
+		// Only set with NetTransportUring, asio waits for completions on the ring fd.
+		std::unique_ptr<UdpUring> pUring_;
+		asio::posix::stream_descriptor uringDescriptor_;
+		bool uringDrainPosted_;			// a drainUring() is posted
+#endif
+
 		asio::steady_timer tick_timer_;
 
-		std::map< SessionID, std::shared_ptr<Session> > sessions_;
+		uint64_t tickTime_;
+		TimerWheel timerWheel_;
+
+		SessionTable sessions_;
+
+		FloodGuard floodGuard_;
+
+		std::vector<PunchAttempt> punches_;
+
+		// Sessions this shard accepted, by the endpoint of the CONNECT. A CONNECT from there again is a retry or a
+		// replay as long as the peer did not use the session, and is answered with the same session.
+		std::map<asio::ip::udp::endpoint, SessionID> acceptedSessions_;
+
+		// Sessions handed back by handler threads, so their last reference drops on the io thread of the shard.
+		std::mutex releaseMutex_;
+		std::vector<std::shared_ptr<Session>> releasedSessions_;
+
+		std::shared_ptr<MessagePool> pMessagePool_;
 
 		std::function<net_event_callback_t> event_callback_;
+		std::shared_ptr<HandlerExecutor> pHandlerExecutor_;
+
+		// primary only.
+		DatagramCallback datagramCallback_;
+
+		KcpTuningPolicy kcpTuningPolicy_;
+
+		NetworkInterface* pPrimary_;
+		int shardIndex_;
+
+		// primary only, index 0 is the primary itself.
+		std::vector<NetworkInterface*> shards_;
+		std::vector<std::thread> shardThreads_;
+
+		// primary only, shared by the shards and never changed after construction.
+		ConnectCookie connectCookie_;
+
+		// primary only, peers we sent a HELLO to. Cookies and accepts from anyone else are dropped, a connect
+		// not accepted within P2PCLOUDS_CONNECTION_TIMEOUT_TIME is given up.
+		struct PendingConnect
+		{
+			uint64_t helloTime;
+			uint64_t connectTime;		// when the last CONNECT went out, 0 if none did
+		};
+
+		std::mutex pendingConnectsMutex_;
+		std::map<asio::ip::udp::endpoint, PendingConnect> pendingConnects_;
+
+		// primary only, the peers registered at this node as rendezvous, by peer ID and by session.
+		std::mutex peersMutex_;
+		std::map<uint64_t, SessionID> peers_;
+		std::map<SessionID, uint64_t> peerOfSession_;
 	};
 
 }
@@ -4,14 +4,87 @@
 
 #include "log/log.h"
 
+#include <openssl/rand.h>
+#include <random>
+
 namespace P2pClouds {
 
+	namespace {
+
+		// Every KCP payload carries one or more messages, each prefixed with its LEB128 encoded length.
+		size_t encodeFrameLength(uint8_t* p, uint32_t len)
+		{
+			size_t size = 0;
+
+			while (len >= 0x80)
+			{
+				p[size++] = (uint8_t)(len | 0x80);
+				len >>= 7;
+			}
+
+			p[size++] = (uint8_t)len;
+			return size;
+		}
+
+		bool decodeFrameLength(const uint8_t* p, size_t available, uint32_t& len, size_t& size)
+		{
+			len = 0;
+
+			for (size = 0; size < available && size < 5; ++size)
+			{
+				len |= (uint32_t)(p[size] & 0x7f) << (7 * size);
+
+				if ((p[size] & 0x80) == 0)
+				{
+					++size;
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		/*
+			Datagrams of the channels after NetChannelOrdered keep the conv in front, so they are routed like any
+			KCP datagram, the byte after it (the KCP cmd) tells them apart from plain KCP and FEC:
+
+			conv(4) type(1) channel(1) payload
+			- CHANNEL_TYPE_KCP: payload is a KCP datagram of the channel's own KCP stream
+			- CHANNEL_TYPE_RAW: payload is one message of NetChannelUnreliable
+		*/
+		enum {
+			CHANNEL_HEADER_SIZE = 6,
+			CHANNEL_TYPE_KCP = 0xf3,
+			CHANNEL_TYPE_RAW = 0xf4
+		};
+	}
+
 	Session::Session(SessionID id, NetworkInterface& networkInterface, const asio::ip::udp::endpoint& remoteEndpoint)
 	    : networkInterface_(networkInterface)
 		, remoteEndpoint_(std::move(remoteEndpoint))
 		, id_(id)
+		, channels_(NetChannelUnreliable, KcpChannel(networkInterface.kcpTuningPolicy()))
 		, pKCP_(NULL)
-		, lastRecvTime_(getTimeStamp())
+		, lastRecvTime_(networkInterface.tickTime())
+		, received_(false)
+		, closed_(false)
+		, recvBucket_()
+		, sendLowWatermark_(P2PCLOUDS_SEND_LOW_WATERMARK)
+		, sendHighWatermark_(P2PCLOUDS_SEND_HIGH_WATERMARK)
+		, wantWritable_(0)
+		, blockedChannels_(0)
+		, channelPacket_()
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		, mtuProber_()
+#endif
+		, fecEncoder_()
+		, fecDecoder_()
+		, fecRequested_(0)
+		, fecRequestTime_(0)
+		, handlerStrand_()
+		, pathEndpoint_()
+		, pathToken_(0)
+		, pathChallengeTime_(0)
 	{
 	}
 
@@ -22,15 +95,31 @@ namespace P2pClouds {
 
 	bool Session::initialize()
 	{
-		return init_kcp();
+		if (!init_kcp())
+			return false;
+
+		scheduleUpdate(networkInterface_.tickTime());
+		return true;
 	}
 
 	bool Session::finalise()
 	{
+		close();
+		return fina_kcp();
+	}
+
+	void Session::close()
+	{
+		unlink();
+
+		if (closed_)
+			return;
+
+		closed_ = true;
+
 		LOG_INFO("send disconnect packet! {}", c_str());
-		ByteBuffer packet = ConnectPacket::make_disconnect_packet(id());
+		ByteBuffer packet = ConnectPacket::makeDisconnectPacket(id());
 		sendPacket(packet);
-		return fina_kcp();
 	}
 
 	std::string Session::c_str()
@@ -54,7 +143,7 @@ namespace P2pClouds {
 		return ptr;
 	}
 
-	SessionID Session::createNewSessionID(SessionID arrayIndex)
+	SessionID Session::createNewSessionID(SessionID arrayIndex, int shardIndex, int numShards)
 	{
 		assert((std::is_same<SessionID, uint32_t>::value));
 
@@ -65,55 +154,204 @@ namespace P2pClouds {
 
 		sessionID |= index;
 
-		std::random_device rd;
-		std::default_random_engine e(rd());
+		static thread_local std::default_random_engine e(std::random_device{}());
 		std::uniform_int_distribution<> u(0, 0xffff);
 		SessionID rnd = u(e);
 
+		// NetworkInterface::shardOfSessionID() must give shardIndex: lowByte % numShards == shardIndex.
+		SessionID lowByte = (SessionID)shardIndex + (SessionID)numShards * ((rnd & 0xff) % ((0xff - shardIndex) / numShards + 1));
+		rnd = (rnd & 0xff00) | lowByte;
+
 		sessionID |= rnd;
 		return sessionID;
 	}
 
 	bool Session::init_kcp()
 	{
-		pKCP_ = ikcp_create(id(), (void*)this);
-		pKCP_->output = &Session::output;
+		for (KcpChannel& channel : channels_)
+		{
+			channel.pKCP = ikcp_create(id(), (void*)this);
+			channel.pKCP->output = &Session::output;
+
+			// normal
+			//ikcp_nodelay(channel.pKCP, 0, 40, 0, 0);
 
-		// normal
-		//ikcp_nodelay(pKCP_, 0, 40, 0, 0);
+			// fast speed
+			ikcp_nodelay(channel.pKCP, 1, 10, 2, 1);
 
-		// fast speed
-		ikcp_nodelay(pKCP_, 1, 10, 2, 1);
+			// A message only completes once all of its fragments fit into the receive queue,
+			// KCP allows up to 255 fragments per message.
+			ikcp_wndsize(channel.pKCP, 0, 256);
+
+			// From here on the window, interval, resend and nodelay follow the measured connection.
+			channel.tuner.reset(channel.pKCP, networkInterface_.tickTime());
+		}
+
+		pKCP_ = channels_[NetChannelOrdered].pKCP;
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		// Starts at the base MTU and grows with every acked probe once startMtuProbe() was called.
+		mtuProber_.reset(pKCP_, endpoint());
+#endif
+
+		syncChannelMtu();
 		return true;
 	}
 
 	bool Session::fina_kcp()
 	{
-		ikcp_release(pKCP_);
+		for (KcpChannel& channel : channels_)
+		{
+			if (channel.pKCP)
+				ikcp_release(channel.pKCP);
+
+			channel.pKCP = NULL;
+		}
+
 		pKCP_ = NULL;
 		return true;
 	}
 
-	bool Session::update(time_t timeStamp)
+	void Session::syncChannelMtu()
 	{
-		ikcp_update(pKCP_, (IUINT32)(timeStamp & 0xfffffffful));
+		// The other channels follow the probed MTU of NetChannelOrdered, less their own header.
+		uint32_t mtu = pKCP_->mtu - CHANNEL_HEADER_SIZE;
 
-		if (isTimeout())
+		for (size_t i = NetChannelOrdered + 1; i < channels_.size(); ++i)
+		{
+			if (channels_[i].pKCP->mtu != mtu)
+				ikcp_setmtu(channels_[i].pKCP, (int)mtu);
+		}
+	}
+
+	bool Session::update(uint64_t now)
+	{
+		if (isTimeout(now))
 		{
 			LOG_INFO("session timeout: {}", c_str());
 			handTimeout();
 			return false;
 		}
 
+		syncChannelMtu();
+
+		// In the order of priority, so the datagrams of NetChannelOrdered are the first of the send batch.
+		for (KcpChannel& channel : channels_)
+		{
+			if (channel.sendQueue.length() > 0 && now >= channel.sendFlushTime)
+				flushSendQueue(channel);
+
+			ikcp_update(channel.pKCP, (IUINT32)(now & 0xfffffffful));
+		}
+
+		// Groups end with the flush, so their parity does not wait for later traffic.
+		if (fecEncoder_.dataShards() > 0)
+			fecEncoder_.flush([this](const char* buf, int len) { queueDatagram(buf, len); });
+
+		if (fecRequested_ != fecEncoder_.dataShards() && now >= fecRequestTime_)
+			sendFecRequest(now);
+
+		checkWritable();
+
+		for (size_t i = NetChannelOrdered + 1; i < channels_.size(); ++i)
+			channels_[i].tuner.update(channels_[i].pKCP, now);
+
+		// Bulk channels are expected to queue up, only the lag of NetChannelOrdered is reported.
+		if (channels_[NetChannelOrdered].tuner.update(pKCP_, now) != KcpTuner::LAG_NONE)
+		{
+			LOG_INFO("Session::update(): lag {}, rtt={}ms! {}", isLagging() ? "begin" : "end", rtt(), c_str());
+			networkInterface_.callEventCallbackFunc(shared_from_this(), NetEventType::NetLagNotify, NULL);
+		}
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		uint32_t probeSize = mtuProber_.update(pKCP_, now);
+		if (probeSize > 0)
+			sendMtuProbe(probeSize);
+#endif
+
+		scheduleUpdate(now);
 		return true;
 	}
 
+	void Session::scheduleUpdate(uint64_t now)
+	{
+		// A closed session only waits for its last reference to go.
+		if (closed_)
+			return;
+
+		uint64_t expire = lastRecvTime_ + P2PCLOUDS_CONNECTION_TIMEOUT_TIME;
+
+		for (const KcpChannel& channel : channels_)
+		{
+			ikcpcb* pKCP = channel.pKCP;
+
+			// An idle KCP (nothing to send, ack or probe) needs no update until input or send.
+			if (!pKCP->updated || ikcp_waitsnd(pKCP) > 0 || pKCP->ackcount > 0 || pKCP->probe != 0)
+			{
+				IUINT32 current = (IUINT32)(now & 0xfffffffful);
+				IINT32 delay = (IINT32)(ikcp_check(pKCP, current) - current);
+				expire = std::min(expire, now + (uint64_t)std::max(delay, 0));
+			}
+
+			if (channel.sendQueue.length() > 0)
+				expire = std::min(expire, channel.sendFlushTime);
+		}
+
+		if (fecRequested_ != fecEncoder_.dataShards())
+			expire = std::min(expire, std::max(fecRequestTime_, now));
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		expire = std::min(expire, std::max(mtuProber_.nextTime(), now));
+#endif
+
+		networkInterface_.scheduleSession(*this, expire);
+	}
+
 	int Session::output(const char *buf, int len, ikcpcb *kcp, void *user)
 	{
-		((Session*)user)->sendPacket(buf, len);
+		Session* pSession = (Session*)user;
+
+		size_t channel = NetChannelOrdered;
+		while (channel + 1 < pSession->channels_.size() && pSession->channels_[channel].pKCP != kcp)
+			++channel;
+
+		pSession->channels_[channel].tuner.onOutput(buf, len);
+
+		if (channel == NetChannelOrdered)
+			pSession->outputDatagram(buf, len);
+		else
+			pSession->outputChannelDatagram(CHANNEL_TYPE_KCP, (NetChannel)channel, buf, len);
+
 		return 0;
 	}
 
+	void Session::outputDatagram(const char *buf, int len)
+	{
+		if (fecEncoder_.dataShards() > 0)
+			fecEncoder_.encode(buf, len, [this](const char* p, int n) { queueDatagram(p, n); });
+		else
+			queueDatagram(buf, len);
+	}
+
+	void Session::outputChannelDatagram(uint8_t type, NetChannel channel, const char *buf, int len)
+	{
+		SessionID conv = id();
+		EndianConvert(conv);
+
+		channelPacket_.resize(CHANNEL_HEADER_SIZE + len);
+		memcpy(&channelPacket_[0], &conv, sizeof(conv));
+		channelPacket_[4] = (char)type;
+		channelPacket_[5] = (char)channel;
+		memcpy(&channelPacket_[CHANNEL_HEADER_SIZE], buf, len);
+
+		outputDatagram(&channelPacket_[0], (int)channelPacket_.size());
+	}
+
+	void Session::queueDatagram(const char *buf, int len)
+	{
+		networkInterface_.queuePacket(buf, len, endpoint());
+	}
+
 	size_t Session::sendPacket(ByteBuffer& datas)
 	{
 		return networkInterface_.sendPacket(datas, endpoint());
@@ -124,44 +362,472 @@ namespace P2pClouds {
 		return networkInterface_.sendPacket(buf, len, endpoint());
 	}
 
-	void Session::sendPacketKCP(ByteBuffer& datas)
+	NetSendStatus Session::sendPacketKCP(const ByteBuffer& datas, NetChannel channel)
+	{
+		if (HandlerExecutor::isHandlerThread())
+		{
+			if (channel < NetChannelUnreliable && (blockedChannels_ & (1u << channel)) != 0)
+			{
+				postWantWritable(channel);
+				return NetSendWouldBlock;
+			}
+
+			postSend(datas, channel);
+			return NetSendOK;
+		}
+
+		if (channel == NetChannelUnreliable)
+		{
+			// Never fragmented, a lost datagram is a lost message.
+			if (datas.length() + CHANNEL_HEADER_SIZE > pKCP_->mtu)
+			{
+				LOG_ERROR("Session::sendPacketKCP(): unreliable message too large! size={}, {}", datas.length(), c_str());
+				return NetSendError;
+			}
+
+			outputChannelDatagram(CHANNEL_TYPE_RAW, channel, (const char*)datas.data() + datas.rpos(), (int)datas.length());
+			return NetSendOK;
+		}
+
+		uint8_t header[5];
+		size_t headerSize = encodeFrameLength(header, (uint32_t)datas.length());
+		return sendFrame(channel, header, headerSize, datas.data() + datas.rpos(), datas.length());
+	}
+
+	void Session::postSend(const ByteBuffer& datas, NetChannel channel)
+	{
+		// KCP is not locked, only the thread of the shard may touch it. The caller's buffer may be gone by then.
+		ByteBufferPtr pDatas = std::make_shared<ByteBuffer>();
+		pDatas->append(datas.data() + datas.rpos(), datas.length());
+
+		std::shared_ptr<Session> pSession = shared_from_this();
+
+		networkInterface_.ioService().post([pSession, pDatas, channel]()
+		{
+			// Closed while the handler ran.
+			if (!pSession->networkInterface_.isSessionOpen(*pSession))
+				return;
+
+			pSession->sendPacketKCP(*pDatas, channel);
+			pSession->networkInterface_.flushPackets();
+		});
+	}
+
+	void Session::postWantWritable(NetChannel channel)
+	{
+		std::shared_ptr<Session> pSession = shared_from_this();
+
+		networkInterface_.ioService().post([pSession, channel]()
+		{
+			if (!pSession->networkInterface_.isSessionOpen(*pSession))
+				return;
+
+			// The backlog may have drained since the handler looked, NetWritable is raised right away then.
+			pSession->wantWritable_ |= 1u << channel;
+			pSession->checkWritable();
+		});
+	}
+
+	NetSendStatus Session::sendFrameKCP(const ByteBuffer& frame, NetChannel channel)
+	{
+		return sendFrame(channel, NULL, 0, frame.data() + frame.rpos(), frame.length());
+	}
+
+	ByteBuffer Session::makeFrame(const ByteBuffer& datas)
+	{
+		uint8_t header[5];
+		size_t headerSize = encodeFrameLength(header, (uint32_t)datas.length());
+
+		ByteBuffer frame;
+		frame.append(header, headerSize);
+		frame.append(datas.data() + datas.rpos(), datas.length());
+		return frame;
+	}
+
+	NetSendStatus Session::sendFrame(NetChannel channel, const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadSize)
+	{
+		if (channel >= NetChannelUnreliable)
+			return NetSendError;
+
+		if (!isWritable(channel))
+		{
+			wantWritable_ |= 1u << channel;
+			blockedChannels_ |= 1u << channel;
+			return NetSendWouldBlock;
+		}
+
+		KcpChannel& kcpChannel = channels_[channel];
+		size_t frameSize = headerSize + payloadSize;
+
+		// KCP splits a payload into at most 255 fragments.
+		if (frameSize > (size_t)kcpChannel.pKCP->mss * 255)
+		{
+			LOG_ERROR("Session::sendFrame(): message too large! size={}, {}", frameSize, c_str());
+			return NetSendError;
+		}
+
+		// A payload is either a batch of messages that fits into one segment, or a single larger message.
+		if (kcpChannel.sendQueue.length() + frameSize > kcpChannel.pKCP->mss && !flushSendQueue(kcpChannel))
+			return NetSendError;
+
+		uint64_t now = networkInterface_.tickTime();
+
+		// A framed message that fills a segment on its own needs no copy into the queue.
+		if (headerSize == 0 && frameSize >= kcpChannel.pKCP->mss)
+		{
+			int ret = ikcp_send(kcpChannel.pKCP, (const char*)payload, (int)frameSize);
+			if (ret < 0)
+			{
+				LOG_ERROR("Session::sendFrame(): ikcp_send error: {}! {}", ret, c_str());
+				return NetSendError;
+			}
+		}
+		else
+		{
+			if (kcpChannel.sendQueue.length() == 0)
+				kcpChannel.sendFlushTime = now + P2PCLOUDS_SEND_COALESCE_DELAY;
+
+			kcpChannel.sendQueue.append(header, headerSize);
+			kcpChannel.sendQueue.append(payload, payloadSize);
+
+			if (kcpChannel.sendQueue.length() >= kcpChannel.pKCP->mss && !flushSendQueue(kcpChannel))
+				return NetSendError;
+		}
+
+		// Handler threads can not look into KCP, they refuse their sends by this.
+		if (!isWritable(channel))
+			blockedChannels_ |= 1u << channel;
+
+		scheduleUpdate(now);
+		return NetSendOK;
+	}
+
+	bool Session::flushSendQueue(KcpChannel& channel)
+	{
+		ByteBuffer& sendQueue = channel.sendQueue;
+		if (sendQueue.length() == 0)
+			return true;
+
+		int ret = ikcp_send(channel.pKCP, (const char*)sendQueue.data() + sendQueue.rpos(), (int)sendQueue.length());
+		sendQueue.clear(false);
+
+		if (ret < 0)
+		{
+			LOG_ERROR("Session::flushSendQueue(): ikcp_send error: {}! {}", ret, c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	void Session::checkWritable()
+	{
+		uint32_t channels = wantWritable_ | blockedChannels_;
+
+		for (size_t i = 0; i < channels_.size() && channels != 0; ++i)
+		{
+			if ((channels & (1u << i)) == 0 || ikcp_waitsnd(channels_[i].pKCP) > (int)sendLowWatermark_)
+				continue;
+
+			channels &= ~(1u << i);
+			blockedChannels_ &= ~(1u << i);
+
+			if ((wantWritable_ & (1u << i)) == 0)
+				continue;
+
+			wantWritable_ &= ~(1u << i);
+			networkInterface_.callEventCallbackFunc(shared_from_this(), NetEventType::NetWritable, NULL, (NetChannel)i);
+		}
+	}
+
+	void Session::sendMtuProbe(uint32_t size)
+	{
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		ByteBuffer packet = ConnectPacket::makeMtuProbePacket(id(), size);
+
+		// EMSGSIZE, the local interface is already smaller.
+		if (sendPacket(packet) == 0)
+			mtuProber_.onProbeTooLarge(size);
+#endif
+	}
+
+	void Session::startMtuProbe()
+	{
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		mtuProber_.start(networkInterface_.tickTime());
+		scheduleUpdate(networkInterface_.tickTime());
+#endif
+	}
+
+	void Session::onMtuProbeAck(uint32_t size)
+	{
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		uint32_t oldMtu = mtuProber_.mtu();
+		mtuProber_.onProbeAck(pKCP_, size);
+
+		if (mtuProber_.mtu() != oldMtu)
+			LOG_DEBUG("Session::onMtuProbeAck(): mtu {} -> {}, {}", oldMtu, mtuProber_.mtu(), c_str());
+
+		// Probe the next size right away.
+		scheduleUpdate(networkInterface_.tickTime());
+#endif
+	}
+
+	bool Session::setFec(uint32_t dataShards)
+	{
+		if (dataShards == 1)
+		{
+			LOG_WARNING("Session::setFec(): 1 data shard per parity is a copy of every datagram, use 2 or more! {}", c_str());
+			return false;
+		}
+
+		fecRequested_ = std::min(dataShards, (uint32_t)P2PCLOUDS_FEC_MAX_DATA_SHARDS);
+
+		// Turning it off needs no consent.
+		if (dataShards == 0)
+			onFecAck(0);
+
+		sendFecRequest(networkInterface_.tickTime());
+		return true;
+	}
+
+	void Session::sendFecRequest(uint64_t now)
+	{
+		ByteBuffer packet = ConnectPacket::makeFecPacket(ConnectPacket::CONTROL_FEC_REQUEST, id(), fecRequested_);
+		sendPacket(packet);
+
+		fecRequestTime_ = now + std::max((uint64_t)pKCP_->rx_rto, (uint64_t)100);
+		scheduleUpdate(now);
+	}
+
+	void Session::onFecRequest(uint32_t dataShards)
+	{
+		// The decoder handles any group size, only the range is checked.
+		uint32_t accepted = std::min(dataShards, (uint32_t)P2PCLOUDS_FEC_MAX_DATA_SHARDS);
+		if (accepted == 1)
+			accepted = 2;
+
+		ByteBuffer packet = ConnectPacket::makeFecPacket(ConnectPacket::CONTROL_FEC_ACK, id(), accepted);
+		sendPacket(packet);
+	}
+
+	void Session::onFecAck(uint32_t dataShards)
+	{
+		// The peer may accept fewer data shards per parity than asked for, or none.
+		fecEncoder_.setDataShards(std::min(dataShards, fecRequested_));
+		fecRequested_ = fecEncoder_.dataShards();
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		mtuProber_.setHeadroom(pKCP_, fecEncoder_.dataShards() > 0 ? FEC_HEADER_SIZE : 0);
+#endif
+
+		LOG_INFO("Session::onFecAck(): fec data shards={}, {}", fecEncoder_.dataShards(), c_str());
+	}
+
+	void Session::input(ByteBuffer& datas)
 	{
-		int sentSize = ikcp_send(pKCP_, (const char*)datas.data(), datas.length());
-		if (sentSize < 0)
+		uint64_t now = networkInterface_.tickTime();
+		lastRecvTime_ = now;
+
+		// The peer can only send on the session once it got the ACCEPT.
+		if (!received_)
+		{
+			received_ = true;
+			startMtuProbe();
+		}
+
+		// KCP takes RTT samples against current, which is stale while the session was idle.
+		for (KcpChannel& channel : channels_)
+			channel.pKCP->current = (IUINT32)(now & 0xfffffffful);
+
+		const uint8_t* pDatagram = datas.data() + datas.rpos();
+		if (isFecPacket(pDatagram, datas.length()))
+			fecDecoder_.input(pDatagram, datas.length(), [this](const char* buf, int len) { inputDatagram(buf, len); });
+		else
+			inputDatagram((const char*)pDatagram, (int)datas.length());
+
+		scheduleUpdate(now);
+
+		// Acks may have drained the send backlog.
+		checkWritable();
+
+		receiveMessages();
+	}
+
+	void Session::receiveMessages()
+	{
+		HandlerExecutor* pExecutor = networkInterface_.handlerExecutor();
+
+		// An inline handler may close the session, this keeps it alive until we are out.
+		std::shared_ptr<Session> self = shared_from_this();
+
+		// One datagram may complete several payloads, deliver all of them now.
+		// Each payload is received straight into a pooled buffer of its size.
+		for (size_t i = 0; i < channels_.size(); ++i)
+		{
+			ikcpcb* pKCP = channels_[i].pKCP;
+
+			int payloadSize;
+			while ((payloadSize = ikcp_peeksize(pKCP)) > 0)
+			{
+				// Left in KCP, the receive window closes until the handlers caught up.
+				if (pExecutor && pExecutor->isFull(*this))
+					return;
+
+				ByteBufferPtr pPayload = networkInterface_.messagePool().allocate(payloadSize);
+
+				int bytes_recvd = ikcp_recv(pKCP, (char*)pPayload->data(), payloadSize);
+				if (bytes_recvd <= 0)
+				{
+					LOG_ERROR("Session::input(): ikcp_recv error: {}! {}", bytes_recvd, c_str());
+					break;
+				}
+
+				pPayload->wpos(bytes_recvd);
+
+				if (!deliverMessages(self, std::move(pPayload), (NetChannel)i))
+					return;
+			}
+		}
+	}
+
+	void Session::onPathChange(const asio::ip::udp::endpoint& newEndpoint)
+	{
+		uint64_t now = networkInterface_.tickTime();
+
+		// A fresh token for every new endpoint, a late response for an older one does not match.
+		if (pathToken_ == 0 || pathEndpoint_ != newEndpoint)
 		{
-			LOG_ERROR("send_kcp_msg(): sentSize < 0! {}", c_str());
+			pathEndpoint_ = newEndpoint;
+			pathChallengeTime_ = 0;
+
+			do
+			{
+				if (RAND_bytes((unsigned char*)&pathToken_, sizeof(pathToken_)) != 1)
+					pathToken_ = ((uint64_t)std::random_device{}() << 32) | std::random_device{}();
+			} while (pathToken_ == 0);
+
+			LOG_INFO("Session::onPathChange(): new endpoint {}:{}, validating. {}", newEndpoint.address().to_string(), newEndpoint.port(), c_str());
 		}
+
+		if (now < pathChallengeTime_)
+			return;
+
+		// Smaller than the datagram that triggered it, so a spoofed source gains nothing.
+		ByteBuffer packet = ConnectPacket::makePathPacket(ConnectPacket::CONTROL_PATH_CHALLENGE, id(), pathToken_);
+		networkInterface_.queuePacket((const char*)packet.data(), (int)packet.length(), pathEndpoint_);
+
+		pathChallengeTime_ = now + std::max((uint64_t)pKCP_->rx_rto, (uint64_t)100);
+	}
+
+	void Session::onPathResponse(const asio::ip::udp::endpoint& fromEndpoint, uint64_t token)
+	{
+		if (pathToken_ == 0 || token != pathToken_ || fromEndpoint != pathEndpoint_)
+			return;
+
+		LOG_INFO("Session::onPathResponse(): migrated to {}:{}. {}", fromEndpoint.address().to_string(), fromEndpoint.port(), c_str());
+
+		remoteEndpoint_ = fromEndpoint;
+		pathToken_ = 0;
+
+		uint64_t now = networkInterface_.tickTime();
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		// The new path may carry less, search again from the base MTU. The peer answered on it already.
+		mtuProber_.reset(pKCP_, endpoint());
+		mtuProber_.start(now);
+		syncChannelMtu();
+#endif
+
+		// Whatever waits for the peer goes out on the new path now.
+		for (KcpChannel& channel : channels_)
+			ikcp_flush(channel.pKCP);
+
+		scheduleUpdate(now);
 	}
 
-	void Session::input(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint)
+	void Session::resumeReceive()
 	{
-		lastRecvTime_ = getTimeStamp();
-		remoteEndpoint_ = remoteEndpoint;
+		std::shared_ptr<Session> pSession = shared_from_this();
+
+		networkInterface_.ioService().post([pSession]()
+		{
+			// Closed while its handlers were busy.
+			if (!pSession->networkInterface_.isSessionOpen(*pSession))
+				return;
+
+			pSession->receiveMessages();
+
+			// A reopened window is announced by the next flush.
+			pSession->scheduleUpdate(pSession->networkInterface_.tickTime());
+		});
+	}
+
+	void Session::inputDatagram(const char *buf, int len)
+	{
+		const uint8_t* p = (const uint8_t*)buf;
+
+		if (len < CHANNEL_HEADER_SIZE || (p[4] != CHANNEL_TYPE_KCP && p[4] != CHANNEL_TYPE_RAW))
+		{
+			ikcp_input(pKCP_, buf, (long)len);
+			return;
+		}
 
-		ikcp_input(pKCP_, (const char*)datas.data(), datas.length());
-		datas.wpos(0);
+		uint8_t channel = p[5];
 
+		if (p[4] == CHANNEL_TYPE_KCP && channel > NetChannelOrdered && channel < channels_.size())
 		{
-			int bytes_recvd = ikcp_recv(pKCP_, (char*)datas.data(), datas.size());
-			if (bytes_recvd <= 0)
+			ikcp_input(channels_[channel].pKCP, buf + CHANNEL_HEADER_SIZE, (long)(len - CHANNEL_HEADER_SIZE));
+		}
+		else if (p[4] == CHANNEL_TYPE_RAW && channel == NetChannelUnreliable)
+		{
+			size_t messageSize = len - CHANNEL_HEADER_SIZE;
+			ByteBufferPtr pMessage = networkInterface_.messagePool().allocate(messageSize);
+			memcpy(pMessage->data(), buf + CHANNEL_HEADER_SIZE, messageSize);
+
+			networkInterface_.callEventCallbackFunc(shared_from_this(), NetEventType::NetRcvMsg, std::move(pMessage), NetChannelUnreliable);
+		}
+	}
+
+	bool Session::deliverMessages(const std::shared_ptr<Session>& self, ByteBufferPtr pPayload, NetChannel channel)
+	{
+		while (pPayload->length() > 0)
+		{
+			uint32_t messageSize;
+			size_t headerSize;
+
+			if (!decodeFrameLength(pPayload->data() + pPayload->rpos(), pPayload->length(), messageSize, headerSize) ||
+				headerSize + messageSize > pPayload->length())
 			{
-				LOG_INFO("Session::input(): recvd_bytes <= 0! {}", c_str());
+				LOG_ERROR("Session::deliverMessages(): malformed payload! {}", c_str());
+				return true;
 			}
-			else
+
+			pPayload->read_skip(headerSize);
+
+			// The last message is handed over in the payload buffer itself, only coalesced ones are copied.
+			if (messageSize == pPayload->length())
 			{
-				assert(bytes_recvd < datas.size());
-				datas.wpos(bytes_recvd);
-				networkInterface_.callEventCallbackFunc(shared_from_this(), NetEventType::NetRcvMsg, &datas);
+				networkInterface_.callEventCallbackFunc(self, NetEventType::NetRcvMsg, std::move(pPayload), channel);
+				return networkInterface_.isSessionOpen(*this);
 			}
+
+			ByteBufferPtr pMessage = networkInterface_.messagePool().allocate(messageSize);
+			memcpy(pMessage->data(), pPayload->data() + pPayload->rpos(), messageSize);
+			pPayload->read_skip(messageSize);
+
+			networkInterface_.callEventCallbackFunc(self, NetEventType::NetRcvMsg, std::move(pMessage), channel);
+
+			if (!networkInterface_.isSessionOpen(*this))
+				return false;
 		}
+
+		return true;
 	}
 
-	bool Session::isTimeout(time_t timeStamp) const
+	bool Session::isTimeout(uint64_t now) const
 	{
-		if (lastRecvTime_ == 0)
-			return false;
-		
-		return (timeStamp == 0 ? getTimeStamp() : timeStamp) - lastRecvTime_ > P2PCLOUDS_CONNECTION_TIMEOUT_TIME;
+		return now > lastRecvTime_ + P2PCLOUDS_CONNECTION_TIMEOUT_TIME;
 	}
 
 	void Session::handTimeout(void)
@@ -1,14 +1,19 @@
 #pragma once
 
 #include "common.h"
-
-
+#include "kcp_tuner.h"
+#include "mtu_prober.h"
+#include "fec.h"
+#include "handler_executor.h"
+#include "flood_guard.h"
+#include "common/timer_wheel.h"
 
 namespace P2pClouds {
 
 	class NetworkInterface;
 
-	class Session : public std::enable_shared_from_this<Session>
+	// Scheduled in the update timer wheel of its NetworkInterface.
+	class Session : public std::enable_shared_from_this<Session>, public TimerWheelNode
 	{
 	public:
 		Session(SessionID id, NetworkInterface& networkInterface, const asio::ip::udp::endpoint& remoteEndpoint);
@@ -17,12 +22,20 @@ namespace P2pClouds {
 		static std::shared_ptr<Session> create(NetworkInterface& networkInterface,
 			uint32_t sessionID, const asio::ip::udp::endpoint& remoteEndpoint);
 
-		// Creating ID by the index of an array
-		static SessionID createNewSessionID(SessionID arrayIndex);
+		// Creating ID by the index of an array, the low byte is chosen so that the ID maps to the given shard.
+		static SessionID createNewSessionID(SessionID arrayIndex, int shardIndex = 0, int numShards = 1);
 
 		bool initialize();
 		bool finalise();
 
+		// Called when the session is removed from its NetworkInterface: leaves the timer wheel for good and
+		// sends the DISCONNECT to the peer, once.
+		void close();
+
+		NetworkInterface& networkInterface() {
+			return networkInterface_;
+		}
+
 		SessionID id() const {
 			return id_;
 		}
@@ -31,16 +44,97 @@ namespace P2pClouds {
 			return remoteEndpoint_;
 		}
 
-		// user level send packet.
-		void sendPacketKCP(ByteBuffer& datas);
+		// user level send packet, must be called on the thread of the session's shard.
+		// Small messages are queued and coalesced into one KCP payload of their channel, the queue is flushed when it
+		// reaches one segment or after P2PCLOUDS_SEND_COALESCE_DELAY. Returns NetSendWouldBlock while the backlog of
+		// the channel is above the high watermark, the message is dropped then and NetWritable is raised for the channel
+		// once the backlog drained. NetChannelUnreliable sends right away and never blocks.
+		// Called by a handler on a HandlerExecutor thread, a copy of the message is posted to the thread of the shard
+		// and NetSendOK returned. The backlog is only known there, the handler gets NetSendWouldBlock once the shard saw
+		// the channel reach the high watermark. Sends racing that are still dropped there, NetWritable follows in both cases.
+		NetSendStatus sendPacketKCP(const ByteBuffer& datas, NetChannel channel = NetChannelOrdered);
+
+		// Like sendPacketKCP() for a message framed once by makeFrame() and sent to many sessions (see NetworkInterface::broadcast).
+		// A frame of a segment or more goes to KCP straight from the shared buffer, only KCP copies it.
+		NetSendStatus sendFrameKCP(const ByteBuffer& frame, NetChannel channel = NetChannelOrdered);
+		static ByteBuffer makeFrame(const ByteBuffer& datas);
+
 		size_t sendPacket(ByteBuffer& datas);
 
-		bool update(time_t timeStamp);
+		bool isWritable(NetChannel channel = NetChannelOrdered) const {
+			return channel >= NetChannelUnreliable || ikcp_waitsnd(channels_[channel].pKCP) < (int)sendHighWatermark_;
+		}
+
+		// A datagram of the peer arrived on the session.
+		bool hasReceived() const {
+			return received_;
+		}
+
+		// Smoothed RTT in ms as measured by KCP, 0 before the first ack.
+		int32_t rtt() const {
+			return pKCP_->rx_srtt;
+		}
+
+		// Set while the RTT is above KcpTuningPolicy::lagRtt, NetLagNotify is raised on every change.
+		bool isLagging() const {
+			return channels_[NetChannelOrdered].tuner.isLagging();
+		}
+
+		uint32_t mtu() const {
+			return pKCP_->mtu;
+		}
+
+		// The session is established on both sides: at the ACCEPT on the connecting side, at the first datagram or
+		// MTU probe of the peer on the accepting one. Probing starts from here.
+		void startMtuProbe();
+
+		void onMtuProbeAck(uint32_t size);
+
+		// Asks the peer to accept XOR parity FEC, one parity datagram per dataShards KCP datagrams, 0 turns it off.
+		// Costs 1/dataShards more bandwidth, meant for latency critical sessions on lossy links.
+		// The request is repeated until the peer answered, FEC starts with the group size it accepted.
+		// 1 is rejected, a parity of one datagram is a plain copy. Above P2PCLOUDS_FEC_MAX_DATA_SHARDS it is lowered to that.
+		bool setFec(uint32_t dataShards);
+
+		uint32_t fecDataShards() const {
+			return fecEncoder_.dataShards();
+		}
+
+		void onFecRequest(uint32_t dataShards);
+		void onFecAck(uint32_t dataShards);
+
+		void setSendWatermarks(uint32_t low, uint32_t high) {
+			sendLowWatermark_ = std::min(low, high);
+			sendHighWatermark_ = high;
+		}
+
+		HandlerStrand& handlerStrand() {
+			return handlerStrand_;
+		}
 
-		// changing remoteEndpoint at every packet. Because we allow connection change ip or port. we using conv to indicate a connection.
-		void input(ByteBuffer& datas, const asio::ip::udp::endpoint& remoteEndpoint);
+		// Takes the messages left in KCP after the HandlerExecutor throttled the session, callable from any thread.
+		void resumeReceive();
 
-		bool isTimeout(time_t timeStamp = 0) const;
+		// Called by the timer wheel, returns false if the session timed out.
+		bool update(uint64_t now);
+
+		// Schedules the next update at the time ikcp_check() asks for, or at the timeout when KCP is idle.
+		void scheduleUpdate(uint64_t now);
+
+		// Per session receive limit, checked before input() so a flood on a known conv does not reach KCP.
+		bool admitDatagram(uint64_t now) {
+			return recvBucket_.consume(now, P2PCLOUDS_FLOOD_SESSION_RATE, P2PCLOUDS_FLOOD_SESSION_BURST);
+		}
+
+		// The session is found by conv, the endpoint of its peer only changes after path validation.
+		void input(ByteBuffer& datas);
+
+		// A datagram of the session came from another endpoint than its peer's. Sends a PATH_CHALLENGE there,
+		// at most once per RTO, replies keep going to the old endpoint until onPathResponse() validated the new one.
+		void onPathChange(const asio::ip::udp::endpoint& newEndpoint);
+		void onPathResponse(const asio::ip::udp::endpoint& fromEndpoint, uint64_t token);
+
+		bool isTimeout(uint64_t now) const;
 		void handTimeout(void);
 
 		std::string c_str();
@@ -51,12 +145,81 @@ namespace P2pClouds {
 		static int output(const char *buf, int len, ikcpcb *kcp, void *user);
 		size_t sendPacket(const char *buf, int len);
 
+		struct KcpChannel;
+
+		void postSend(const ByteBuffer& datas, NetChannel channel);
+		void postWantWritable(NetChannel channel);
+		NetSendStatus sendFrame(NetChannel channel, const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadSize);
+		bool flushSendQueue(KcpChannel& channel);
+		void checkWritable();
+		void syncChannelMtu();
+		void sendMtuProbe(uint32_t size);
+		void sendFecRequest(uint64_t now);
+		void queueDatagram(const char *buf, int len);
+		void outputDatagram(const char *buf, int len);
+		void outputChannelDatagram(uint8_t type, NetChannel channel, const char *buf, int len);
+		void inputDatagram(const char *buf, int len);
+		void receiveMessages();
+		// Returns false once a handler closed the session, nothing may be delivered after that.
+		bool deliverMessages(const std::shared_ptr<Session>& self, ByteBufferPtr pPayload, NetChannel channel);
+
 	protected:
 		NetworkInterface& networkInterface_;
 		asio::ip::udp::endpoint remoteEndpoint_;
 		SessionID id_;
+
+		// Every reliable channel is a KCP stream of its own, so a large transfer on one does not hold back the others.
+		struct KcpChannel
+		{
+			KcpChannel(const KcpTuningPolicy& policy)
+				: pKCP(NULL)
+				, sendQueue()
+				, sendFlushTime(0)
+				, tuner(policy)
+			{
+			}
+
+			ikcpcb* pKCP;
+
+			// Length-prefixed messages waiting to go into one KCP payload.
+			ByteBuffer sendQueue;
+			uint64_t sendFlushTime;
+
+			KcpTuner tuner;
+		};
+
+		// Indexed by NetChannel, up to NetChannelUnreliable.
+		std::vector<KcpChannel> channels_;
+
+		// The KCP of NetChannelOrdered, the RTT, MTU and FEC of the session are taken from it.
 		ikcpcb* pKCP_;
 		uint64_t lastRecvTime_;
+		bool received_;
+		bool closed_;
+		TokenBucket recvBucket_;
+
+		uint32_t sendLowWatermark_;
+		uint32_t sendHighWatermark_;
+		uint32_t wantWritable_;			// bit mask of the channels a send was refused on
+		std::atomic<uint32_t> blockedChannels_;	// channels at the high watermark, read by handler threads
+
+		std::vector<char> channelPacket_;
+
+#if P2PCLOUDS_HAS_PMTU_PROBE
+		MtuProber mtuProber_;
+#endif
+
+		FecEncoder fecEncoder_;
+		FecDecoder fecDecoder_;
+		uint32_t fecRequested_;
+		uint64_t fecRequestTime_;		// when to repeat an unanswered request
+
+		HandlerStrand handlerStrand_;
+
+		// The endpoint being validated, pathToken_ is 0 while there is none.
+		asio::ip::udp::endpoint pathEndpoint_;
+		uint64_t pathToken_;
+		uint64_t pathChallengeTime_;	// earliest time of the next challenge
 	};
 
 }
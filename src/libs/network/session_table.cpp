@@ -0,0 +1,107 @@
+#include "session_table.h"
+#include "session.h"
+
+#include "log/log.h"
+
+namespace P2pClouds {
+
+	SessionTable::SessionTable(int shardIndex, int numShards)
+		: shardIndex_(shardIndex)
+		, numShards_(numShards)
+		, slots_()
+		, freeSlots_()
+		, reservedCount_(0)
+		, remoteSessions_()
+	{
+	}
+
+	SessionTable::~SessionTable()
+	{
+		clear();
+	}
+
+	SessionID SessionTable::acquire()
+	{
+		uint32_t index;
+
+		if (!freeSlots_.empty())
+		{
+			index = freeSlots_.front();
+			freeSlots_.pop_front();
+		}
+		else if (slots_.size() < MAX_SLOTS)
+		{
+			index = (uint32_t)slots_.size();
+			slots_.push_back(Slot());
+		}
+		else
+		{
+			LOG_ERROR("SessionTable::acquire(): no free slot! shard={}", shardIndex_);
+			return 0;
+		}
+
+		SessionID sessionID;
+
+		// ID 0 is never handed out, and a remote peer may already use the same ID for one of our outgoing sessions.
+		do
+		{
+			sessionID = Session::createNewSessionID(index, shardIndex_, numShards_);
+		} while (sessionID == 0 || remoteSessions_.find(sessionID) != remoteSessions_.end());
+
+		slots_[index].id = sessionID;
+		slots_[index].session.reset();
+		++reservedCount_;
+		return sessionID;
+	}
+
+	bool SessionTable::add(SessionID sessionID, const std::shared_ptr<Session>& session)
+	{
+		if (isLocal(sessionID))
+		{
+			Slot& slot = slots_[sessionID >> 16];
+			if (slot.session)
+				return false;
+
+			slot.session = session;
+			--reservedCount_;
+			return true;
+		}
+
+		if (sessionID == 0)
+			return false;
+
+		return remoteSessions_.emplace(sessionID, session).second;
+	}
+
+	bool SessionTable::remove(SessionID sessionID)
+	{
+		if (isLocal(sessionID))
+		{
+			Slot& slot = slots_[sessionID >> 16];
+			if (!slot.session)
+				--reservedCount_;
+
+			// Move the session out first, its destructor may look at the table.
+			std::shared_ptr<Session> session;
+			session.swap(slot.session);
+			slot.id = 0;
+			freeSlots_.push_back(sessionID >> 16);
+			return true;
+		}
+
+		return remoteSessions_.erase(sessionID) > 0;
+	}
+
+	void SessionTable::clear()
+	{
+		std::vector<Slot> slots;
+		slots.swap(slots_);
+
+		std::unordered_map< SessionID, std::shared_ptr<Session> > remoteSessions;
+		remoteSessions.swap(remoteSessions_);
+
+		freeSlots_.clear();
+		reservedCount_ = 0;
+	}
+
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common.h"
+
+namespace P2pClouds {
+
+	class Session;
+
+	/*
+		Sessions of one NetworkInterface shard, indexed by SessionID.
+
+		IDs allocated here carry their slot index in the high 16 bits and random bits in the low 16 bits
+		(see Session::createNewSessionID), so a lookup is one array access and a stale ID of a reused slot
+		is rejected by its random bits. Freed slots are reused in FIFO order to keep stale IDs rare.
+
+		IDs chosen by a remote peer (our outgoing connections) can not be placed by their slot index,
+		they are kept in a small hash map next to the array.
+	*/
+	class SessionTable
+	{
+	public:
+		enum { MAX_SLOTS = 0x10000 };
+
+		SessionTable(int shardIndex = 0, int numShards = 1);
+		virtual ~SessionTable();
+
+		// Reserves a free slot and returns its new ID, 0 if the table is full.
+		// The slot is filled by add() or given back by remove().
+		SessionID acquire();
+
+		bool add(SessionID sessionID, const std::shared_ptr<Session>& session);
+		bool remove(SessionID sessionID);
+
+		Session* find(SessionID sessionID) const
+		{
+			uint32_t index = sessionID >> 16;
+			if (index < slots_.size() && slots_[index].id == sessionID)
+				return slots_[index].session.get();
+
+			if (remoteSessions_.empty())
+				return NULL;
+
+			auto iter = remoteSessions_.find(sessionID);
+			return iter == remoteSessions_.end() ? NULL : iter->second.get();
+		}
+
+		// Walks the live sessions, slot array first. f must not add or remove sessions.
+		template<typename F>
+		void forEach(F&& f) const
+		{
+			for (const Slot& slot : slots_)
+			{
+				if (slot.session)
+					f(*slot.session);
+			}
+
+			for (auto& item : remoteSessions_)
+				f(*item.second);
+		}
+
+		size_t size() const {
+			return slots_.size() - freeSlots_.size() - reservedCount_ + remoteSessions_.size();
+		}
+
+		void clear();
+
+	protected:
+		struct Slot
+		{
+			SessionID id;
+			std::shared_ptr<Session> session;
+		};
+
+		bool isLocal(SessionID sessionID) const
+		{
+			uint32_t index = sessionID >> 16;
+			return index < slots_.size() && slots_[index].id == sessionID;
+		}
+
+		int shardIndex_;
+		int numShards_;
+
+		std::vector<Slot> slots_;
+		std::deque<uint32_t> freeSlots_;
+		size_t reservedCount_;
+
+		std::unordered_map< SessionID, std::shared_ptr<Session> > remoteSessions_;
+	};
+
+}
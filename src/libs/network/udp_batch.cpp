@@ -0,0 +1,325 @@
+#include "udp_batch.h"
+#include "udp_uring.h"
+
+#include "log/log.h"
+
+#if P2PCLOUDS_HAS_MMSG
+
+#include <netinet/udp.h>
+
+namespace P2pClouds {
+
+	namespace {
+
+#if defined(UDP_SEGMENT)
+		const size_t GSO_CONTROL_SIZE = CMSG_SPACE(sizeof(uint16_t));
+		const size_t GRO_CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+#else
+		const size_t GSO_CONTROL_SIZE = 0;
+		const size_t GRO_CONTROL_SIZE = 0;
+#endif
+	}
+
+	UdpRecvBatch::UdpRecvBatch(size_t slotSize)
+		: buffers_(MAX_PACKETS)
+		, endpoints_(MAX_PACKETS)
+		, msgs_(MAX_PACKETS)
+		, iovecs_(MAX_PACKETS)
+		, segmentSizes_(MAX_PACKETS, 0)
+		, controls_()
+		, numSlots_(MAX_PACKETS)
+		, gro_(false)
+	{
+		for (int i = 0; i < MAX_PACKETS; ++i)
+			buffers_[i].data_resize(slotSize);
+	}
+
+	UdpRecvBatch::~UdpRecvBatch()
+	{
+	}
+
+	bool UdpRecvBatch::enableGro(int fd)
+	{
+#if defined(UDP_GRO)
+		int on = 1;
+		if (setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0)
+			return false;
+
+		// Coalesced buffers need room for 64KB, fewer but larger slots keep the memory the same order.
+		numSlots_ = GRO_PACKETS;
+		for (int i = 0; i < numSlots_; ++i)
+			buffers_[i].data_resize(GRO_SLOT_SIZE);
+
+		controls_.assign(numSlots_ * GRO_CONTROL_SIZE, 0);
+		gro_ = true;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	int UdpRecvBatch::receive(int fd)
+	{
+		for (int i = 0; i < numSlots_; ++i)
+		{
+			iovecs_[i].iov_base = buffers_[i].data();
+			iovecs_[i].iov_len = buffers_[i].size();
+
+			struct msghdr& hdr = msgs_[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = endpoints_[i].data();
+			hdr.msg_namelen = (socklen_t)endpoints_[i].capacity();
+			hdr.msg_iov = &iovecs_[i];
+			hdr.msg_iovlen = 1;
+
+			if (gro_)
+			{
+				hdr.msg_control = &controls_[i * GRO_CONTROL_SIZE];
+				hdr.msg_controllen = GRO_CONTROL_SIZE;
+			}
+
+			msgs_[i].msg_len = 0;
+		}
+
+		int count = recvmmsg(fd, &msgs_[0], numSlots_, MSG_DONTWAIT, NULL);
+
+		for (int i = 0; i < count; ++i)
+		{
+			struct msghdr& hdr = msgs_[i].msg_hdr;
+			endpoints_[i].resize(hdr.msg_namelen);
+
+			ByteBuffer& datas = buffers_[i];
+			datas.rpos(0);
+
+			// A truncated datagram can not be a valid KCP segment, hand it on empty.
+			datas.wpos((hdr.msg_flags & MSG_TRUNC) ? 0 : (int)msgs_[i].msg_len);
+
+			segmentSizes_[i] = 0;
+
+#if defined(UDP_GRO)
+			if (gro_)
+			{
+				for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+				{
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+					{
+						int segmentSize;
+						memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+						segmentSizes_[i] = (size_t)std::max(segmentSize, 0);
+					}
+				}
+			}
+#endif
+		}
+
+		return count;
+	}
+
+	UdpSendBatch::UdpSendBatch()
+		: arena_(ARENA_SIZE)
+		, arenaUsed_(0)
+		, messages_(MAX_MESSAGES)
+		, endpoints_(MAX_MESSAGES)
+		, msgs_(MAX_MESSAGES)
+		, iovecs_(MAX_MESSAGES)
+		, controls_(MAX_MESSAGES * GSO_CONTROL_SIZE)
+		, count_(0)
+		, datagrams_(0)
+		, dropped_(0)
+		, lastError_(0)
+		, gso_(false)
+	{
+	}
+
+	UdpSendBatch::~UdpSendBatch()
+	{
+	}
+
+	bool UdpSendBatch::enableGso(int fd)
+	{
+#if defined(UDP_SEGMENT)
+		// Kernels without GSO (before 4.18) do not know the option.
+		int segmentSize = 0;
+		socklen_t optlen = sizeof(segmentSize);
+		gso_ = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &optlen) == 0;
+#endif
+		return gso_;
+	}
+
+	bool UdpSendBatch::push(const char *buf, int len, const asio::ip::udp::endpoint& endpoint)
+	{
+		if (arenaUsed_ + len > arena_.size())
+			return false;
+
+		// Messages are laid out back to back, so a datagram appended to the arena extends the last message.
+		// Only the last segment of a GSO message may be shorter than the others.
+		if (gso_ && count_ > 0)
+		{
+			Message& last = messages_[count_ - 1];
+
+			if ((size_t)len <= last.segmentSize && last.length % last.segmentSize == 0 &&
+				last.segments < MAX_GSO_SEGMENTS && last.length + len <= MAX_GSO_BYTES &&
+				endpoints_[count_ - 1] == endpoint)
+			{
+				memcpy(&arena_[arenaUsed_], buf, len);
+				arenaUsed_ += len;
+				last.length += len;
+				++last.segments;
+				++datagrams_;
+				return true;
+			}
+		}
+
+		if (full())
+			return false;
+
+		memcpy(&arena_[arenaUsed_], buf, len);
+
+		Message& message = messages_[count_];
+		message.offset = arenaUsed_;
+		message.length = len;
+		message.segmentSize = (uint16_t)len;
+		message.segments = 1;
+
+		endpoints_[count_] = endpoint;
+		arenaUsed_ += len;
+		++count_;
+		++datagrams_;
+		return true;
+	}
+
+	void UdpSendBatch::prepare()
+	{
+		for (size_t i = 0; i < count_; ++i)
+		{
+			const Message& message = messages_[i];
+
+			iovecs_[i].iov_base = &arena_[message.offset];
+			iovecs_[i].iov_len = message.length;
+
+			struct msghdr& hdr = msgs_[i].msg_hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_name = endpoints_[i].data();
+			hdr.msg_namelen = (socklen_t)endpoints_[i].size();
+			hdr.msg_iov = &iovecs_[i];
+			hdr.msg_iovlen = 1;
+
+#if defined(UDP_SEGMENT)
+			if (message.segments > 1)
+			{
+				hdr.msg_control = &controls_[i * GSO_CONTROL_SIZE];
+				hdr.msg_controllen = GSO_CONTROL_SIZE;
+
+				struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+				cmsg->cmsg_level = SOL_UDP;
+				cmsg->cmsg_type = UDP_SEGMENT;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				memcpy(CMSG_DATA(cmsg), &message.segmentSize, sizeof(uint16_t));
+			}
+#endif
+		}
+	}
+
+	void UdpSendBatch::dropMessage(size_t pos, int error)
+	{
+		// Datagrams are allowed to get lost, KCP resends them.
+		lastError_ = error;
+		dropped_ += messages_[pos].segments;
+
+		// EIO: the device can not checksum segmented packets, resends go out one by one.
+		if (error == EIO && messages_[pos].segments > 1 && gso_)
+		{
+			gso_ = false;
+			LOG_WARNING("UdpSendBatch::flush(): GSO failed, turned off.");
+		}
+	}
+
+	int UdpSendBatch::finish(size_t sent, size_t pos)
+	{
+		if (dropped_ > 0)
+		{
+			LOG_ERROR("UdpSendBatch::flush(): send error: {}, dropped: {}/{}", strerror(lastError_), dropped_, datagrams_);
+		}
+
+		// The kept messages move to the front, in their order, later pushes are appended behind them.
+		size_t start = pos < count_ ? messages_[pos].offset : arenaUsed_;
+		size_t kept = 0;
+
+		datagrams_ = 0;
+
+		for (size_t i = pos; i < count_; ++i, ++kept)
+		{
+			messages_[kept] = messages_[i];
+			messages_[kept].offset -= start;
+			endpoints_[kept] = endpoints_[i];
+			datagrams_ += messages_[kept].segments;
+		}
+
+		if (start < arenaUsed_)
+			memmove(&arena_[0], &arena_[start], arenaUsed_ - start);
+
+		count_ = kept;
+		arenaUsed_ -= start;
+		dropped_ = 0;
+		lastError_ = 0;
+		return (int)sent;
+	}
+
+	int UdpSendBatch::flush(int fd)
+	{
+		prepare();
+
+		size_t pos = 0, sent = 0;
+
+		while (pos < count_)
+		{
+			int ret = sendmmsg(fd, &msgs_[pos], (unsigned int)(count_ - pos), 0);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				// The socket buffer is full, the rest waits for it to drain instead of being dropped.
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+
+				// Skip the failing one and go on.
+				dropMessage(pos, errno);
+				++pos;
+				continue;
+			}
+
+			for (int i = 0; i < ret; ++i)
+				sent += messages_[pos + i].segments;
+
+			pos += ret;
+		}
+
+		return finish(sent, pos);
+	}
+
+#if P2PCLOUDS_HAS_IO_URING
+	int UdpSendBatch::flush(UdpUring& ring)
+	{
+		prepare();
+
+		int results[MAX_MESSAGES];
+		ring.send(&msgs_[0], count_, results);
+
+		size_t sent = 0;
+
+		for (size_t i = 0; i < count_; ++i)
+		{
+			if (results[i] < 0)
+				dropMessage(i, -results[i]);
+			else
+				sent += messages_[i].segments;
+		}
+
+		return finish(sent, count_);
+	}
+#endif
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "common.h"
+
+#if P2PCLOUDS_HAS_MMSG
+
+namespace P2pClouds {
+
+	class UdpUring;
+
+	// Receives up to MAX_PACKETS datagrams with a single recvmmsg() call.
+	// With UDP_GRO the kernel may coalesce datagrams of one flow into a single buffer, see segmentSize().
+	class UdpRecvBatch
+	{
+	public:
+		enum {
+			MAX_PACKETS = 32,
+			GRO_PACKETS = 8,				// a GRO buffer holds up to 64 datagrams already
+			GRO_SLOT_SIZE = 65535
+		};
+
+		UdpRecvBatch(size_t slotSize);
+		virtual ~UdpRecvBatch();
+
+		// Turns on UDP_GRO for the socket, false if the kernel does not support it.
+		bool enableGro(int fd);
+
+		// Non-blocking, returns the number of buffers received or -1 with errno set.
+		int receive(int fd);
+
+		ByteBuffer& buffer(int index) {
+			return buffers_[index];
+		}
+
+		const asio::ip::udp::endpoint& endpoint(int index) const {
+			return endpoints_[index];
+		}
+
+		// Size of the datagrams coalesced into buffer(index) by GRO (the last one may be shorter), 0 if it holds one datagram.
+		size_t segmentSize(int index) const {
+			return segmentSizes_[index];
+		}
+
+	protected:
+		std::vector<ByteBuffer> buffers_;
+		std::vector<asio::ip::udp::endpoint> endpoints_;
+		std::vector<struct mmsghdr> msgs_;
+		std::vector<struct iovec> iovecs_;
+		std::vector<size_t> segmentSizes_;
+		std::vector<char> controls_;
+		int numSlots_;
+		bool gro_;
+	};
+
+	// Collects outgoing datagrams and sends them with as few sendmmsg() calls as possible.
+	// With UDP_SEGMENT (GSO) consecutive datagrams of the same size to one endpoint become a single message,
+	// the kernel or the NIC splits it again.
+	class UdpSendBatch
+	{
+	public:
+		enum {
+			MAX_MESSAGES = 64,
+			ARENA_SIZE = 256 * 1024,
+			MAX_GSO_SEGMENTS = 64,			// UDP_MAX_SEGMENTS of the kernel
+			MAX_GSO_BYTES = 65000			// below the 64KB limit of an IP packet
+		};
+
+		UdpSendBatch();
+		virtual ~UdpSendBatch();
+
+		// Turns on GSO if the kernel supports UDP_SEGMENT.
+		bool enableGso(int fd);
+
+		// Returns false if the batch has no room left, the caller flushes and pushes again.
+		bool push(const char *buf, int len, const asio::ip::udp::endpoint& endpoint);
+
+		// Returns the number of datagrams handed to the kernel. The batch is empty afterwards unless the socket buffer
+		// was full (EAGAIN), the datagrams not taken then stay queued for the next flush once the socket is writable.
+		int flush(int fd);
+
+#if P2PCLOUDS_HAS_IO_URING
+		// Like flush(int), with one SENDMSG per message submitted to ring at once.
+		int flush(UdpUring& ring);
+#endif
+
+		// Number of queued datagrams.
+		size_t size() const {
+			return datagrams_;
+		}
+
+		bool empty() const {
+			return count_ == 0;
+		}
+
+		bool full() const {
+			return count_ == MAX_MESSAGES;
+		}
+
+	protected:
+		struct Message
+		{
+			size_t offset;
+			size_t length;
+			uint16_t segmentSize;
+			uint16_t segments;
+		};
+
+		// Fills msgs_ for the queued messages.
+		void prepare();
+
+		// Counts the datagrams of a message the kernel refused, EIO on a segmented one turns GSO off.
+		void dropMessage(size_t pos, int error);
+
+		// Logs the drops and keeps the messages from pos on, returns the number of datagrams sent.
+		int finish(size_t sent, size_t pos);
+
+		std::vector<char> arena_;
+		size_t arenaUsed_;
+
+		std::vector<Message> messages_;
+		std::vector<asio::ip::udp::endpoint> endpoints_;
+		std::vector<struct mmsghdr> msgs_;
+		std::vector<struct iovec> iovecs_;
+		std::vector<char> controls_;
+		size_t count_;
+		size_t datagrams_;
+		size_t dropped_;
+		int lastError_;
+		bool gso_;
+	};
+
+}
+
+#endif
@@ -0,0 +1,427 @@
+#include "udp_uring.h"
+
+#include "log/log.h"
+
+#if P2PCLOUDS_HAS_IO_URING
+
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace P2pClouds {
+
+	namespace {
+
+#if defined(UDP_GRO)
+		const size_t GRO_CONTROL_SIZE = CMSG_SPACE(sizeof(int));
+#else
+		const size_t GRO_CONTROL_SIZE = 0;
+#endif
+
+		template<typename T>
+		T loadAcquire(const T* p) {
+			return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+		}
+
+		template<typename T>
+		void storeRelease(T* p, T value) {
+			__atomic_store_n(p, value, __ATOMIC_RELEASE);
+		}
+	}
+
+	UdpUring::UdpUring()
+		: ringFd_(-1)
+		, socketFd_(-1)
+		, sqRing_(MAP_FAILED)
+		, sqRingSize_(0)
+		, cqRing_(MAP_FAILED)
+		, cqRingSize_(0)
+		, sqes_(NULL)
+		, sqesSize_(0)
+		, sqHead_(NULL)
+		, sqTail_(NULL)
+		, sqMask_(0)
+		, sqEntries_(0)
+		, sqArray_(NULL)
+		, cqHead_(NULL)
+		, cqTail_(NULL)
+		, cqMask_(0)
+		, cqes_(NULL)
+		, pBufRing_(NULL)
+		, bufRingSize_(0)
+		, bufTail_(0)
+		, recvMsg_()
+		, armed_(false)
+		, buffers_()
+		, received_(MAX_PACKETS)
+		, endpoints_(MAX_PACKETS)
+		, segmentSizes_(MAX_PACKETS, 0)
+		, numReceived_(0)
+		, pendingCqes_()
+	{
+	}
+
+	UdpUring::~UdpUring()
+	{
+		// Closing the ring cancels the receive, the buffers are only freed after that.
+		if (ringFd_ >= 0)
+			close(ringFd_);
+
+		if (pBufRing_)
+			munmap(pBufRing_, bufRingSize_);
+
+		if (sqes_)
+			munmap(sqes_, sqesSize_);
+
+		if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+			munmap(cqRing_, cqRingSize_);
+
+		if (sqRing_ != MAP_FAILED)
+			munmap(sqRing_, sqRingSize_);
+	}
+
+	bool UdpUring::initialize(int fd, size_t slotSize, bool gro)
+	{
+		socketFd_ = fd;
+
+		// Multishot receives post completions without submissions, the CQ gets room for bursts.
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = QUEUE_DEPTH * 8;
+
+		ringFd_ = (int)syscall(__NR_io_uring_setup, QUEUE_DEPTH, &params);
+		if (ringFd_ < 0)
+		{
+			LOG_WARNING("UdpUring::initialize(): io_uring_setup error: {}", strerror(errno));
+			return false;
+		}
+
+		if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+		{
+			LOG_WARNING("UdpUring::initialize(): kernel too old, features={:x}", params.features);
+			return false;
+		}
+
+		sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+		sqRing_ = mmap(NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+		if (sqRing_ == MAP_FAILED)
+			return false;
+
+		cqRing_ = sqRing_;
+
+		sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+		void* sqes = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		sqes_ = (struct io_uring_sqe*)sqes;
+
+		char* sq = (char*)sqRing_;
+		sqHead_ = (unsigned int*)(sq + params.sq_off.head);
+		sqTail_ = (unsigned int*)(sq + params.sq_off.tail);
+		sqMask_ = *(unsigned int*)(sq + params.sq_off.ring_mask);
+		sqEntries_ = *(unsigned int*)(sq + params.sq_off.ring_entries);
+		sqArray_ = (unsigned int*)(sq + params.sq_off.array);
+
+		char* cq = (char*)cqRing_;
+		cqHead_ = (unsigned int*)(cq + params.cq_off.head);
+		cqTail_ = (unsigned int*)(cq + params.cq_off.tail);
+		cqMask_ = *(unsigned int*)(cq + params.cq_off.ring_mask);
+		cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+		// The receive layout: the kernel writes the header, name and control in front of the payload.
+		memset(&recvMsg_, 0, sizeof(recvMsg_));
+		recvMsg_.msg_namelen = sizeof(struct sockaddr_in6);
+		recvMsg_.msg_controllen = gro ? GRO_CONTROL_SIZE : 0;
+
+		size_t numBuffers = gro ? GRO_BUFFERS : NUM_BUFFERS;
+		size_t bufferSize = sizeof(struct io_uring_recvmsg_out) + recvMsg_.msg_namelen + recvMsg_.msg_controllen +
+			(gro ? (size_t)GRO_SLOT_SIZE : slotSize);
+
+		bufRingSize_ = numBuffers * sizeof(struct io_uring_buf);
+		void* bufRing = mmap(NULL, bufRingSize_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (bufRing == MAP_FAILED)
+			return false;
+
+		pBufRing_ = (struct io_uring_buf_ring*)bufRing;
+
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)pBufRing_;
+		reg.ring_entries = (uint32_t)numBuffers;
+		reg.bgid = BUFFER_GROUP;
+
+		if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+		{
+			LOG_WARNING("UdpUring::initialize(): no provided buffer rings: {}", strerror(errno));
+			return false;
+		}
+
+		buffers_.resize(numBuffers);
+		for (size_t i = 0; i < numBuffers; ++i)
+		{
+			buffers_[i].data_resize(bufferSize);
+			recycleBuffer((uint16_t)i);
+		}
+
+		publishBuffers();
+
+		if (!armReceive())
+			return false;
+
+		// An unsupported multishot recvmsg fails right away, during the submission.
+		unsigned int head = *cqHead_;
+		if (head != loadAcquire(cqTail_) && cqes_[head & cqMask_].res == -EINVAL)
+		{
+			LOG_WARNING("UdpUring::initialize(): no multishot recvmsg.");
+			return false;
+		}
+
+		return true;
+	}
+
+	struct io_uring_sqe* UdpUring::getSqe()
+	{
+		unsigned int tail = *sqTail_;
+		if (tail - loadAcquire(sqHead_) >= sqEntries_)
+			return NULL;
+
+		unsigned int index = tail & sqMask_;
+		sqArray_[index] = index;
+
+		struct io_uring_sqe* sqe = &sqes_[index];
+		memset(sqe, 0, sizeof(*sqe));
+
+		storeRelease(sqTail_, tail + 1);
+		return sqe;
+	}
+
+	int UdpUring::enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+	{
+		int ret;
+
+		do
+		{
+			ret = (int)syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, NULL, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		return ret;
+	}
+
+	bool UdpUring::armReceive()
+	{
+		struct io_uring_sqe* sqe = getSqe();
+		if (!sqe)
+			return false;
+
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = socketFd_;
+		sqe->addr = (uint64_t)(uintptr_t)&recvMsg_;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		sqe->user_data = RECV_USER_DATA;
+
+		if (enter(1, 0, 0) < 0)
+		{
+			LOG_ERROR("UdpUring::armReceive(): io_uring_enter error: {}", strerror(errno));
+			return false;
+		}
+
+		armed_ = true;
+		return true;
+	}
+
+	void UdpUring::recycleBuffer(uint16_t bufferID)
+	{
+		// Only the fields of the entry are written, the ring tail shares its memory with the reserved field of entry 0.
+		// The entries are indexed from the start of the ring, in C++ the flexible bufs array of the kernel header
+		// sits behind a one byte placeholder struct and so is off by 8.
+		struct io_uring_buf* pBuf = (struct io_uring_buf*)pBufRing_ + (bufTail_ & (buffers_.size() - 1));
+		pBuf->addr = (uint64_t)(uintptr_t)buffers_[bufferID].data();
+		pBuf->len = (uint32_t)buffers_[bufferID].size();
+		pBuf->bid = bufferID;
+		++bufTail_;
+	}
+
+	void UdpUring::publishBuffers()
+	{
+		storeRelease(&pBufRing_->tail, bufTail_);
+	}
+
+	bool UdpUring::hasCompletions()
+	{
+		return !pendingCqes_.empty() || *cqHead_ != loadAcquire(cqTail_);
+	}
+
+	bool UdpUring::takeReceive(const struct io_uring_cqe& cqe, int count)
+	{
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			armed_ = false;
+
+		if (cqe.res < 0)
+		{
+			// ENOBUFS: every buffer was in use, the receive is armed again once they came back.
+			if (cqe.res != -ENOBUFS)
+				LOG_ERROR("UdpUring::receive(): recvmsg error: {}", strerror(-cqe.res));
+
+			return false;
+		}
+
+		if (!(cqe.flags & IORING_CQE_F_BUFFER))
+			return false;
+
+		uint16_t bufferID = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		ByteBuffer& datas = buffers_[bufferID];
+
+		size_t headerSize = sizeof(struct io_uring_recvmsg_out) + recvMsg_.msg_namelen + recvMsg_.msg_controllen;
+		const struct io_uring_recvmsg_out* pOut = (const struct io_uring_recvmsg_out*)datas.data();
+
+		// A truncated datagram can not be a valid KCP segment.
+		if ((size_t)cqe.res < headerSize || (pOut->flags & MSG_TRUNC) || pOut->namelen > recvMsg_.msg_namelen)
+		{
+			recycleBuffer(bufferID);
+			return false;
+		}
+
+		asio::ip::udp::endpoint& endpoint = endpoints_[count];
+		memcpy(endpoint.data(), datas.data() + sizeof(struct io_uring_recvmsg_out), pOut->namelen);
+		endpoint.resize(pOut->namelen);
+
+		segmentSizes_[count] = 0;
+
+#if defined(UDP_GRO)
+		if (recvMsg_.msg_controllen > 0 && pOut->controllen > 0)
+		{
+			// The cmsg macros only look at msg_control and msg_controllen.
+			struct msghdr hdr;
+			memset(&hdr, 0, sizeof(hdr));
+			hdr.msg_control = datas.data() + sizeof(struct io_uring_recvmsg_out) + recvMsg_.msg_namelen;
+			hdr.msg_controllen = pOut->controllen;
+
+			for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				{
+					int segmentSize;
+					memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+					segmentSizes_[count] = (size_t)std::max(segmentSize, 0);
+				}
+			}
+		}
+#endif
+
+		datas.rpos((int)headerSize);
+		datas.wpos((int)(headerSize + pOut->payloadlen));
+
+		received_[count] = bufferID;
+		return true;
+	}
+
+	int UdpUring::receive()
+	{
+		for (int i = 0; i < numReceived_; ++i)
+			recycleBuffer(received_[i]);
+
+		int count = 0;
+
+		while (count < MAX_PACKETS && !pendingCqes_.empty())
+		{
+			if (takeReceive(pendingCqes_.front(), count))
+				++count;
+
+			pendingCqes_.pop_front();
+		}
+
+		unsigned int head = *cqHead_;
+		unsigned int tail = loadAcquire(cqTail_);
+
+		while (count < MAX_PACKETS && head != tail)
+		{
+			const struct io_uring_cqe& cqe = cqes_[head & cqMask_];
+			if (cqe.user_data == RECV_USER_DATA && takeReceive(cqe, count))
+				++count;
+
+			++head;
+		}
+
+		storeRelease(cqHead_, head);
+
+		numReceived_ = count;
+		publishBuffers();
+
+		if (!armed_)
+			armReceive();
+
+		return count;
+	}
+
+	void UdpUring::send(struct mmsghdr* msgs, size_t count, int* results)
+	{
+		size_t submitted = 0;
+
+		for (; submitted < count; ++submitted)
+		{
+			struct io_uring_sqe* sqe = getSqe();
+			if (!sqe)
+				break;
+
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = socketFd_;
+			sqe->addr = (uint64_t)(uintptr_t)&msgs[submitted].msg_hdr;
+			sqe->len = 1;
+			sqe->msg_flags = MSG_DONTWAIT;
+			sqe->user_data = submitted;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+			results[i] = i < submitted ? -EIO : -EBUSY;
+
+		if (submitted == 0)
+			return;
+
+		if (enter((unsigned int)submitted, (unsigned int)submitted, IORING_ENTER_GETEVENTS) < 0)
+		{
+			LOG_ERROR("UdpUring::send(): io_uring_enter error: {}", strerror(errno));
+			return;
+		}
+
+		// Completions of the receive that come in between are kept for the next receive().
+		size_t done = 0;
+		while (done < submitted)
+		{
+			unsigned int head = *cqHead_;
+			unsigned int tail = loadAcquire(cqTail_);
+
+			for (; head != tail; ++head)
+			{
+				const struct io_uring_cqe& cqe = cqes_[head & cqMask_];
+				if (cqe.user_data == RECV_USER_DATA)
+				{
+					pendingCqes_.push_back(cqe);
+					continue;
+				}
+
+				results[cqe.user_data] = cqe.res;
+				++done;
+			}
+
+			storeRelease(cqHead_, head);
+
+			if (done < submitted && enter(0, (unsigned int)(submitted - done), IORING_ENTER_GETEVENTS) < 0)
+			{
+				LOG_ERROR("UdpUring::send(): io_uring_enter error: {}", strerror(errno));
+				return;
+			}
+		}
+	}
+
+}
+
+#endif
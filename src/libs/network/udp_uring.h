@@ -0,0 +1,125 @@
+#pragma once
+
+#include "common.h"
+
+#if P2PCLOUDS_HAS_IO_URING
+
+#include <linux/io_uring.h>
+
+namespace P2pClouds {
+
+	/*
+		UDP transport on io_uring, used by a NetworkInterface created with NetTransportUring.
+
+		Receiving is one multishot RECVMSG that stays armed: the kernel picks a buffer from a ring of
+		provided buffers for every datagram and posts one completion, there is nothing to re-arm per
+		datagram. receive() hands out the completed buffers in place (rpos at the payload) and gives
+		those of the previous call back to the kernel first.
+		Sending submits one SENDMSG per message of a UdpSendBatch with a single io_uring_enter(),
+		MSG_DONTWAIT makes a full socket buffer fail fast like sendmmsg() instead of waiting.
+
+		The ring fd is readable while completions are queued, the owner watches it with asio.
+		The syscalls are used directly, liburing is not needed. Needs Linux 6.0 (multishot recvmsg),
+		initialize() fails on older kernels and the NetworkInterface stays on the asio reactor.
+	*/
+	class UdpUring
+	{
+	public:
+		enum {
+			QUEUE_DEPTH = 256,
+			MAX_PACKETS = 32,			// datagrams handed out per receive()
+			NUM_BUFFERS = 256,			// power of two, a requirement of buffer rings
+			GRO_BUFFERS = 32,			// a GRO buffer holds up to 64 datagrams already
+			GRO_SLOT_SIZE = 65535,
+			BUFFER_GROUP = 0
+		};
+
+		UdpUring();
+		virtual ~UdpUring();
+
+		// Sets up the ring for the socket fd and arms the receive, false if the kernel lacks one of the features.
+		// With gro the socket has UDP_GRO on, see segmentSize().
+		bool initialize(int fd, size_t slotSize, bool gro);
+
+		int ringFd() const {
+			return ringFd_;
+		}
+
+		// Non-blocking, returns the number of datagrams received.
+		int receive();
+
+		// True while completions are left that receive() did not hand out yet.
+		bool hasCompletions();
+
+		ByteBuffer& buffer(int index) {
+			return buffers_[received_[index]];
+		}
+
+		const asio::ip::udp::endpoint& endpoint(int index) const {
+			return endpoints_[index];
+		}
+
+		// Size of the datagrams coalesced into buffer(index) by GRO (the last one may be shorter), 0 if it holds one datagram.
+		size_t segmentSize(int index) const {
+			return segmentSizes_[index];
+		}
+
+		// Sends the messages with one submission and waits for them, results[i] is what sendmsg() returned or -errno.
+		void send(struct mmsghdr* msgs, size_t count, int* results);
+
+	protected:
+		enum { RECV_USER_DATA = 0xffffffffffffffffull };
+
+		struct io_uring_sqe* getSqe();
+		int enter(unsigned int toSubmit, unsigned int minComplete, unsigned int flags);
+
+		bool armReceive();
+		void recycleBuffer(uint16_t bufferID);
+		void publishBuffers();
+
+		// Turns a receive completion into received_[count], false if it holds no datagram.
+		bool takeReceive(const struct io_uring_cqe& cqe, int count);
+
+	protected:
+		int ringFd_;
+		int socketFd_;
+
+		void* sqRing_;
+		size_t sqRingSize_;
+		void* cqRing_;
+		size_t cqRingSize_;
+		struct io_uring_sqe* sqes_;
+		size_t sqesSize_;
+
+		unsigned int* sqHead_;
+		unsigned int* sqTail_;
+		unsigned int sqMask_;
+		unsigned int sqEntries_;
+		unsigned int* sqArray_;
+
+		unsigned int* cqHead_;
+		unsigned int* cqTail_;
+		unsigned int cqMask_;
+		struct io_uring_cqe* cqes_;
+
+		struct io_uring_buf_ring* pBufRing_;
+		size_t bufRingSize_;
+		uint16_t bufTail_;
+
+		// The layout of every receive buffer: io_uring_recvmsg_out, name, control, payload.
+		struct msghdr recvMsg_;
+		bool armed_;
+
+		std::vector<ByteBuffer> buffers_;
+		std::vector<uint16_t> received_;
+		std::vector<asio::ip::udp::endpoint> endpoints_;
+		std::vector<size_t> segmentSizes_;
+		int numReceived_;
+
+		// Receive completions reaped while waiting for sends.
+		std::deque<struct io_uring_cqe> pendingCqes_;
+	};
+
+}
+
+#endif